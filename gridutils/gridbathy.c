@@ -51,6 +51,7 @@ enum { CSA = 0, NN_SIBSON = 1, NN_NONSIBSONIAN = 2, LINEAR = 3, AVERAGE = 4 } ru
 
 int linear = 0;
 int indexspace = 0;
+char* indexfname = NULL;
 
 /**
  */
@@ -69,6 +70,7 @@ static void usage()
     printf("                   [-c <i> <j>]\n");
     printf("                   [-i <node type>]\n");
     printf("                   [-m <mask file>]\n");
+    printf("                   [-M <index file>]\n");
     printf("                   [-n <points per edge>]\n");
     printf("                   [-r <min depth> <max depth>]\n");
     printf("                   [-v]\n");
@@ -87,6 +89,7 @@ static void info()
     printf("                   [-c <i> <j>]\n");
     printf("                   [-i <node type>]\n");
     printf("                   [-m <mask file>]\n");
+    printf("                   [-M <index file>]\n");
     printf("                   [-n <points per edge>]\n");
     printf("                   [-r <min depth> <max depth>]\n");
     printf("                   [-v]\n");
@@ -107,6 +110,11 @@ static void info()
     printf("                            CO -- cell corner\n");
     printf("    -m <mask file>       -- text file with nce1 x nce2 lines containing \"0\" or \"1\"\n");
     printf("                            (use \"stdin\" or \"-\" for standard input)\n");
+    printf("    -M <index file>      -- load the grid map from this file if it has been saved\n");
+    printf("                            for the same grid and node type; otherwise build the\n");
+    printf("                            map and save it to this file; set GRIDMAP_VERIFY=1\n");
+    printf("                            in the environment to verify the checksum of the\n");
+    printf("                            whole file on loading\n");
     printf("    -n <points per edge> -- number of points per cell edge (default = 3)\n");
     printf("    -r <min> <max>       -- depth range (default = -infty +infty)\n");
     printf("    -v                   -- verbose / version\n");
@@ -253,6 +261,13 @@ static void parse_commandline(int argc, char* argv[], char** bathyfname, char**
             *maskfname = argv[i];
             i++;
             break;
+        case 'M':
+            i++;
+            if (i == argc)
+                gu_quit("no file name found after \"-M\"");
+            indexfname = argv[i];
+            i++;
+            break;
         case 'n':
             i++;
             if (i >= argc)
@@ -369,31 +384,53 @@ int main(int argc, char* argv[])
         gn = newgn;
     }
     /*
-     * build the grid map for physical <-> index space conversions
+     * build the grid map for physical <-> index space conversions (or load
+     * it from the index file)
      */
-    gm = gridmap_build(gridnodes_getnce1(gn), gridnodes_getnce2(gn), gridnodes_getx(gn), gridnodes_gety(gn), gridnodes_getmaptype(gn));
+    if (indexfname != NULL) {
+        int maptype = gridnodes_getmaptype(gn);
+        uint64_t checksum;
+
+        if (strcmp(gridfname, "stdin") == 0 || strcmp(gridfname, "-") == 0)
+            gu_quit("can not use grid map index file with the grid read from standard input");
+        checksum = gu_checksum(0, &nt, sizeof(nt));
+        checksum = gu_checksum(checksum, &maptype, sizeof(maptype));
+        checksum = gu_checksumfile(checksum, gridfname);
+        gm = gridmap_load(indexfname, checksum);
+        if (gm == NULL) {
+            gm = gridmap_build(gridnodes_getnce1(gn), gridnodes_getnce2(gn), gridnodes_getx(gn), gridnodes_gety(gn), maptype);
+            gridmap_save(gm, indexfname, checksum);
+        }
+    } else
+        gm = gridmap_build(gridnodes_getnce1(gn), gridnodes_getnce2(gn), gridnodes_getx(gn), gridnodes_gety(gn), gridnodes_getmaptype(gn));
 
     /*
      * convert bathymetry to index space if necessary 
      */
     if (indexspace) {
         point* newpbathy = malloc(nbathy * sizeof(point));
+        double* ic = malloc(nbathy * sizeof(double));
+        double* jc = malloc(nbathy * sizeof(double));
+        int* status = malloc(nbathy * sizeof(int));
         int newnbathy = 0;
         int ii;
 
+        (void) gridmap_xy2fij_batch(gm, nbathy, &pbathy[0].x, &pbathy[0].y, sizeof(point) / sizeof(double), ic, jc, status);
+
         for (ii = 0; ii < nbathy; ++ii) {
-            point* p = &pbathy[ii];
             point* newp = &newpbathy[newnbathy];
-            double ic, jc;
 
-            if (gridmap_xy2fij(gm, p->x, p->y, &ic, &jc)) {
-                newp->x = ic;
-                newp->y = jc;
-                newp->z = p->z;
+            if (status[ii]) {
+                newp->x = ic[ii];
+                newp->y = jc[ii];
+                newp->z = pbathy[ii].z;
                 newnbathy++;
             }
         }
 
+        free(status);
+        free(jc);
+        free(ic);
         free(pbathy);
         pbathy = newpbathy;
         nbathy = newnbathy;
@@ -33,27 +33,122 @@
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <float.h>
+#include <assert.h>
 #include "poly.h"
 #include "gridbmap.h"
 #include "gucommon.h"
 
 #define EPS_COMPACT 1.0e-10
+#define EPS_SIDE 1.0e-9         /* tolerance of the side-of-cut test
+                                 * relative to the size of the node */
+#define NINDEXMIN 64            /* minimal number of boundary vertices of a
+                                 * tree node for building an edge index of
+                                 * the boundary */
+#define NCUTMIN 16              /* minimal number of cut vertices of a tree
+                                 * node for keeping the cut coordinates */
+#define NHASHMIN 32             /* minimal number of boundary vertices of a
+                                 * subgrid for hashing them when cutting the
+                                 * boundary */
+#define NCELLS_TASK 4096        /* minimal subgrid size (in cells) for
+                                 * dividing its halves in parallel */
 
 typedef struct subgrid {
     gridbmap* gmap;              /* gridf map this subgrid belongs to */
     poly* bound;                /* boundary polygon */
+    int* ids;                   /* numbers of the grid nodes of the
+                                 * boundary vertices, j * (nce1 + 1) + i
+                                 * [bound->n] */
     int mini;                   /* minimal i index within the subgrid */
     int maxi;                   /* maximal i index within the subgrid */
     int minj;                   /* minimal j index within the subgrid */
     int maxj;                   /* maximal j index within the subgrid */
+    int ncut;                   /* number of vertices of the cut between
+                                 * the halves if it is monotone in X or Y
+                                 * (see subgrid_setcut()); 0 if the
+                                 * side-of-cut test can not be used */
+    int cuti;                   /* i index of the first cut vertex */
+    int cutj;                   /* j index of the first cut vertex */
+    int cutdi;                  /* i increment between the cut vertices */
+    int cutdj;                  /* j increment between the cut vertices */
+    int cutaxis;                /* 0 if the cut is monotone in X, 1 if it
+                                 * is monotone in Y */
+    int cutside;                /* 1 if half 1 lies on the side of greater
+                                 * Y (X for cutaxis = 1) of the cut; -1
+                                 * otherwise */
     struct subgrid* half1;      /* child 1 */
     struct subgrid* half2;      /* child 2 */
 } subgrid;
 
+/*
+ * Node of the binary tree after it has been built. The nodes are stored in
+ * one array in breadth-first order, so that the two children of a node are
+ * adjacent. The boundaries of all nodes are stored in one vertex pool as
+ * numbers of grid nodes, j * (nce1 + 1) + i; the cut between the children
+ * runs along a grid line and is given by its first vertex and direction.
+ */
+typedef struct {
+    extent e;                   /* bounding rectangle of the boundary */
+    size_t offset;              /* start of the boundary in the vertex pool */
+    int n;                      /* number of boundary vertices */
+    int child;                  /* index of child 1 (child 2 follows it); 0
+                                 * for a leaf */
+    int mini;                   /* minimal i index within the subgrid */
+    int maxi;                   /* maximal i index within the subgrid */
+    int minj;                   /* minimal j index within the subgrid */
+    int maxj;                   /* maximal j index within the subgrid */
+    int ncut;                   /* number of vertices of the cut between
+                                 * the children; 0 if the side-of-cut test
+                                 * is not used */
+    int cuti;                   /* see subgrid */
+    int cutj;                   /* see subgrid */
+    signed char cutdi;          /* see subgrid */
+    signed char cutdj;          /* see subgrid */
+    signed char cutaxis;        /* see subgrid */
+    signed char cutside;        /* see subgrid */
+} bnode;
+
+/*
+ * Cut between the children of a tree node, monotone along an axis. Vertex
+ * k of the cut is grid node (i + k * di, j + k * dj); the vertices are
+ * ordered by increasing coordinate along the axis.
+ */
+typedef struct {
+    double** gu;                /* grid node coordinates along the axis */
+    double** gv;                /* other grid node coordinates */
+    int n;                      /* number of vertices */
+    int i;                      /* i index of the first vertex */
+    int j;                      /* j index of the first vertex */
+    int di;                     /* i increment between the vertices */
+    int dj;                     /* j increment between the vertices */
+    double* us;                 /* coordinates of the vertices along the
+                                 * axis (or NULL) [n] */
+    double* vs;                 /* other coordinates of the vertices (or
+                                 * NULL) [n] */
+} gridcut;
+
 struct gridbmap {
-    poly* bound;                /* boundary polygon */
-    subgrid* trunk;             /* binary tree trunk */
-    int nleaves;                /* for debugging purposes */
+    int nleaves;                /* number of tree nodes */
+    bnode* nodes;               /* tree nodes [nleaves] */
+    size_t nvertices;           /* number of vertices in the pool */
+    size_t nallocated;          /* number of vertices allocated */
+    size_t nunused;             /* number of vertices in the pool no longer
+                                 * used by the nodes (after updates) */
+    int* vertices;              /* vertex pool [nallocated] */
+    polyindex** indices;        /* edge indices of the node boundaries with
+                                 * NINDEXMIN vertices or more; NULL for
+                                 * other nodes [nleaves] */
+    double** coords;            /* coordinates of the boundaries with edge
+                                 * indices (n X coordinates followed by n Y
+                                 * coordinates); NULL for other nodes
+                                 * [nleaves] */
+    double** cuts;              /* coordinates of the cuts with NCUTMIN
+                                 * vertices or more (ncut coordinates
+                                 * along the axis followed by ncut other
+                                 * coordinates); NULL for other nodes
+                                 * [nleaves] */
+    int attached;               /* flag: the nodes and the vertex pool
+                                 * belong to a mapped index file */
     int nce1;                   /* number of cells in e1 direction */
     int nce2;                   /* number of cells in e2 direction */
     double** gx;                /* reference to array of X coords
@@ -65,69 +160,35 @@ struct gridbmap {
 /** Creates a subgrid.
  * @param gm Grid map
  * @param pl Boundary polygon for the subgrid
- * @param mini Minimal i index within the subgrid
- * @param maxi Maximal i index within the subgrid
- * @param minj Minimal j index within the subgrid
- * @param maxj Maximal j index within the subgrid
+ * @param ids Numbers of the grid nodes of the boundary vertices
  * @return Subgrid
  */
-static subgrid* subgrid_create(gridbmap* gm, poly* pl, int i1, int i2, int j1, int j2)
+static subgrid* subgrid_create(gridbmap* gm, poly* pl, int* ids)
 {
     subgrid* l = malloc(sizeof(subgrid));
-
-    double** gx = gm->gx;
-    double** gy = gm->gy;
     int n = pl->n;
-    double x, y;
-    int i = i1;                 /* to eliminate warning */
-    int j, ii;
+    int ii;
 
     l->bound = pl;
+    l->ids = ids;
     l->gmap = gm;
     l->mini = INT_MAX;
     l->maxi = INT_MIN;
     l->minj = INT_MAX;
     l->maxj = INT_MIN;
+    l->ncut = 0;
+    l->cuti = 0;
+    l->cutj = 0;
+    l->cutdi = 0;
+    l->cutdj = 0;
+    l->cutaxis = 0;
+    l->cutside = 0;
     l->half1 = NULL;
     l->half2 = NULL;
 
-    if (n == 0)
-        return l;
-
-    x = pl->x[0];
-    y = pl->y[0];
-
-    for (j = j1; j <= j2; ++j)
-        for (i = i1; i <= i2; ++i)
-            if (x == gx[j][i] && y == gy[j][i])
-                goto aftersearch;
-
-  aftersearch:
-
-    if (j > j2)
-        gu_quit("subgrid_create(): boundary vertex not in the grid");
-
-    l->mini = i;
-    l->maxi = i;
-    l->minj = j;
-    l->maxj = j;
-
-    for (ii = 1; ii < n; ++ii) {
-        x = pl->x[ii];
-        y = pl->y[ii];
-
-        if (i > i1 && x == gx[j][i - 1] && y == gy[j][i - 1])
-            i--;
-        else if (i < i2 && x == gx[j][i + 1] && y == gy[j][i + 1])
-            i++;
-        else if (j > j1 && x == gx[j - 1][i] && y == gy[j - 1][i])
-            j--;
-        else if (j < j2 && x == gx[j + 1][i] && y == gy[j + 1][i])
-            j++;
-        else if (x == gx[j][i] && y == gy[j][i])
-            continue;
-        else
-            gu_quit("subgrid_create(): boundary vertex not in the grid");
+    for (ii = 0; ii < n; ++ii) {
+        int i = ids[ii] % (gm->nce1 + 1);
+        int j = ids[ii] / (gm->nce1 + 1);
 
         if (l->mini > i)
             l->mini = i;
@@ -142,6 +203,26 @@ static subgrid* subgrid_create(gridbmap* gm, poly* pl, int i1, int i2, int j1, i
     return l;
 }
 
+/** Creates the subgrid for the whole grid.
+ * @param gm Grid map
+ * @return Subgrid
+ */
+static subgrid* subgrid_createtrunk(gridbmap* gm)
+{
+    poly* bound = poly_formbound(gm->nce1, gm->nce2, gm->gx, gm->gy);
+    poly* boundij = poly_formboundij(gm->nce1, gm->nce2, gm->gx);
+    int* ids = malloc(bound->n * sizeof(int));
+    int ii;
+
+    if (boundij->n != bound->n)
+        gu_quit("subgrid_createtrunk(): could not form the grid boundary");
+    for (ii = 0; ii < bound->n; ++ii)
+        ids[ii] = (int) boundij->y[ii] * (gm->nce1 + 1) + (int) boundij->x[ii];
+    poly_destroy(boundij);
+
+    return subgrid_create(gm, bound, ids);
+}
+
 /** Destroys a subgrid.
  * @param l Subgrid
  */
@@ -152,6 +233,7 @@ static void subgrid_destroy(subgrid* l)
     if (l->half2 != NULL)
         subgrid_destroy(l->half2);
     poly_destroy(l->bound);
+    free(l->ids);
     free(l);
 }
 
@@ -160,18 +242,27 @@ static void subgrid_destroy(subgrid* l)
  * ([changes][fixed]) in index space; the physical nodes are given by
  * input double arrays; first two intersections of the cutting polyline
  * with the polygon are used to form the new polygons.
+ * The grid nodes of the vertices of the new polygons are tracked, so that
+ * subgrid_create() does not need to search for them.
+ * @param gm Grid map
  * @param pl Original polygon
- * @param gx Array of x cell corner coordinates
- * @param gy Array of y cell corner coordinates
+ * @param ids Numbers of the grid nodes of the vertices of `pl'
  * @param horiz flag: 1 for horizontal cut; 0 otherwise
  * @param index Value of "fixed" index
  * @param start Start value of "variable" index
  * @param end End value of "variable" index
  * @param pl1 Output polygon 1
- * @param pl1 Output polygon 2
+ * @param ids1 Output numbers of the grid nodes of the vertices of `pl1'
+ * @param pl2 Output polygon 2
+ * @param ids2 Output numbers of the grid nodes of the vertices of `pl2'
+ * @param cut Output cut along the grid line (from the first intersection
+ *            to the second one)
  */
-static void cut_boundary(poly* pl, double** gx, double** gy, int horiz, int index, int start, int end, poly** pl1, poly** pl2)
+static void cut_boundary(gridbmap* gm, poly* pl, int* ids, int horiz, int index, int start, int end, poly** pl1, int** ids1, poly** pl2, int** ids2, gridcut* cut)
 {
+    double** gx = gm->gx;
+    double** gy = gm->gy;
+    int stride = gm->nce1 + 1;
     int n = pl->n;
     int i = -1;
     int i1 = -1;                /* array index of the first intersection */
@@ -186,6 +277,9 @@ static void cut_boundary(poly* pl, double** gx, double** gy, int horiz, int inde
     if (poly_isclosed(pl, 1.0e-15))
         n--;
 
+    if (n >= NHASHMIN)
+        poly_buildhash(pl);
+
     if (horiz) {                /* horizontal cut */
         /*
          * find first intersection 
@@ -245,28 +339,44 @@ static void cut_boundary(poly* pl, double** gx, double** gy, int horiz, int inde
          */
         *pl1 = poly_create();
         *pl2 = poly_create();
+        *ids1 = malloc(((ii2 - ii1 + n) % n + i2 - i1) * sizeof(int));
+        *ids2 = malloc(((ii1 - ii2 + n) % n + i2 - i1) * sizeof(int));
 
         /*
          * add the portion of perimeter 
          */
-        for (i = ii1; i != ii2; i = (i + 1) % n)
+        for (i = ii1; i != ii2; i = (i + 1) % n) {
+            (*ids1)[(*pl1)->n] = ids[i];
             poly_addpoint(*pl1, pl->x[i], pl->y[i]);
+        }
         /*
          * add the cutting section 
          */
-        for (i = i2; i > i1; --i)
+        for (i = i2; i > i1; --i) {
+            (*ids1)[(*pl1)->n] = index * stride + i;
             poly_addpoint(*pl1, gx[index][i], gy[index][i]);
+        }
 
         /*
          * add the portion of perimeter 
          */
-        for (i = ii2; i != ii1; i = (i + 1) % n)
+        for (i = ii2; i != ii1; i = (i + 1) % n) {
+            (*ids2)[(*pl2)->n] = ids[i];
             poly_addpoint(*pl2, pl->x[i], pl->y[i]);
+        }
         /*
          * add the cutting section 
          */
-        for (i = i1; i < i2; ++i)
+        for (i = i1; i < i2; ++i) {
+            (*ids2)[(*pl2)->n] = index * stride + i;
             poly_addpoint(*pl2, gx[index][i], gy[index][i]);
+        }
+
+        cut->n = i2 - i1 + 1;
+        cut->i = i1;
+        cut->j = index;
+        cut->di = 1;
+        cut->dj = 0;
 
     } else {                    /* vertical cut */
         for (i = start; i < end; ++i) {
@@ -296,16 +406,32 @@ static void cut_boundary(poly* pl, double** gx, double** gy, int horiz, int inde
 
         *pl1 = poly_create();
         *pl2 = poly_create();
+        *ids1 = malloc(((ii2 - ii1 + n) % n + i2 - i1) * sizeof(int));
+        *ids2 = malloc(((ii1 - ii2 + n) % n + i2 - i1) * sizeof(int));
 
-        for (i = ii1; i != ii2; i = (i + 1) % n)
+        for (i = ii1; i != ii2; i = (i + 1) % n) {
+            (*ids1)[(*pl1)->n] = ids[i];
             poly_addpoint(*pl1, pl->x[i], pl->y[i]);
-        for (i = i2; i > i1; --i)
+        }
+        for (i = i2; i > i1; --i) {
+            (*ids1)[(*pl1)->n] = i * stride + index;
             poly_addpoint(*pl1, gx[i][index], gy[i][index]);
+        }
 
-        for (i = ii2; i != ii1; i = (i + 1) % n)
+        for (i = ii2; i != ii1; i = (i + 1) % n) {
+            (*ids2)[(*pl2)->n] = ids[i];
             poly_addpoint(*pl2, pl->x[i], pl->y[i]);
-        for (i = i1; i < i2; ++i)
+        }
+        for (i = i1; i < i2; ++i) {
+            (*ids2)[(*pl2)->n] = i * stride + index;
             poly_addpoint(*pl2, gx[i][index], gy[i][index]);
+        }
+
+        cut->n = i2 - i1 + 1;
+        cut->i = index;
+        cut->j = i1;
+        cut->di = 0;
+        cut->dj = 1;
         /*
          * There used to be closure of the polylines here:
          *        poly_close(*pl1);
@@ -318,66 +444,490 @@ static void cut_boundary(poly* pl, double** gx, double** gy, int horiz, int inde
     }
 }
 
+/** Gets the coordinate of a cut vertex along the axis of monotonicity.
+ * @param c Cut
+ * @param k Vertex
+ * @return Coordinate
+ */
+static double gridcut_u(gridcut* c, int k)
+{
+    if (c->us != NULL)
+        return c->us[k];
+    return c->gu[c->j + k * c->dj][c->i + k * c->di];
+}
+
+/** Gets the coordinate of a cut vertex across the axis of monotonicity.
+ * @param c Cut
+ * @param k Vertex
+ * @return Coordinate
+ */
+static double gridcut_v(gridcut* c, int k)
+{
+    if (c->vs != NULL)
+        return c->vs[k];
+    return c->gv[c->j + k * c->dj][c->i + k * c->di];
+}
+
+/** Finds the segment of a monotone cut containing a given coordinate.
+ * @param c Cut
+ * @param u Coordinate along the axis of monotonicity
+ * @return Index of the last vertex with u_k <= u; -1 if u < u_0
+ */
+static int gridcut_find(gridcut* c, double u)
+{
+    int lo = -1;
+    int hi = c->n;
+
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+
+        if (gridcut_u(c, mid) <= u)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/** Evaluates a monotone cut as function v(u). Beyond the ends of the cut
+ * the function is extended by constants.
+ * @param c Cut
+ * @param u Coordinate along the axis of monotonicity
+ * @return Other coordinate of the (extended) cut at u
+ */
+static double gridcut_eval(gridcut* c, double u)
+{
+    int k = gridcut_find(c, u);
+    double u0, u1;
+
+    if (k < 0)
+        return gridcut_v(c, 0);
+    if (k >= c->n - 1)
+        return gridcut_v(c, c->n - 1);
+    u0 = gridcut_u(c, k);
+    u1 = gridcut_u(c, k + 1);
+    return gridcut_v(c, k) + (u - u0) * (gridcut_v(c, k + 1) - gridcut_v(c, k)) / (u1 - u0);
+}
+
+/** Finds the side of a monotone cut (extended by constants beyond its
+ * ends) a straight edge lies on. As the distance between the edge and the
+ * cut is linear between the cut vertices, it is checked at the ends of the
+ * edge and at the cut vertices within the edge's range only.
+ * @param c Cut
+ * @param ua Coordinate of the edge start along the axis
+ * @param va Other coordinate of the edge start
+ * @param ub Coordinate of the edge end along the axis
+ * @param vb Other coordinate of the edge end
+ * @param skipa Flag: do not check the edge start (an end of the cut)
+ * @param skipb Flag: do not check the edge end (an end of the cut)
+ * @param eps Tolerance
+ * @return 1 if the edge lies on the side of greater v by more than eps; -1
+ *         if it lies on the other side by more than eps; 0 otherwise
+ */
+static int gridcut_edgeside(gridcut* c, double ua, double va, double ub, double vb, int skipa, int skipb, double eps)
+{
+    double dmin = DBL_MAX;
+    double dmax = -DBL_MAX;
+    int k;
+
+    if (!skipa) {
+        double d = va - gridcut_eval(c, ua);
+
+        dmin = (d < dmin) ? d : dmin;
+        dmax = (d > dmax) ? d : dmax;
+    }
+    if (!skipb) {
+        double d = vb - gridcut_eval(c, ub);
+
+        dmin = (d < dmin) ? d : dmin;
+        dmax = (d > dmax) ? d : dmax;
+    }
+    if (ua != ub) {
+        double umin = (ua < ub) ? ua : ub;
+        double umax = (ua < ub) ? ub : ua;
+
+        for (k = gridcut_find(c, umin) + 1; k < c->n && gridcut_u(c, k) < umax; ++k) {
+            double u = gridcut_u(c, k);
+            double d;
+
+            if (u == umin)
+                continue;
+            d = va + (u - ua) * (vb - va) / (ub - ua) - gridcut_v(c, k);
+            dmin = (d < dmin) ? d : dmin;
+            dmax = (d > dmax) ? d : dmax;
+        }
+    }
+
+    if (dmin > dmax)
+        return 0;
+    if (dmin > eps)
+        return 1;
+    if (dmax < -eps)
+        return -1;
+    return 0;
+}
+
+/** Sets up the side-of-cut test for a divided subgrid. If the cut is
+ * monotone in X or Y, it is extended beyond its ends by straight rays
+ * parallel to this axis, which divides the plane in two. If the two arcs
+ * of the subgrid boundary separated by the cut lie strictly on different
+ * sides of the extended cut, then so do the halves of the subgrid, and a
+ * point inside the subgrid belongs to the half on its side of the cut.
+ * @param sg Subgrid
+ * @param pl1 Boundary of half 1 (the boundary arc from the first to the
+ *            second intersection followed by the cut)
+ * @param pl2 Boundary of half 2 (the boundary arc from the second to the
+ *            first intersection followed by the cut)
+ * @param cut Cut (from the first intersection to the second one)
+ */
+static void subgrid_setcut(subgrid* sg, poly* pl1, poly* pl2, gridcut* cut)
+{
+    gridbmap* gm = sg->gmap;
+    extent* e = &sg->bound->e;
+    double eps = EPS_SIDE * (e->xmax - e->xmin + e->ymax - e->ymin);
+    int m = cut->n;
+    int sides[2];
+    int axis, h, k;
+
+    for (axis = 0; axis < 2; ++axis) {
+        cut->gu = (axis == 0) ? gm->gx : gm->gy;
+        cut->gv = (axis == 0) ? gm->gy : gm->gx;
+
+        for (k = 1; k < m && gridcut_u(cut, k) > gridcut_u(cut, k - 1); ++k);
+        if (k == m)
+            break;
+        for (k = 1; k < m && gridcut_u(cut, k) < gridcut_u(cut, k - 1); ++k);
+        if (k == m) {
+            cut->i += (m - 1) * cut->di;
+            cut->j += (m - 1) * cut->dj;
+            cut->di = -cut->di;
+            cut->dj = -cut->dj;
+            break;
+        }
+    }
+    if (axis == 2)
+        return;
+
+    for (h = 0; h < 2; ++h) {
+        poly* pl = (h == 0) ? pl1 : pl2;
+        double* pu = (axis == 0) ? pl->x : pl->y;
+        double* pv = (axis == 0) ? pl->y : pl->x;
+        int na = pl->n - m + 1;  /* number of edges in the arc */
+
+        sides[h] = 0;
+        for (k = 0; k < na; ++k) {
+            int side = gridcut_edgeside(cut, pu[k], pv[k], pu[k + 1], pv[k + 1], k == 0, k == na - 1, eps);
+
+            if (side == 0 || (k > 0 && side != sides[h])) {
+                sides[h] = 0;
+                break;
+            }
+            sides[h] = side;
+        }
+    }
+    if (sides[0] == 0 || sides[1] != -sides[0])
+        return;
+
+    sg->ncut = m;
+    sg->cuti = cut->i;
+    sg->cutj = cut->j;
+    sg->cutdi = cut->di;
+    sg->cutdj = cut->dj;
+    sg->cutaxis = axis;
+    sg->cutside = sides[0];
+}
+
 /* Divides a subgrid in two.
  * @param sg The subgrid to divide
  * @param subgrid1 Output subgrid 1
  * @param subgrid2 Output subgrid 2
- * @param gx Array of x cell corner coordinates
- * @param gy Array of y cell corner coordinates
+ * @return 1 if successful (or the subgrid is a single cell and is not
+ *         divided), 0 if the boundary could not be cut
  */
-static void subgrid_divide(subgrid* sg, subgrid** sg1, subgrid** sg2)
+static int subgrid_divide(subgrid* sg, subgrid** sg1, subgrid** sg2)
 {
     poly* pl1 = NULL;
     poly* pl2 = NULL;
+    int* ids1 = NULL;
+    int* ids2 = NULL;
+    gridcut cut = { NULL, NULL, 0, 0, 0, 0, 0, NULL, NULL };
     gridbmap* gm = sg->gmap;
     int index;
 
-    if ((sg->maxi <= sg->mini + 1) && (sg->maxj <= sg->minj + 1)) {
-        *sg1 = *sg2 = NULL;
-        return;
-    }
+    *sg1 = *sg2 = NULL;
+    if ((sg->maxi <= sg->mini + 1) && (sg->maxj <= sg->minj + 1))
+        return 1;
 
     if (sg->maxi - sg->mini > sg->maxj - sg->minj) {
         /*
          * divide "vertically" 
          */
         index = (sg->mini + sg->maxi) / 2;
-        cut_boundary(sg->bound, gm->gx, gm->gy, 0, index, sg->minj, sg->maxj, &pl1, &pl2);
+        cut_boundary(gm, sg->bound, sg->ids, 0, index, sg->minj, sg->maxj, &pl1, &ids1, &pl2, &ids2, &cut);
     } else {
         /*
          * divide "horizontally" 
          */
         index = (sg->minj + sg->maxj) / 2;
-        cut_boundary(sg->bound, gm->gx, gm->gy, 1, index, sg->mini, sg->maxi, &pl1, &pl2);
+        cut_boundary(gm, sg->bound, sg->ids, 1, index, sg->mini, sg->maxi, &pl1, &ids1, &pl2, &ids2, &cut);
     }
 
     if (pl1 == NULL || pl2 == NULL)
-        gu_quit("dividesubgrid(): could not cut the boundary");
+        return 0;
 
-    *sg1 = subgrid_create(gm, pl1, sg->mini, sg->maxi, sg->minj, sg->maxj);
-    *sg2 = subgrid_create(gm, pl2, sg->mini, sg->maxi, sg->minj, sg->maxj);
+    subgrid_setcut(sg, pl1, pl2, &cut);
+
+    *sg1 = subgrid_create(gm, pl1, ids1);
+    *sg2 = subgrid_create(gm, pl2, ids2);
+
+    return 1;
 }
 
-/**
+/** Deletes redundant vertices of the boundary of a subgrid (see
+ * poly_compact()) along with their grid node numbers.
+ * @param sg Subgrid
+ */
+static void subgrid_compact(subgrid* sg)
+{
+    poly* pl = sg->bound;
+    double** gx = sg->gmap->gx;
+    double** gy = sg->gmap->gy;
+    int stride = sg->gmap->nce1 + 1;
+    int n = pl->n;
+    int ii, kk;
+
+    poly_compact(pl, EPS_COMPACT);
+    if (pl->n == n)
+        return;
+
+    /*
+     * the remaining vertices keep their order
+     */
+    for (ii = 0, kk = 0; ii < pl->n; ++ii, ++kk) {
+        for (; kk < n; ++kk) {
+            int id = sg->ids[kk];
+
+            if (gx[id / stride][id % stride] == pl->x[ii] && gy[id / stride][id % stride] == pl->y[ii])
+                break;
+        }
+        assert(kk < n);
+        sg->ids[ii] = sg->ids[kk];
+    }
+}
+
+/** Recursively divides a subgrid, building the binary tree below it. If
+ * compiled with OpenMP, the halves of large subgrids are divided in
+ * parallel tasks; the resulting tree does not depend on the order in which
+ * the tasks are executed.
+ * @param gm Grid map
+ * @param sg Subgrid
  */
 static void gridbmap_subdivide(gridbmap* gm, subgrid* sg)
 {
     subgrid* sg1 = NULL;
     subgrid* sg2 = NULL;
 
-    subgrid_divide(sg, &sg1, &sg2);
+    if (!subgrid_divide(sg, &sg1, &sg2))
+        gu_quit("dividesubgrid(): could not cut the boundary");
 
     if (sg1 != NULL) {
         sg->half1 = sg1;
+#if defined(_OPENMP)
+#pragma omp atomic
+#endif
         ++(gm->nleaves);
-        gridbmap_subdivide(gm, sg1);
     }
     if (sg2 != NULL) {
-        gridbmap_subdivide(gm, sg2);
         sg->half2 = sg2;
+#if defined(_OPENMP)
+#pragma omp atomic
+#endif
         ++(gm->nleaves);
     }
-    poly_compact(sg->bound, EPS_COMPACT);
+#if defined(_OPENMP)
+    if (sg1 != NULL && sg2 != NULL && (sg->maxi - sg->mini) * (sg->maxj - sg->minj) >= NCELLS_TASK) {
+#pragma omp task
+        gridbmap_subdivide(gm, sg1);
+        gridbmap_subdivide(gm, sg2);
+#pragma omp taskwait
+        subgrid_compact(sg);
+        return;
+    }
+#endif
+    if (sg1 != NULL)
+        gridbmap_subdivide(gm, sg1);
+    if (sg2 != NULL)
+        gridbmap_subdivide(gm, sg2);
+    subgrid_compact(sg);
+}
+
+/** Copies the boundary of a subgrid to the vertex pool at the position of
+ * a tree node, and the cut between its halves to the tree node.
+ * @param gm Grid map
+ * @param nd Tree node
+ * @param sg Subgrid
+ */
+static void bnode_copyvertices(gridbmap* gm, bnode* nd, subgrid* sg)
+{
+    nd->e = sg->bound->e;
+    nd->n = sg->bound->n;
+    memcpy(&gm->vertices[nd->offset], sg->ids, nd->n * sizeof(int));
+    nd->ncut = sg->ncut;
+    nd->cuti = sg->cuti;
+    nd->cutj = sg->cutj;
+    nd->cutdi = (signed char) sg->cutdi;
+    nd->cutdj = (signed char) sg->cutdj;
+    nd->cutaxis = (signed char) sg->cutaxis;
+    nd->cutside = (signed char) sg->cutside;
+}
+
+/** Packs the binary tree into the node array and vertex pool of the grid
+ * map.
+ * @param gm Grid map
+ * @param trunk Binary tree trunk
+ */
+static void gridbmap_freeze(gridbmap* gm, subgrid* trunk)
+{
+    subgrid** queue = malloc(gm->nleaves * sizeof(subgrid*));
+    size_t nvertices = 0;
+    int nqueued = 1;
+    int k;
+
+    queue[0] = trunk;
+    for (k = 0; k < nqueued; ++k) {
+        subgrid* sg = queue[k];
+
+        nvertices += sg->bound->n;
+        if (sg->half1 != NULL) {
+            queue[nqueued++] = sg->half1;
+            queue[nqueued++] = sg->half2;
+        }
+    }
+    assert(nqueued == gm->nleaves);
+
+    gm->nodes = malloc(nqueued * sizeof(bnode));
+    gm->vertices = malloc(nvertices * sizeof(int));
+
+    nvertices = 0;
+    nqueued = 1;
+    for (k = 0; k < gm->nleaves; ++k) {
+        subgrid* sg = queue[k];
+        bnode* nd = &gm->nodes[k];
+
+        nd->offset = nvertices;
+        nd->mini = sg->mini;
+        nd->maxi = sg->maxi;
+        nd->minj = sg->minj;
+        nd->maxj = sg->maxj;
+        nd->child = 0;
+        if (sg->half1 != NULL) {
+            nd->child = nqueued;
+            nqueued += 2;
+        }
+        bnode_copyvertices(gm, nd, sg);
+        nvertices += nd->n;
+    }
+
+    free(queue);
+    gm->nvertices = nvertices;
+    gm->nallocated = nvertices;
+    gm->nunused = 0;
+}
+
+/** Gets the coordinates of the boundary vertices of a tree node.
+ * @param gm Grid map
+ * @param nd Tree node
+ * @param xs Output X coordinates [nd->n]
+ * @param ys Output Y coordinates [nd->n]
+ */
+static void bnode_getvertices(gridbmap* gm, bnode* nd, double* xs, double* ys)
+{
+    int* ids = &gm->vertices[nd->offset];
+    int stride = gm->nce1 + 1;
+    int k;
+
+    for (k = 0; k < nd->n; ++k) {
+        int j = ids[k] / stride;
+        int i = ids[k] - j * stride;
+
+        xs[k] = gm->gx[j][i];
+        ys[k] = gm->gy[j][i];
+    }
+}
+
+/** Gets the cut between the children of a tree node.
+ * @param gm Grid map
+ * @param k Index of the tree node
+ * @param cut Output cut
+ */
+static void bnode_getcut(gridbmap* gm, int k, gridcut* cut)
+{
+    bnode* nd = &gm->nodes[k];
+
+    cut->gu = (nd->cutaxis == 0) ? gm->gx : gm->gy;
+    cut->gv = (nd->cutaxis == 0) ? gm->gy : gm->gx;
+    cut->n = nd->ncut;
+    cut->i = nd->cuti;
+    cut->j = nd->cutj;
+    cut->di = nd->cutdi;
+    cut->dj = nd->cutdj;
+    cut->us = gm->cuts[k];
+    cut->vs = (gm->cuts[k] != NULL) ? gm->cuts[k] + nd->ncut : NULL;
+}
+
+/** Builds or rebuilds the edge index of the boundary of a tree node, and
+ * copies the coordinates of its boundary and cut if they are large.
+ * @param gm Grid map
+ * @param k Index of the tree node
+ */
+static void bnode_buildindex(gridbmap* gm, int k)
+{
+    bnode* nd = &gm->nodes[k];
+
+    if (gm->indices[k] != NULL) {
+        polyindex_destroy(gm->indices[k]);
+        gm->indices[k] = NULL;
+        free(gm->coords[k]);
+        gm->coords[k] = NULL;
+    }
+    if (gm->cuts[k] != NULL) {
+        free(gm->cuts[k]);
+        gm->cuts[k] = NULL;
+    }
+    if (nd->n >= NINDEXMIN) {
+        double* xs = malloc(nd->n * 2 * sizeof(double));
+
+        bnode_getvertices(gm, nd, xs, xs + nd->n);
+        gm->coords[k] = xs;
+        gm->indices[k] = polyindex_create(nd->n, xs + nd->n);
+    }
+    if (nd->ncut >= NCUTMIN) {
+        double* us = malloc(nd->ncut * 2 * sizeof(double));
+        gridcut cut;
+        int i;
+
+        bnode_getcut(gm, k, &cut);
+        for (i = 0; i < nd->ncut; ++i) {
+            us[i] = gridcut_u(&cut, i);
+            us[nd->ncut + i] = gridcut_v(&cut, i);
+        }
+        gm->cuts[k] = us;
+    }
+}
+
+/** Builds edge indices of the boundaries of large tree nodes.
+ * @param gm Grid map
+ */
+static void gridbmap_buildindices(gridbmap* gm)
+{
+    int k;
+
+    gm->indices = calloc(gm->nleaves, sizeof(polyindex*));
+    gm->coords = calloc(gm->nleaves, sizeof(double*));
+    gm->cuts = calloc(gm->nleaves, sizeof(double*));
+    for (k = 0; k < gm->nleaves; ++k)
+        bnode_buildindex(gm, k);
 }
 
 /** Builds a grid map structure to facilitate conversion from coordinate
@@ -392,7 +942,6 @@ static void gridbmap_subdivide(gridbmap* gm, subgrid* sg)
 gridbmap* gridbmap_build(int nce1, int nce2, double** gx, double** gy)
 {
     gridbmap* gm = malloc(sizeof(gridbmap));
-    poly* bound;
     subgrid* trunk;
 
     gm->nce1 = nce1;
@@ -400,14 +949,19 @@ gridbmap* gridbmap_build(int nce1, int nce2, double** gx, double** gy)
     gm->gx = gx;
     gm->gy = gy;
 
-    bound = poly_formbound(nce1, nce2, gx, gy);
-    trunk = subgrid_create(gm, bound, 0, nce1, 0, nce2);
+    trunk = subgrid_createtrunk(gm);
 
-    gm->bound = bound;
-    gm->trunk = trunk;
     gm->nleaves = 1;
+    gm->attached = 0;
 
+#if defined(_OPENMP)
+#pragma omp parallel
+#pragma omp single
+#endif
     gridbmap_subdivide(gm, trunk);       /* recursive */
+    gridbmap_freeze(gm, trunk);
+    subgrid_destroy(trunk);
+    gridbmap_buildindices(gm);
 
     return gm;
 }
@@ -417,10 +971,274 @@ gridbmap* gridbmap_build(int nce1, int nce2, double** gx, double** gy)
  */
 void gridbmap_destroy(gridbmap* gm)
 {
-    subgrid_destroy(gm->trunk);
+    int k;
+
+    for (k = 0; k < gm->nleaves; ++k) {
+        if (gm->indices[k] != NULL)
+            polyindex_destroy(gm->indices[k]);
+        free(gm->coords[k]);
+        free(gm->cuts[k]);
+    }
+    free(gm->indices);
+    free(gm->coords);
+    free(gm->cuts);
+    if (!gm->attached) {
+        free(gm->nodes);
+        free(gm->vertices);
+    }
     free(gm);
 }
 
+/** Writes the tree of a grid map to a binary file.
+ * @param gm Grid map
+ * @param f File
+ */
+void gridbmap_write(gridbmap* gm, FILE* f)
+{
+    size_t sizes[3];
+
+    sizes[0] = gm->nleaves;
+    sizes[1] = gm->nvertices;
+    sizes[2] = sizeof(bnode);
+    gu_writeblock(f, sizes, sizeof(sizes));
+    gu_writeblock(f, gm->nodes, gm->nleaves * sizeof(bnode));
+    gu_writeblock(f, gm->vertices, gm->nvertices * sizeof(int));
+}
+
+/** Creates a grid map with the tree written by gridbmap_write() to a file
+ * that has been mapped to memory. The tree is used in place.
+ *
+ * @param nce1 number of cells in e1 direction
+ * @param nce2 number of cells in e2 direction
+ * @param gx array of X coordinates [nce2 + 1][nce1 + 1]
+ * @param gy array of Y coordinates [nce2 + 1][nce1 + 1]
+ * @param pos Pointer to the position of the tree in the mapped file; is
+ *            advanced past the tree
+ * @param end End of the mapped file
+ * @return Grid map
+ */
+gridbmap* gridbmap_attach(int nce1, int nce2, double** gx, double** gy, char** pos, char* end)
+{
+    gridbmap* gm = malloc(sizeof(gridbmap));
+    size_t* sizes = gu_readblock(pos, end, 3 * sizeof(size_t));
+
+    if (sizes[2] != sizeof(bnode) || sizes[0] == 0 || sizes[0] > INT_MAX)
+        gu_quit("gridbmap_attach(): incompatible tree data");
+
+    gm->nce1 = nce1;
+    gm->nce2 = nce2;
+    gm->gx = gx;
+    gm->gy = gy;
+    gm->nleaves = (int) sizes[0];
+    gm->nvertices = sizes[1];
+    gm->nodes = gu_readblock(pos, end, gm->nleaves * sizeof(bnode));
+    gm->vertices = gu_readblock(pos, end, gm->nvertices * sizeof(int));
+    gm->nallocated = gm->nvertices;
+    gm->nunused = 0;
+    gm->attached = 1;
+    gridbmap_buildindices(gm);
+
+    return gm;
+}
+
+/** Packs the vertex pool, removing the vertices no longer used by the tree
+ * nodes.
+ * @param gm Grid map
+ */
+static void gridbmap_packvertices(gridbmap* gm)
+{
+    int* vertices = malloc(gm->nvertices * sizeof(int));
+    size_t nvertices = 0;
+    int k;
+
+    for (k = 0; k < gm->nleaves; ++k) {
+        bnode* nd = &gm->nodes[k];
+
+        memcpy(&vertices[nvertices], &gm->vertices[nd->offset], nd->n * sizeof(int));
+        nd->offset = nvertices;
+        nvertices += nd->n;
+    }
+    free(gm->vertices);
+    gm->vertices = vertices;
+    gm->nvertices = nvertices;
+    gm->nallocated = nvertices;
+    gm->nunused = 0;
+}
+
+/** Stores the new boundary and cut of a tree node. The boundary replaces
+ * the old one in the vertex pool if it is not longer; otherwise it is
+ * appended to the pool.
+ * @param gm Grid map
+ * @param nd Tree node
+ * @param sg Subgrid for the tree node
+ */
+static void bnode_setboundary(gridbmap* gm, bnode* nd, subgrid* sg)
+{
+    int n = sg->bound->n;
+
+    if (n > nd->n) {
+        if (gm->nvertices + n > gm->nallocated) {
+            gm->nallocated = (gm->nvertices + n) * 2;
+            gm->vertices = realloc(gm->vertices, gm->nallocated * sizeof(int));
+        }
+        gm->nunused += nd->n;
+        nd->offset = gm->nvertices;
+        gm->nvertices += n;
+    } else
+        gm->nunused += nd->n - n;
+    bnode_copyvertices(gm, nd, sg);
+}
+
+/** Checks whether a subgrid spans the same index range as a tree node.
+ * @param sg Subgrid
+ * @param nd Tree node
+ * @return 1 for yes, 0 for no
+ */
+static int subgrid_matches(subgrid* sg, bnode* nd)
+{
+    return sg->mini == nd->mini && sg->maxi == nd->maxi && sg->minj == nd->minj && sg->maxj == nd->maxj;
+}
+
+/** Updates a tree node and the nodes below it after the coordinates of the
+ * grid nodes within a rectangle in index space have been modified. The
+ * subtrees that do not contain modified grid nodes are not changed. The
+ * update fails if the subgrids no longer span the same index ranges as the
+ * tree nodes (e.g. after the set of valid grid nodes has changed, so that
+ * the cuts move) or if a subgrid can not be cut.
+ * @param gm Grid map
+ * @param k Index of the tree node
+ * @param sg Subgrid for the tree node, formed with the modified coordinates
+ * @param imin Minimal I index of the modified nodes
+ * @param imax Maximal I index of the modified nodes
+ * @param jmin Minimal J index of the modified nodes
+ * @param jmax Maximal J index of the modified nodes
+ * @return 1 if successful, 0 if the tree does not match the subgrid
+ */
+static int gridbmap_updatenode(gridbmap* gm, int k, subgrid* sg, int imin, int imax, int jmin, int jmax)
+{
+    bnode* nd = &gm->nodes[k];
+    int child = nd->child;
+
+    if (!subgrid_matches(sg, nd))
+        return 0;
+
+    if (!subgrid_divide(sg, &sg->half1, &sg->half2))
+        return 0;
+    if ((sg->half1 == NULL) != (child == 0))
+        return 0;
+
+    if (child != 0) {
+        subgrid* halves[2];
+        int h;
+
+        halves[0] = sg->half1;
+        halves[1] = sg->half2;
+        for (h = 0; h < 2; ++h) {
+            subgrid* half = halves[h];
+
+            if (half->mini > imax || half->maxi < imin || half->minj > jmax || half->maxj < jmin) {
+                if (!subgrid_matches(half, &gm->nodes[child + h]))
+                    return 0;
+            } else if (!gridbmap_updatenode(gm, child + h, half, imin, imax, jmin, jmax))
+                return 0;
+        }
+    }
+
+    subgrid_compact(sg);
+    bnode_setboundary(gm, &gm->nodes[k], sg);
+    bnode_buildindex(gm, k);
+
+    return 1;
+}
+
+/** Updates the grid map after the coordinates of the grid nodes within a
+ * rectangle in index space have been modified. Only the boundaries of the
+ * tree nodes whose subgrids contain modified grid nodes are formed again;
+ * the bounding rectangles of these nodes are refitted. If the structure of
+ * the tree has to change (e.g. because the set of valid nodes with finite
+ * coordinates has changed), the map is left partly updated and must be
+ * built again. The map must not be attached to an index file.
+ *
+ * @param gm Grid map
+ * @param imin Minimal I index of the modified nodes
+ * @param imax Maximal I index of the modified nodes
+ * @param jmin Minimal J index of the modified nodes
+ * @param jmax Maximal J index of the modified nodes
+ * @return 1 if successful, 0 if the map needs to be built again
+ */
+int gridbmap_update_region(gridbmap* gm, int imin, int imax, int jmin, int jmax)
+{
+    subgrid* trunk;
+    int success;
+
+    assert(!gm->attached);
+
+    trunk = subgrid_createtrunk(gm);
+    success = gridbmap_updatenode(gm, 0, trunk, imin, imax, jmin, jmax);
+    subgrid_destroy(trunk);
+
+    if (gm->nunused > gm->nvertices / 2)
+        gridbmap_packvertices(gm);
+
+    return success;
+}
+
+/** Checks whether a point is inside the boundary of a tree node. Large
+ * boundaries are tested using their edge indices.
+ * @param gm Grid map
+ * @param nd Tree node
+ * @param x X coordinate
+ * @param y Y coordinate
+ * @return 1 for yes, 0 for no
+ */
+static int bnode_containspoint(gridbmap* gm, bnode* nd, double x, double y)
+{
+    int k = (int) (nd - gm->nodes);
+    double xs[NINDEXMIN * 2];
+
+    if (nd->n <= 1)
+        return 0;
+    if (x < nd->e.xmin || x > nd->e.xmax || y < nd->e.ymin || y > nd->e.ymax)
+        return 0;
+
+    if (gm->indices[k] != NULL)
+        return polyindex_containspoint(gm->indices[k], nd->n, gm->coords[k], gm->coords[k] + nd->n, x, y);
+
+    bnode_getvertices(gm, nd, xs, xs + nd->n);
+    return poly_containspoint2(nd->n, xs, xs + nd->n, x, y);
+}
+
+/** Finds the child of a tree node on the side of the cut between the
+ * children a point lies on. The point is supposed to be inside the node.
+ * @param gm Grid map
+ * @param nd Tree node
+ * @param x X coordinate
+ * @param y Y coordinate
+ * @return 1 for child 1, 2 for child 2; 0 if the point is too close to the
+ *         cut or the side-of-cut test is not used for the node
+ */
+static int bnode_getside(gridbmap* gm, bnode* nd, double x, double y)
+{
+    double eps = EPS_SIDE * (nd->e.xmax - nd->e.xmin + nd->e.ymax - nd->e.ymin);
+    gridcut cut;
+    double d;
+
+    if (nd->ncut == 0)
+        return 0;
+
+    bnode_getcut(gm, (int) (nd - gm->nodes), &cut);
+    if (nd->cutaxis == 0)
+        d = y - gridcut_eval(&cut, x);
+    else
+        d = x - gridcut_eval(&cut, y);
+
+    if (d > eps)
+        return (nd->cutside > 0) ? 1 : 2;
+    if (d < -eps)
+        return (nd->cutside > 0) ? 2 : 1;
+    return 0;
+}
+
 /** Calculates indices (i,j) of a grid cell containing point (x,y).
  *
  * @param gm Grid map
@@ -432,32 +1250,42 @@ void gridbmap_destroy(gridbmap* gm)
  */
 int gridbmap_xy2ij(gridbmap* gm, double x, double y, int* i, int* j)
 {
-    subgrid* sg = gm->trunk;
+    bnode* nodes = gm->nodes;
+    bnode* nd = nodes;
 
     /*
      * check if point is in grid outline 
      */
-    sg = gm->trunk;
-    if (!poly_containspoint(sg->bound, x, y))
+    if (!bnode_containspoint(gm, nd, x, y))
         return 0;
 
     /*
      * do the full search 
      */
-    while (sg->half1 != NULL) {
+    while (nd->child != 0) {
+        bnode* nd1 = &nodes[nd->child];
+        bnode* nd2 = nd1 + 1;
+        int side = bnode_getside(gm, nd, x, y);
+
         /*
          * Test on the point being within the boundary polyline is the most
-         * expensive part of the mapping; therefore, perform it in a branch
-         * that contains a smaller (number of points-wise) polyline.
+         * expensive part of the mapping; therefore, find the side of the
+         * cut between the children the point is on if possible, and
+         * otherwise perform it in a branch that contains a smaller (number
+         * of points-wise) polyline.
          */
-        if (sg->half1->bound->n <= sg->half2->bound->n)
-            sg = (poly_containspoint(sg->half1->bound, x, y)) ? sg->half1 : sg->half2;
+        if (side == 1)
+            nd = nd1;
+        else if (side == 2)
+            nd = nd2;
+        else if (nd1->n <= nd2->n)
+            nd = (bnode_containspoint(gm, nd1, x, y)) ? nd1 : nd2;
         else
-            sg = (poly_containspoint(sg->half2->bound, x, y)) ? sg->half2 : sg->half1;
+            nd = (bnode_containspoint(gm, nd2, x, y)) ? nd2 : nd1;
     }
 
-    *i = sg->mini;
-    *j = sg->minj;
+    *i = nd->mini;
+    *j = nd->minj;
 
     return 1;
 }
@@ -480,7 +1308,7 @@ int gridbmap_getnce2(gridbmap* gm)
  */
 void gridbmap_getextent(gridbmap* gm, double* xmin, double* xmax, double* ymin, double* ymax)
 {
-    extent* e = &gm->trunk->bound->e;
+    extent* e = &gm->nodes[0].e;
 
     *xmin = e->xmin;
     *xmax = e->xmax;
@@ -35,6 +35,9 @@ typedef struct gridbmap gridbmap;
 
 gridbmap* gridbmap_build(int nce1, int nce2, double** gx, double** gy);
 void gridbmap_destroy(gridbmap* gm);
+void gridbmap_write(gridbmap* gm, FILE* f);
+gridbmap* gridbmap_attach(int nce1, int nce2, double** gx, double** gy, char** pos, char* end);
+int gridbmap_update_region(gridbmap* gm, int imin, int imax, int jmin, int jmax);
 int gridbmap_xy2ij(gridbmap* gm, double x, double y, int* i, int* j);
 int gridbmap_getnce1(gridbmap* gm);
 int gridbmap_getnce2(gridbmap* gm);
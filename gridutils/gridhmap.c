@@ -0,0 +1,366 @@
+/******************************************************************************
+ *
+ * File:           gridhmap.c
+ *
+ * Created:        16 October 2026
+ *
+ * Purpose:        Mapping of curvilinear grids based on uniform spatial hash.
+ *                 The bounding rectangle of each valid cell is registered in
+ *                 all buckets of a regular XY grid it overlaps; the search
+ *                 then tests only the cells registered in the bucket
+ *                 containing the point. Works best for grids with cells of
+ *                 similar size.
+ *
+ * Revisions:
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include <float.h>
+#include "poly.h"
+#include "gridhmap.h"
+#include "gucommon.h"
+
+struct gridhmap {
+    int nce1;                   /* number of cells in e1 direction */
+    int nce2;                   /* number of cells in e2 direction */
+    double** gx;                /* reference to array of X coords
+                                 * [nce2+1][nce1+1] */
+    double** gy;                /* reference to array of Y coords
+                                 * [nce2+1][nce1+1] */
+    double xmin;                /* extent of valid cells */
+    double xmax;
+    double ymin;
+    double ymax;
+    int nx;                     /* number of buckets in X direction */
+    int ny;                     /* number of buckets in Y direction */
+    double rdx;                 /* inverse bucket width */
+    double rdy;                 /* inverse bucket height */
+    size_t* offsets;            /* start of each bucket in `cells' [nx * ny
+                                 * + 1] */
+    int* cells;                 /* cell ids (j * nce1 + i) by bucket */
+    int attached;               /* flag: the buckets belong to a mapped
+                                 * index file */
+};
+
+/** Checks whether a cell is valid (all corner nodes are valid).
+ * @param gm Grid map
+ * @param i I index of the cell
+ * @param j J index of the cell
+ * @return 1 for yes, 0 for no
+ */
+static int cell_isvalid(gridhmap* gm, int i, int j)
+{
+    double** gx = gm->gx;
+    double** gy = gm->gy;
+
+    return isfinite(gx[j][i] + gx[j][i + 1] + gx[j + 1][i] + gx[j + 1][i + 1] + gy[j][i] + gy[j][i + 1] + gy[j + 1][i] + gy[j + 1][i + 1]);
+}
+
+/** Gets range of buckets overlapped by a cell.
+ * @param gm Grid map
+ * @param i I index of the cell
+ * @param j J index of the cell
+ * @param ix1 Output minimal bucket X index
+ * @param ix2 Output maximal bucket X index
+ * @param iy1 Output minimal bucket Y index
+ * @param iy2 Output maximal bucket Y index
+ */
+static void cell_getbuckets(gridhmap* gm, int i, int j, int* ix1, int* ix2, int* iy1, int* iy2)
+{
+    double** gx = gm->gx;
+    double** gy = gm->gy;
+    double xmin = fmin(fmin(gx[j][i], gx[j][i + 1]), fmin(gx[j + 1][i], gx[j + 1][i + 1]));
+    double xmax = fmax(fmax(gx[j][i], gx[j][i + 1]), fmax(gx[j + 1][i], gx[j + 1][i + 1]));
+    double ymin = fmin(fmin(gy[j][i], gy[j][i + 1]), fmin(gy[j + 1][i], gy[j + 1][i + 1]));
+    double ymax = fmax(fmax(gy[j][i], gy[j][i + 1]), fmax(gy[j + 1][i], gy[j + 1][i + 1]));
+
+    *ix1 = (int) ((xmin - gm->xmin) * gm->rdx);
+    *ix2 = (int) ((xmax - gm->xmin) * gm->rdx);
+    *iy1 = (int) ((ymin - gm->ymin) * gm->rdy);
+    *iy2 = (int) ((ymax - gm->ymin) * gm->rdy);
+    if (*ix2 >= gm->nx)
+        *ix2 = gm->nx - 1;
+    if (*iy2 >= gm->ny)
+        *iy2 = gm->ny - 1;
+}
+
+/** Builds a grid map structure to facilitate conversion from coordinate
+ * to index space.
+ *
+ * @param nce1 number of cells in e1 direction
+ * @param nce2 number of cells in e2 direction
+ * @param gx array of X coordinates [nce2 + 1][nce1 + 1]
+ * @param gy array of Y coordinates [nce2 + 1][nce1 + 1]
+ * @return a map to be used by xy2ij
+ */
+gridhmap* gridhmap_build(int nce1, int nce2, double** gx, double** gy)
+{
+    gridhmap* gm = malloc(sizeof(gridhmap));
+    size_t* counts = NULL;
+    int ncells = 0;
+    int nbuckets;
+    int i, j, ix, iy;
+
+    gm->nce1 = nce1;
+    gm->nce2 = nce2;
+    gm->gx = gx;
+    gm->gy = gy;
+    gm->attached = 0;
+    gm->xmin = DBL_MAX;
+    gm->xmax = -DBL_MAX;
+    gm->ymin = DBL_MAX;
+    gm->ymax = -DBL_MAX;
+
+    for (j = 0; j < nce2; ++j) {
+        for (i = 0; i < nce1; ++i) {
+            int di, dj;
+
+            if (!cell_isvalid(gm, i, j))
+                continue;
+            ncells++;
+            for (dj = 0; dj < 2; ++dj) {
+                for (di = 0; di < 2; ++di) {
+                    double x = gx[j + dj][i + di];
+                    double y = gy[j + dj][i + di];
+
+                    if (x < gm->xmin)
+                        gm->xmin = x;
+                    if (x > gm->xmax)
+                        gm->xmax = x;
+                    if (y < gm->ymin)
+                        gm->ymin = y;
+                    if (y > gm->ymax)
+                        gm->ymax = y;
+                }
+            }
+        }
+    }
+
+    /*
+     * about one bucket per cell, with buckets of about the same shape as
+     * the grid extent
+     */
+    if (ncells == 0) {
+        gm->nx = 1;
+        gm->ny = 1;
+    } else if (gm->xmax > gm->xmin && gm->ymax > gm->ymin) {
+        double ratio = (gm->xmax - gm->xmin) / (gm->ymax - gm->ymin);
+
+        gm->nx = (int) ceil(sqrt((double) ncells * ratio));
+        gm->ny = (int) ceil(sqrt((double) ncells / ratio));
+        if (gm->nx > ncells)
+            gm->nx = ncells;
+        if (gm->ny > ncells)
+            gm->ny = ncells;
+    } else if (gm->xmax > gm->xmin) {
+        gm->nx = ncells;
+        gm->ny = 1;
+    } else {
+        gm->nx = 1;
+        gm->ny = ncells;
+    }
+    nbuckets = gm->nx * gm->ny;
+    gm->rdx = (gm->xmax > gm->xmin) ? (double) gm->nx / (gm->xmax - gm->xmin) : 0.0;
+    gm->rdy = (gm->ymax > gm->ymin) ? (double) gm->ny / (gm->ymax - gm->ymin) : 0.0;
+
+    /*
+     * count cells in each bucket, then fill the buckets
+     */
+    gm->offsets = calloc(nbuckets + 1, sizeof(size_t));
+    for (j = 0; j < nce2; ++j) {
+        for (i = 0; i < nce1; ++i) {
+            int ix1, ix2, iy1, iy2;
+
+            if (!cell_isvalid(gm, i, j))
+                continue;
+            cell_getbuckets(gm, i, j, &ix1, &ix2, &iy1, &iy2);
+            for (iy = iy1; iy <= iy2; ++iy)
+                for (ix = ix1; ix <= ix2; ++ix)
+                    gm->offsets[iy * gm->nx + ix + 1]++;
+        }
+    }
+    for (i = 0; i < nbuckets; ++i)
+        gm->offsets[i + 1] += gm->offsets[i];
+
+    gm->cells = malloc((gm->offsets[nbuckets] + 1) * sizeof(int));
+    counts = calloc(nbuckets, sizeof(size_t));
+    for (j = 0; j < nce2; ++j) {
+        for (i = 0; i < nce1; ++i) {
+            int ix1, ix2, iy1, iy2;
+
+            if (!cell_isvalid(gm, i, j))
+                continue;
+            cell_getbuckets(gm, i, j, &ix1, &ix2, &iy1, &iy2);
+            for (iy = iy1; iy <= iy2; ++iy) {
+                for (ix = ix1; ix <= ix2; ++ix) {
+                    int b = iy * gm->nx + ix;
+
+                    gm->cells[gm->offsets[b] + counts[b]] = j * nce1 + i;
+                    counts[b]++;
+                }
+            }
+        }
+    }
+    free(counts);
+
+    return gm;
+}
+
+/**
+ */
+void gridhmap_destroy(gridhmap* gm)
+{
+    if (!gm->attached) {
+        free(gm->offsets);
+        free(gm->cells);
+    }
+    free(gm);
+}
+
+/** Writes the buckets of a grid map to a binary file.
+ * @param gm Grid map
+ * @param f File
+ */
+void gridhmap_write(gridhmap* gm, FILE* f)
+{
+    double params[6];
+    int dims[2];
+
+    params[0] = gm->xmin;
+    params[1] = gm->xmax;
+    params[2] = gm->ymin;
+    params[3] = gm->ymax;
+    params[4] = gm->rdx;
+    params[5] = gm->rdy;
+    dims[0] = gm->nx;
+    dims[1] = gm->ny;
+    gu_writeblock(f, params, sizeof(params));
+    gu_writeblock(f, dims, sizeof(dims));
+    gu_writeblock(f, gm->offsets, ((size_t) gm->nx * gm->ny + 1) * sizeof(size_t));
+    gu_writeblock(f, gm->cells, (gm->offsets[gm->nx * gm->ny] + 1) * sizeof(int));
+}
+
+/** Creates a grid map with the buckets written by gridhmap_write() to a file
+ * that has been mapped to memory. The buckets are used in place.
+ *
+ * @param nce1 number of cells in e1 direction
+ * @param nce2 number of cells in e2 direction
+ * @param gx array of X coordinates [nce2 + 1][nce1 + 1]
+ * @param gy array of Y coordinates [nce2 + 1][nce1 + 1]
+ * @param pos Pointer to the position of the buckets in the mapped file; is
+ *            advanced past the buckets
+ * @param end End of the mapped file
+ * @return Grid map
+ */
+gridhmap* gridhmap_attach(int nce1, int nce2, double** gx, double** gy, char** pos, char* end)
+{
+    gridhmap* gm = malloc(sizeof(gridhmap));
+    double* params = gu_readblock(pos, end, 6 * sizeof(double));
+    int* dims = gu_readblock(pos, end, 2 * sizeof(int));
+
+    if (dims[0] <= 0 || dims[1] <= 0)
+        gu_quit("gridhmap_attach(): incompatible bucket data");
+
+    gm->nce1 = nce1;
+    gm->nce2 = nce2;
+    gm->gx = gx;
+    gm->gy = gy;
+    gm->xmin = params[0];
+    gm->xmax = params[1];
+    gm->ymin = params[2];
+    gm->ymax = params[3];
+    gm->rdx = params[4];
+    gm->rdy = params[5];
+    gm->nx = dims[0];
+    gm->ny = dims[1];
+    gm->offsets = gu_readblock(pos, end, ((size_t) gm->nx * gm->ny + 1) * sizeof(size_t));
+    gm->cells = gu_readblock(pos, end, (gm->offsets[gm->nx * gm->ny] + 1) * sizeof(int));
+    gm->attached = 1;
+
+    return gm;
+}
+
+/** Calculates indices (i,j) of a grid cell containing point (x,y).
+ *
+ * @param gm Grid map
+ * @param x X coordinate
+ * @param y Y coordinate
+ * @param iout pointer to returned I indice value
+ * @param jout pointer to returned J indice value
+ * @return 1 if successful, 0 otherwhile
+ */
+int gridhmap_xy2ij(gridhmap* gm, double x, double y, int* iout, int* jout)
+{
+    double** gx = gm->gx;
+    double** gy = gm->gy;
+    int ix, iy, b;
+    size_t ii;
+
+    if (x < gm->xmin || y < gm->ymin || x > gm->xmax || y > gm->ymax)
+        return 0;
+
+    ix = (int) ((x - gm->xmin) * gm->rdx);
+    iy = (int) ((y - gm->ymin) * gm->rdy);
+    if (ix >= gm->nx)
+        ix = gm->nx - 1;
+    if (iy >= gm->ny)
+        iy = gm->ny - 1;
+    b = iy * gm->nx + ix;
+
+    for (ii = gm->offsets[b]; ii < gm->offsets[b + 1]; ++ii) {
+        int id = gm->cells[ii];
+        int i = id % gm->nce1;
+        int j = id / gm->nce1;
+        double xs[4], ys[4];
+
+        xs[0] = gx[j][i];
+        xs[1] = gx[j][i + 1];
+        xs[2] = gx[j + 1][i + 1];
+        xs[3] = gx[j + 1][i];
+        if ((x < xs[0] && x < xs[1] && x < xs[2] && x < xs[3]) || (x > xs[0] && x > xs[1] && x > xs[2] && x > xs[3]))
+            continue;
+        ys[0] = gy[j][i];
+        ys[1] = gy[j][i + 1];
+        ys[2] = gy[j + 1][i + 1];
+        ys[3] = gy[j + 1][i];
+        if (poly_containspoint2(4, xs, ys, x, y)) {
+            *iout = i;
+            *jout = j;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ */
+int gridhmap_getnce1(gridhmap* gm)
+{
+    return gm->nce1;
+}
+
+/**
+ */
+int gridhmap_getnce2(gridhmap* gm)
+{
+    return gm->nce2;
+}
+
+/**
+ */
+double** gridhmap_getxnodes(gridhmap* gm)
+{
+    return gm->gx;
+}
+
+/**
+ */
+double** gridhmap_getynodes(gridhmap* gm)
+{
+    return gm->gy;
+}
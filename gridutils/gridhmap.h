@@ -0,0 +1,30 @@
+/******************************************************************************
+ *
+ * File:           gridhmap.h
+ *
+ * Created:        16 October 2026
+ *
+ * Purpose:        Calculates transformations between physical and index
+ *                 space for a numerical grid using uniform spatial hash
+ *
+ * Revisions:
+ *
+ *****************************************************************************/
+
+#if !defined(_GRIDHMAP_H)
+#define _GRIDHMAP_H
+
+struct gridhmap;
+typedef struct gridhmap gridhmap;
+
+gridhmap* gridhmap_build(int nce1, int nce2, double** gx, double** gy);
+void gridhmap_destroy(gridhmap* gm);
+void gridhmap_write(gridhmap* gm, FILE* f);
+gridhmap* gridhmap_attach(int nce1, int nce2, double** gx, double** gy, char** pos, char* end);
+int gridhmap_xy2ij(gridhmap* gm, double x, double y, int* i, int* j);
+int gridhmap_getnce1(gridhmap* gm);
+int gridhmap_getnce2(gridhmap* gm);
+double** gridhmap_getxnodes(gridhmap* gm);
+double** gridhmap_getynodes(gridhmap* gm);
+
+#endif
@@ -18,6 +18,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
+#include "nan.h"
 #include "kdtree.h"
 #include "poly.h"
 #include "gridkmap.h"
@@ -25,6 +26,10 @@
 
 #define EPS 1.0e-8
 #define EPS_ZERO 1.0e-5
+#define NRINGMAX 4
+#define BUCKETSIZE 16           /* number of grid nodes in a kd-tree leaf */
+#define NNEARESTGEO 4           /* number of nearest nodes tried in the
+                                 * geographic mode */
 
 struct gridkmap {
     int nce1;                   /* number of cells in e1 direction */
@@ -33,32 +38,62 @@ struct gridkmap {
                                  * [nce2+1][nce1+1] */
     double** gy;                /* reference to array of Y coords
                                  * [nce2+1][nce1+1] */
+    int geographic;             /* flag: X and Y are longitude and latitude;
+                                 * the nodes are indexed on the unit sphere */
     kdtree* tree;               /* kd tree with grid nodes */
 };
 
 /** Builds a grid map structure to facilitate conversion from coordinate
  * to index space.
  *
+ * In the geographic mode, X and Y are longitude and latitude in degrees.
+ * The grid nodes are indexed as points on the unit sphere, and the cells are
+ * tested for containing a point in the plane tangent to the sphere at the
+ * point. This makes the mapping continuous across the dateline and near the
+ * poles.
+ *
  * @param gx array of X coordinates [nce2 + 1][nce1 + 1]
  * @param gy array of Y coordinates [nce2 + 1][nce1 + 1]
  * @param nce1 number of cells in e1 direction
  * @param nce2 number of cells in e2 direction
+ * @param geographic flag: use the geographic mode
  * @return a map tree to be used by xy2ij
  */
-gridkmap* gridkmap_build(int nce1, int nce2, double** gx, double** gy)
+gridkmap* gridkmap_build(int nce1, int nce2, double** gx, double** gy, int geographic)
 {
     gridkmap* gm = malloc(sizeof(gridkmap));
-    double* data[2];
+    size_t nnodes = (size_t) (nce1 + 1) * (nce2 + 1);
+    double* data[3];
 
     gm->nce1 = nce1;
     gm->nce2 = nce2;
     gm->gx = gx;
     gm->gy = gy;
+    gm->geographic = geographic;
+
+    if (!geographic) {
+        gm->tree = kd_create(2);
+        data[0] = gx[0];
+        data[1] = gy[0];
+        kd_build_compact(gm->tree, nnodes, data, BUCKETSIZE);
+    } else {
+        size_t ii;
+        int i;
 
-    gm->tree = kd_create(2);
-    data[0] = gx[0];
-    data[1] = gy[0];
-    kd_insertnodes(gm->tree, (nce1 + 1) * (nce2 + 1), data, 1 /* shuffle */ );
+        for (i = 0; i < 3; ++i)
+            data[i] = malloc(nnodes * sizeof(double));
+        for (ii = 0; ii < nnodes; ++ii) {
+            double xyz[3];
+
+            gu_lonlat2xyz(gx[0][ii], gy[0][ii], xyz);
+            for (i = 0; i < 3; ++i)
+                data[i][ii] = xyz[i];
+        }
+        gm->tree = kd_create(3);
+        kd_build_compact(gm->tree, nnodes, data, BUCKETSIZE);
+        for (i = 0; i < 3; ++i)
+            free(data[i]);
+    }
 
     return gm;
 }
@@ -71,7 +106,239 @@ void gridkmap_destroy(gridkmap* gm)
     free(gm);
 }
 
-/**
+/** Writes the kd-tree of a grid map to a binary file.
+ * @param gm Grid map
+ * @param f File
+ */
+void gridkmap_write(gridkmap* gm, FILE* f)
+{
+    if (!kd_write(gm->tree, f))
+        gu_quit("gridkmap_write(): could not write the kd-tree");
+}
+
+/** Creates a grid map with the kd-tree written by gridkmap_write() to a file
+ * that has been mapped to memory. The kd-tree is used in place.
+ *
+ * @param nce1 number of cells in e1 direction
+ * @param nce2 number of cells in e2 direction
+ * @param gx array of X coordinates [nce2 + 1][nce1 + 1]
+ * @param gy array of Y coordinates [nce2 + 1][nce1 + 1]
+ * @param pos Pointer to the position of the kd-tree in the mapped file; is
+ *            advanced past the kd-tree
+ * @param end End of the mapped file
+ * @return Grid map
+ */
+gridkmap* gridkmap_attach(int nce1, int nce2, double** gx, double** gy, char** pos, char* end)
+{
+    gridkmap* gm = malloc(sizeof(gridkmap));
+    size_t size = end - *pos;
+
+    gm->nce1 = nce1;
+    gm->nce2 = nce2;
+    gm->gx = gx;
+    gm->gy = gy;
+    gm->tree = kd_attach(*pos, &size);
+    if (gm->tree == NULL)
+        gu_quit("gridkmap_attach(): incompatible kd-tree data");
+    gm->geographic = (kd_getndim(gm->tree) == 3);
+    *pos += size;
+
+    return gm;
+}
+
+/** Updates the grid map after the coordinates of the grid nodes within a
+ * rectangle in index space have been modified. The kd-tree nodes are
+ * updated by kd_updatenodes().
+ *
+ * @param gm Grid map
+ * @param imin Minimal I index of the modified nodes
+ * @param imax Maximal I index of the modified nodes
+ * @param jmin Minimal J index of the modified nodes
+ * @param jmax Maximal J index of the modified nodes
+ * @return 1 if successful, 0 if the map needs to be built again
+ */
+int gridkmap_update_region(gridkmap* gm, int imin, int imax, int jmin, int jmax)
+{
+    int ni = imax - imin + 1;
+    size_t n = (size_t) ni * (jmax - jmin + 1);
+    size_t* ids = malloc(n * sizeof(size_t));
+    double* data[3];
+    size_t k;
+    int ndim = (gm->geographic) ? 3 : 2;
+    int d, success;
+
+    for (d = 0; d < ndim; ++d)
+        data[d] = malloc(n * sizeof(double));
+    for (k = 0; k < n; ++k) {
+        int i = imin + (int) (k % ni);
+        int j = jmin + (int) (k / ni);
+
+        ids[k] = (size_t) j * (gm->nce1 + 1) + i;
+        if (!gm->geographic) {
+            data[0][k] = gm->gx[j][i];
+            data[1][k] = gm->gy[j][i];
+        } else if (isfinite(gm->gx[j][i])) {
+            double xyz[3];
+
+            gu_lonlat2xyz(gm->gx[j][i], gm->gy[j][i], xyz);
+            for (d = 0; d < 3; ++d)
+                data[d][k] = xyz[d];
+        } else
+            for (d = 0; d < 3; ++d)
+                data[d][k] = NaN;
+    }
+    success = kd_updatenodes(gm->tree, n, ids, data);
+    for (d = 0; d < ndim; ++d)
+        free(data[d]);
+    free(ids);
+
+    return success;
+}
+
+/** Checks whether a point is inside a valid grid cell.
+ * @param gm Grid map
+ * @param i I index of the cell
+ * @param j J index of the cell
+ * @param x X coordinate
+ * @param y Y coordinate
+ * @return 1 for yes, 0 for no
+ */
+static int cell_containspoint(gridkmap* gm, int i, int j, double x, double y)
+{
+    double** gx = gm->gx;
+    double** gy = gm->gy;
+    double xs[4], ys[4];
+
+    xs[0] = gx[j][i];
+    xs[1] = gx[j][i + 1];
+    xs[2] = gx[j + 1][i + 1];
+    xs[3] = gx[j + 1][i];
+    if (!isfinite(xs[0] + xs[1] + xs[2] + xs[3]))
+        return 0;
+    if ((x < xs[0] && x < xs[1] && x < xs[2] && x < xs[3]) || (x > xs[0] && x > xs[1] && x > xs[2] && x > xs[3]))
+        return 0;
+    ys[0] = gy[j][i];
+    ys[1] = gy[j][i + 1];
+    ys[2] = gy[j + 1][i + 1];
+    ys[3] = gy[j + 1][i];
+
+    return poly_containspoint2(4, xs, ys, x, y);
+}
+
+/** Checks whether a point is inside a valid grid cell in the geographic
+ * mode. The cell edges are assumed to be great circle arcs.
+ * @param gm Grid map
+ * @param i I index of the cell
+ * @param j J index of the cell
+ * @param basis Basis of the plane tangent to the sphere at the point (see
+ *              gu_tangentplane())
+ * @return 1 for yes, 0 for no
+ */
+static int cell_containspoint_geo(gridkmap* gm, int i, int j, const double* basis)
+{
+    double** gx = gm->gx;
+    double** gy = gm->gy;
+    double xs[4], ys[4];
+
+    if (!isfinite(gx[j][i] + gx[j][i + 1] + gx[j + 1][i + 1] + gx[j + 1][i]))
+        return 0;
+    if (!gu_gnomonic(basis, gx[j][i], gy[j][i], &xs[0], &ys[0]) || !gu_gnomonic(basis, gx[j][i + 1], gy[j][i + 1], &xs[1], &ys[1]) || !gu_gnomonic(basis, gx[j + 1][i + 1], gy[j + 1][i + 1], &xs[2], &ys[2]) || !gu_gnomonic(basis, gx[j + 1][i], gy[j + 1][i], &xs[3], &ys[3]))
+        return 0;
+
+    return poly_containspoint2(4, xs, ys, 0.0, 0.0);
+}
+
+/** Tests rings of cells around a node for containing a point. Ring r
+ * consists of cells (i, j) with max(i0 - 1 - i, i - i0, j0 - 1 - j, j - j0) =
+ * r; ring 0 are the cells adjacent to the node.
+ * @param gm Grid map
+ * @param i0 I index of the node
+ * @param j0 J index of the node
+ * @param r1 First ring
+ * @param r2 Last ring
+ * @param x X coordinate
+ * @param y Y coordinate
+ * @param basis Tangent plane basis in the geographic mode; NULL otherwise
+ * @param iout pointer to returned I indice value
+ * @param jout pointer to returned J indice value
+ * @return 1 if successful, 0 otherwhile
+ */
+static int searchrings(gridkmap* gm, int i0, int j0, int r1, int r2, double x, double y, const double* basis, int* iout, int* jout)
+{
+    int r;
+
+    for (r = r1; r <= r2; ++r) {
+        int i1 = (i0 - 1 - r > 0) ? i0 - 1 - r : 0;
+        int i2 = (i0 + r < gm->nce1 - 1) ? i0 + r : gm->nce1 - 1;
+        int j1 = (j0 - 1 - r > 0) ? j0 - 1 - r : 0;
+        int j2 = (j0 + r < gm->nce2 - 1) ? j0 + r : gm->nce2 - 1;
+        int i, j;
+
+        for (j = j1; j <= j2; ++j) {
+            int border = (j == j0 - 1 - r || j == j0 + r);
+
+            for (i = i1; i <= i2; ++i) {
+                if (!border && i != i0 - 1 - r && i != i0 + r)
+                    continue;
+                if ((basis == NULL) ? cell_containspoint(gm, i, j, x, y) : cell_containspoint_geo(gm, i, j, basis)) {
+                    *iout = i;
+                    *jout = j;
+                    return 1;
+                }
+            }
+        }
+        if (i1 == 0 && j1 == 0 && i2 == gm->nce1 - 1 && j2 == gm->nce2 - 1)
+            break;
+    }
+
+    return 0;
+}
+
+/** Calculates indices (i,j) of a grid cell containing point (x,y) in the
+ * geographic mode. Tests the cells adjacent to several nearest nodes first,
+ * as nodes on a fold or a seam of a global grid can coincide with nodes
+ * elsewhere in the index space.
+ */
+static int xy2ij_geo(gridkmap* gm, double x, double y, int* iout, int* jout)
+{
+    size_t ids[NNEARESTGEO];
+    double dists[NNEARESTGEO];
+    double basis[9];
+    size_t n, k;
+    int i0 = 0, j0 = 0;
+
+    gu_tangentplane(x, y, basis);
+    n = kd_findknearest(gm->tree, basis, NNEARESTGEO, ids, dists);
+    for (k = 0; k < n; ++k) {
+        size_t id = kd_getnodeorigid(gm->tree, ids[k]);
+        int i = id % (gm->nce1 + 1);
+        int j = id / (gm->nce1 + 1);
+
+        if (k == 0) {
+            i0 = i;
+            j0 = j;
+        }
+        if (searchrings(gm, i, j, 0, 0, x, y, basis, iout, jout))
+            return 1;
+    }
+    if (n == 0)
+        return 0;
+
+    return searchrings(gm, i0, j0, 1, NRINGMAX, x, y, basis, iout, jout);
+}
+
+/** Calculates indices (i,j) of a grid cell containing point (x,y).
+ *
+ * Tests the cells adjacent to the grid node nearest to the point first. If
+ * none of them contains the point (e.g. in strongly skewed cells), tests
+ * rings of cells around them, up to NRINGMAX cells away.
+ *
+ * @param gm Grid map
+ * @param x X coordinate
+ * @param y Y coordinate
+ * @param iout pointer to returned I indice value
+ * @param jout pointer to returned J indice value
+ * @return 1 if successful, 0 otherwhile
  */
 int gridkmap_xy2ij(gridkmap* gm, double x, double y, int* iout, int* jout)
 {
@@ -79,54 +346,23 @@ int gridkmap_xy2ij(gridkmap* gm, double x, double y, int* iout, int* jout)
     double pos[2];
     size_t nearest;
     size_t id;
-    poly* p;
-    int i, j, i1, i2, j1, j2;
-    int success = 0;
+    int i0, j0;
+
+    if (gm->geographic)
+        return xy2ij_geo(gm, x, y, iout, jout);
 
     if (x < minmax[0] || y < minmax[1] || x > minmax[2] || y > minmax[3])
-        return success;
+        return 0;
 
     pos[0] = x;
     pos[1] = y;
     nearest = kd_findnearestnode(gm->tree, pos);
     id = kd_getnodeorigid(gm->tree, nearest);
-    p = poly_create();
-
-    j = id / (gm->nce1 + 1);
-    i = id % (gm->nce1 + 1);
-
-    i1 = (i > 0) ? i - 1 : i;
-    i2 = (i < gm->nce1) ? i + 1 : i;
-    j1 = (j > 0) ? j - 1 : j;
-    j2 = (j < gm->nce2) ? j + 1 : j;
-
-    /*
-     * TODO?: looks a bit heavyweight
-     */
-    for (j = j1; j <= j2 - 1; ++j)
-        for (i = i1; i <= i2 - 1; ++i) {
-            if (!isfinite(gm->gx[j][i]) || !isfinite(gm->gx[j][i + 1]) || !isfinite(gm->gx[j + 1][i + 1]) || !isfinite(gm->gx[j + 1][i]))
-                continue;
-            poly_addpoint(p, gm->gx[j][i], gm->gy[j][i]);
-            poly_addpoint(p, gm->gx[j][i + 1], gm->gy[j][i + 1]);
-            poly_addpoint(p, gm->gx[j + 1][i + 1], gm->gy[j + 1][i + 1]);
-            poly_addpoint(p, gm->gx[j + 1][i], gm->gy[j + 1][i]);
-            poly_addpoint(p, gm->gx[j][i], gm->gy[j][i]);
-
-            if (poly_containspoint(p, x, y)) {
-                success = 1;
-                *iout = i;
-                *jout = j;
-                goto finish;
-            }
-            poly_clear(p);
-        }
 
-  finish:
+    j0 = id / (gm->nce1 + 1);
+    i0 = id % (gm->nce1 + 1);
 
-    poly_destroy(p);
-
-    return success;
+    return searchrings(gm, i0, j0, 0, NRINGMAX, x, y, NULL, iout, jout);
 }
 
 /**
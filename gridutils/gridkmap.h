@@ -20,8 +20,11 @@
 struct gridkmap;
 typedef struct gridkmap gridkmap;
 
-gridkmap* gridkmap_build(int nce1, int nce2, double** gx, double** gy);
+gridkmap* gridkmap_build(int nce1, int nce2, double** gx, double** gy, int geographic);
 void gridkmap_destroy(gridkmap* gm);
+void gridkmap_write(gridkmap* gm, FILE* f);
+gridkmap* gridkmap_attach(int nce1, int nce2, double** gx, double** gy, char** pos, char* end);
+int gridkmap_update_region(gridkmap* gm, int imin, int imax, int jmin, int jmax);
 int gridkmap_xy2ij(gridkmap* gm, double x, double y, int* i, int* j);
 int gridkmap_getnce1(gridkmap* gm);
 int gridkmap_getnce2(gridkmap* gm);
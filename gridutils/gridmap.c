@@ -34,23 +34,111 @@
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <stdint.h>
+#include <float.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "nan.h"
 #include "poly.h"
 #include "gridnodes.h"
 #include "gridmap.h"
 #include "gridbmap.h"
 #include "gridkmap.h"
+#include "gridhmap.h"
+#include "gridrmap.h"
 #include "gucommon.h"
 
 #define EPS 1.0e-8
 #define EPS_ZERO 1.0e-5
 
+#define NBATCH 1024
+#define NCURVE 65536            /* size of the space-filling curve grid */
+#define NLANE 8                 /* points solved together in
+                                 * xy2fij_lanes() */
+#define NWALKMAX 100
+
+#define BUFSIZE 65536            /* multiple of 8 (see gu_checksum()) */
+#define FILE_MAGIC "gridmap"
+#define FILE_VERSION 6
+#define VERIFY_ENV "GRIDMAP_VERIFY"     /* environment variable that turns on
+                                         * checking the contents of index
+                                         * files by gridmap_load() */
+
+/*
+ * Coefficients of the bilinear mapping of a cell:
+ *   x = a * u * v + b * u + c * v + d
+ *   y = e * u * v + f * u + g * v + h
+ * together with the leading coefficient of the quadratic for u, so that
+ * xy2fij() does not need to access the grid nodes. The other coefficients of
+ * the quadratic are calculated in the same order of operations as from the
+ * nodes, so that the results are the same.
+ */
+typedef struct {
+    double a, b, c, d;
+    double e, f, g, h;
+    double A;                   /* a * f - b * e */
+    int sign;                   /* branch of sqrt(); 0 if unknown */
+    int degenerate;             /* flag: fabs(A) < EPS_ZERO */
+} cellcoeffs;
+
+/*
+ * A block of points located in cells, laid out by lane for xy2fij_lanes().
+ * A, B and C are the coefficients of the quadratic for u for each point.
+ */
+typedef struct {
+    double a[NLANE], b[NLANE], c[NLANE], d[NLANE];
+    double e[NLANE], f[NLANE], g[NLANE], h[NLANE];
+    double A[NLANE], B[NLANE], C[NLANE];
+    double sign[NLANE];
+    double x[NLANE], y[NLANE];
+    double fi0[NLANE], fj0[NLANE];      /* I and J indices of the cell; NaN
+                                         * if the mapping fails */
+    double degenerate[NLANE];           /* 1 if fabs(A) < EPS_ZERO; 0
+                                         * otherwise */
+    int status[NLANE];                  /* return value of xy2fij() */
+    int id[NLANE];                      /* index of the point in the batch */
+} lanes;
+
 struct gridmap {
     void* map;
     int type;
     int sign;
+    int batchflags;             /* GRIDMAP_BATCH_* */
+    int nce1;                   /* number of cells in e1 direction */
+    int nce2;                   /* number of cells in e2 direction */
+    double** gx;                /* reference to array of X coords
+                                 * [nce2+1][nce1+1] */
+    double** gy;                /* reference to array of Y coords
+                                 * [nce2+1][nce1+1] */
+    cellcoeffs* coeffs;         /* optional coefficients by cell id (j *
+                                 * nce1 + i) [nce2 * nce1] */
+    void* data;                 /* mapped index file (or NULL) */
+    size_t datasize;            /* size of the mapped index file */
 };
 
+/*
+ * Header of a grid map index file. It is followed by the X and Y node
+ * coordinates and the data of the map engine.
+ */
+typedef struct {
+    char magic[8];              /* FILE_MAGIC */
+    int version;                /* FILE_VERSION */
+    int sizeofsize;             /* sizeof(size_t) */
+    int type;                   /* GRIDMAP_TYPE_* */
+    int nce1;                   /* number of cells in e1 direction */
+    int nce2;                   /* number of cells in e2 direction */
+    int sign;                   /* branch of sqrt() in xy2fij() */
+    uint64_t checksum;          /* checksum of the grid (by the caller) */
+    uint64_t datachecksum;      /* checksum of the data after the header */
+    uint64_t size;              /* file size */
+} fileheader;
+
+static void gridmap_setbranch(gridmap* gm);
+static int calc_branch(gridmap* gm, int i, int j, double x, double y);
+
 /**
  */
 gridmap* gridmap_build(int nce1, int nce2, double** gx, double** gy, int type)
@@ -60,11 +148,23 @@ gridmap* gridmap_build(int nce1, int nce2, double** gx, double** gy, int type)
     gm->type = type;
     if (gm->type == GRIDMAP_TYPE_BINARY)
         gm->map = gridbmap_build(nce1, nce2, gx, gy);
-    else if (gm->type == GRIDMAP_TYPE_KDTREE)
-        gm->map = gridkmap_build(nce1, nce2, gx, gy);
+    else if (gm->type == GRIDMAP_TYPE_KDTREE || gm->type == GRIDMAP_TYPE_KDTREEGEO)
+        gm->map = gridkmap_build(nce1, nce2, gx, gy, gm->type == GRIDMAP_TYPE_KDTREEGEO);
+    else if (gm->type == GRIDMAP_TYPE_HASH)
+        gm->map = gridhmap_build(nce1, nce2, gx, gy);
+    else if (gm->type == GRIDMAP_TYPE_RASTER)
+        gm->map = gridrmap_build(nce1, nce2, gx, gy);
     else
         gu_quit("grid map type = %d: unknown type", type);
-    gm->sign = 0;
+    gm->nce1 = nce1;
+    gm->nce2 = nce2;
+    gm->gx = gx;
+    gm->gy = gy;
+    gm->batchflags = 0;
+    gm->coeffs = NULL;
+    gm->data = NULL;
+    gm->datasize = 0;
+    gridmap_setbranch(gm);
 
     return gm;
 }
@@ -73,23 +173,7 @@ gridmap* gridmap_build(int nce1, int nce2, double** gx, double** gy, int type)
  */
 gridmap* gridmap_build2(gridnodes* gn)
 {
-    gridmap* gm = malloc(sizeof(gridmap));
-    int nce1 = gridnodes_getnce1(gn);
-    int nce2 = gridnodes_getnce2(gn);
-    double** gx = gridnodes_getx(gn);
-    double** gy = gridnodes_gety(gn);
-    int type = gridnodes_getmaptype(gn);
-
-    gm->type = type;
-    if (gm->type == GRIDMAP_TYPE_BINARY)
-        gm->map = gridbmap_build(nce1, nce2, gx, gy);
-    else if (gm->type == GRIDMAP_TYPE_KDTREE)
-        gm->map = gridkmap_build(nce1, nce2, gx, gy);
-    else
-        gu_quit("grid map type = %d: unknown type", type);
-    gm->sign = 0;
-
-    return gm;
+    return gridmap_build(gridnodes_getnce1(gn), gridnodes_getnce2(gn), gridnodes_getx(gn), gridnodes_gety(gn), gridnodes_getmaptype(gn));
 }
 
 /**
@@ -98,12 +182,202 @@ void gridmap_destroy(gridmap* gm)
 {
     if (gm->type == GRIDMAP_TYPE_BINARY)
         gridbmap_destroy(gm->map);
-    else if (gm->type == GRIDMAP_TYPE_KDTREE)
+    else if (gm->type == GRIDMAP_TYPE_KDTREE || gm->type == GRIDMAP_TYPE_KDTREEGEO)
         gridkmap_destroy(gm->map);
+    else if (gm->type == GRIDMAP_TYPE_HASH)
+        gridhmap_destroy(gm->map);
+    else if (gm->type == GRIDMAP_TYPE_RASTER)
+        gridrmap_destroy(gm->map);
 
+    if (gm->coeffs != NULL)
+        free(gm->coeffs);
+    if (gm->data != NULL) {
+        free(gm->gx);
+        free(gm->gy);
+        munmap(gm->data, gm->datasize);
+    }
     free(gm);
 }
 
+/** Saves a grid map to a binary index file, so that it can be loaded by
+ * gridmap_load() rather than built again. The file contains the grid nodes
+ * and the search structure of the map; it can only be used on platforms with
+ * the same binary representation of data. The file is written under a
+ * temporary name and then renamed, so that concurrent readers never see an
+ * incomplete file.
+ *
+ * The grid nodes are written from gm->gx[0] and gm->gy[0] as contiguous
+ * blocks of (nce2 + 1) * (nce1 + 1) values each; this relies on the node
+ * arrays being allocated by gu_alloc2d().
+ *
+ * @param gm Grid map
+ * @param fname File name
+ * @param checksum Checksum identifying the grid (e.g. of the grid file, see
+ *                 gu_checksumfile()); is checked by gridmap_load()
+ */
+void gridmap_save(gridmap* gm, char* fname, uint64_t checksum)
+{
+    size_t nnodes = (size_t) (gm->nce1 + 1) * (gm->nce2 + 1);
+    char* tmpname = malloc(strlen(fname) + 32);
+    fileheader h;
+    FILE* f;
+    char buf[BUFSIZE];
+    size_t n;
+
+    sprintf(tmpname, "%s.%ld", fname, (long) getpid());
+    f = gu_fopen(tmpname, "w+");
+
+    memset(&h, 0, sizeof(h));
+    strcpy(h.magic, FILE_MAGIC);
+    h.version = FILE_VERSION;
+    h.sizeofsize = sizeof(size_t);
+    h.type = gm->type;
+    h.nce1 = gm->nce1;
+    h.nce2 = gm->nce2;
+    h.sign = gm->sign;
+    h.checksum = checksum;
+    gu_writeblock(f, &h, sizeof(h));
+
+    gu_writeblock(f, gm->gx[0], nnodes * sizeof(double));
+    gu_writeblock(f, gm->gy[0], nnodes * sizeof(double));
+    if (gm->type == GRIDMAP_TYPE_BINARY)
+        gridbmap_write(gm->map, f);
+    else if (gm->type == GRIDMAP_TYPE_KDTREE || gm->type == GRIDMAP_TYPE_KDTREEGEO)
+        gridkmap_write(gm->map, f);
+    else if (gm->type == GRIDMAP_TYPE_HASH)
+        gridhmap_write(gm->map, f);
+    else if (gm->type == GRIDMAP_TYPE_RASTER)
+        gridrmap_write(gm->map, f);
+
+    /*
+     * calculate the checksum of the data and update the header
+     */
+    if (fflush(f) != 0)
+        gu_quit("%s: %s", tmpname, strerror(errno));
+    h.size = ftell(f);
+    fseek(f, sizeof(h), SEEK_SET);
+    h.datachecksum = 0;
+    while ((n = fread(buf, 1, BUFSIZE, f)) > 0)
+        h.datachecksum = gu_checksum(h.datachecksum, buf, n);
+    fseek(f, 0, SEEK_SET);
+    gu_writeblock(f, &h, sizeof(h));
+    if (fclose(f) != 0)
+        gu_quit("%s: %s", tmpname, strerror(errno));
+
+    if (rename(tmpname, fname) != 0)
+        gu_quit("could not rename \"%s\" to \"%s\": %s", tmpname, fname, strerror(errno));
+    free(tmpname);
+}
+
+/** Checks whether the contents of index files should be verified on
+ * loading.
+ * @return 1 if the environment variable VERIFY_ENV is set to a non-empty
+ *         value other than "0", 0 otherwise
+ */
+static int verifyrequested(void)
+{
+    char* value = getenv(VERIFY_ENV);
+
+    return value != NULL && value[0] != 0 && strcmp(value, "0") != 0;
+}
+
+/** Loads a grid map from an index file written by gridmap_save(). The file
+ * is mapped to memory, and the grid nodes and the search structure are used
+ * in place. The node arrays of the loaded map can be obtained by
+ * gridmap_getxnodes() and gridmap_getynodes().
+ *
+ * The header of the file, the file size and the checksum of the grid are
+ * checked on every load. The checksum of the file contents is checked only
+ * if the environment variable GRIDMAP_VERIFY is set (to a value other than
+ * "0"), because it reads the whole file, while otherwise only the pages
+ * of the file used by the map are read from disk.
+ *
+ * @param fname File name
+ * @param checksum Checksum identifying the grid
+ * @return Grid map; NULL if the file does not exist, was saved with a
+ *         different checksum, or was written by a different version of the
+ *         code or on a platform with a different size of size_t (so that
+ *         the map should be built again)
+ */
+gridmap* gridmap_load(char* fname, uint64_t checksum)
+{
+    gridmap* gm;
+    fileheader* h;
+    struct stat st;
+    void* data;
+    char* pos;
+    char* end;
+    double* x;
+    double* y;
+    size_t nnodes;
+    int fd, j;
+
+    fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return NULL;
+        gu_quit("%s: %s", fname, strerror(errno));
+    }
+    if (fstat(fd, &st) != 0)
+        gu_quit("%s: %s", fname, strerror(errno));
+    if (st.st_size < (off_t) sizeof(fileheader))
+        gu_quit("%s: not a grid map index file", fname);
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        gu_quit("%s: %s", fname, strerror(errno));
+    close(fd);
+
+    h = data;
+    if (strncmp(h->magic, FILE_MAGIC, sizeof(h->magic)) != 0)
+        gu_quit("%s: not a grid map index file", fname);
+    if (h->version != FILE_VERSION || h->sizeofsize != sizeof(size_t) || h->checksum != checksum) {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    if (h->size != (uint64_t) st.st_size)
+        gu_quit("%s: incomplete grid map index file", fname);
+    if (h->nce1 <= 0 || h->nce2 <= 0 || ((uint64_t) h->nce1 + 1) * ((uint64_t) h->nce2 + 1) * sizeof(double) * 2 > h->size - sizeof(fileheader))
+        gu_quit("%s: grid map index file is corrupted", fname);
+    if (verifyrequested() && gu_checksum(0, (char*) data + sizeof(fileheader), st.st_size - sizeof(fileheader)) != h->datachecksum)
+        gu_quit("%s: grid map index file is corrupted", fname);
+
+    gm = malloc(sizeof(gridmap));
+    gm->type = h->type;
+    gm->sign = h->sign;
+    gm->batchflags = 0;
+    gm->nce1 = h->nce1;
+    gm->nce2 = h->nce2;
+    gm->coeffs = NULL;
+    gm->data = data;
+    gm->datasize = st.st_size;
+
+    pos = (char*) data;
+    end = pos + st.st_size;
+    (void) gu_readblock(&pos, end, sizeof(fileheader));
+    nnodes = (size_t) (gm->nce1 + 1) * (gm->nce2 + 1);
+    x = gu_readblock(&pos, end, nnodes * sizeof(double));
+    y = gu_readblock(&pos, end, nnodes * sizeof(double));
+    gm->gx = malloc((gm->nce2 + 1) * sizeof(double*));
+    gm->gy = malloc((gm->nce2 + 1) * sizeof(double*));
+    for (j = 0; j <= gm->nce2; ++j) {
+        gm->gx[j] = &x[(size_t) j * (gm->nce1 + 1)];
+        gm->gy[j] = &y[(size_t) j * (gm->nce1 + 1)];
+    }
+
+    if (gm->type == GRIDMAP_TYPE_BINARY)
+        gm->map = gridbmap_attach(gm->nce1, gm->nce2, gm->gx, gm->gy, &pos, end);
+    else if (gm->type == GRIDMAP_TYPE_KDTREE || gm->type == GRIDMAP_TYPE_KDTREEGEO)
+        gm->map = gridkmap_attach(gm->nce1, gm->nce2, gm->gx, gm->gy, &pos, end);
+    else if (gm->type == GRIDMAP_TYPE_HASH)
+        gm->map = gridhmap_attach(gm->nce1, gm->nce2, gm->gx, gm->gy, &pos, end);
+    else if (gm->type == GRIDMAP_TYPE_RASTER)
+        gm->map = gridrmap_attach(gm->nce1, gm->nce2, gm->gx, gm->gy, &pos, end);
+    else
+        gu_quit("%s: grid map type = %d: unknown type", fname, gm->type);
+
+    return gm;
+}
+
 /**
  */
 int gridmap_xy2ij(gridmap* gm, double x, double y, int* i, int* j)
@@ -117,47 +391,320 @@ int gridmap_xy2ij(gridmap* gm, double x, double y, int* i, int* j)
 
     if (gm->type == GRIDMAP_TYPE_BINARY)
         success = gridbmap_xy2ij(gm->map, x, y, i, j);
-    else if (gm->type == GRIDMAP_TYPE_KDTREE)
+    else if (gm->type == GRIDMAP_TYPE_KDTREE || gm->type == GRIDMAP_TYPE_KDTREEGEO)
         success = gridkmap_xy2ij(gm->map, x, y, i, j);
+    else if (gm->type == GRIDMAP_TYPE_HASH)
+        success = gridhmap_xy2ij(gm->map, x, y, i, j);
+    else if (gm->type == GRIDMAP_TYPE_RASTER)
+        success = gridrmap_xy2ij(gm->map, x, y, i, j);
 
     return success;
 }
 
-/** Calculates (x,y) coordinates for a point within the grid with
- * specified fractional indices (i,j).
+/** Checks whether a point is within a cell; if not, finds the edge of the
+ * cell to be crossed to get closer to the point.
+ * @param gm Grid map
+ * @param i I index of the cell
+ * @param j J index of the cell
+ * @param x X coordinate
+ * @param y Y coordinate
+ * @return -1 if the point is inside the cell; 0, 1, 2 or 3 for the edge to be
+ *         crossed towards j - 1, i + 1, j + 1 or i - 1 respectively; 4 if the
+ *         cell is invalid or the edge could not be determined
+ */
+static int cell_findexit(gridmap* gm, int i, int j, double x, double y)
+{
+    double** gx = gm->gx;
+    double** gy = gm->gy;
+    double xs[4], ys[4];
+    double area, maxdist;
+    int k, exit;
+
+    xs[0] = gx[j][i];
+    xs[1] = gx[j][i + 1];
+    xs[2] = gx[j + 1][i + 1];
+    xs[3] = gx[j + 1][i];
+    ys[0] = gy[j][i];
+    ys[1] = gy[j][i + 1];
+    ys[2] = gy[j + 1][i + 1];
+    ys[3] = gy[j + 1][i];
+    if (!isfinite(xs[0] + xs[1] + xs[2] + xs[3]))
+        return 4;
+    if (poly_containspoint2(4, xs, ys, x, y))
+        return -1;
+
+    /*
+     * cross the edge the point is "most outside" of, taking into account
+     * orientation of the cell
+     */
+    area = (xs[2] - xs[0]) * (ys[3] - ys[1]) - (xs[3] - xs[1]) * (ys[2] - ys[0]);
+    for (k = 0, exit = 4, maxdist = 0.0; k < 4; ++k) {
+        int k1 = (k + 1) % 4;
+        double dx = xs[k1] - xs[k];
+        double dy = ys[k1] - ys[k];
+        double len = hypot(dx, dy);
+        double dist;
+
+        if (len == 0.0)
+            continue;
+        dist = (dx * (y - ys[k]) - dy * (x - xs[k])) / len;
+        if (area < 0.0)
+            dist = -dist;
+        if (dist < maxdist) {
+            maxdist = dist;
+            exit = k;
+        }
+    }
+
+    return exit;
+}
+
+/** Calculates indices (i,j) of a grid cell containing point (x,y), starting
+ * the search from a specified cell. The search walks from cell to cell
+ * towards the point; if it leaves the grid or does not arrive within a fixed
+ * number of steps, the full search by gridmap_xy2ij() is conducted. Much
+ * faster than gridmap_xy2ij() for spatially coherent sequences of points,
+ * e.g. when the cell found for the previous point is used as the starting
+ * cell.
  *
- * The transformation used to compute the coords is a forward
- * tetragonal bilinear texture mapping.
+ * @param gm Grid map
+ * @param x X coordinate
+ * @param y Y coordinate
+ * @param i On input: I index of the starting cell (a full search is
+ *          conducted if the starting cell is outside the grid, e.g. -1); on
+ *          output: I index of the cell containing the point
+ * @param j On input: J index of the starting cell; on output: J index of
+ *          the cell containing the point
+ * @return 1 if successful, 0 otherwhile
+ */
+int gridmap_xy2ij_hint(gridmap* gm, double x, double y, int* i, int* j)
+{
+    static int di[] = { 0, 1, 0, -1 };
+    static int dj[] = { -1, 0, 1, 0 };
+    int ii = *i;
+    int jj = *j;
+    int step;
+
+    if (!isfinite(x + y)) {
+        *i = -1;
+        *j = -1;
+        return 0;
+    }
+    /*
+     * (the walk tests cells in the plane of X and Y, which is not valid for
+     * cells crossing the dateline)
+     */
+    if (gm->type == GRIDMAP_TYPE_KDTREEGEO)
+        return gridmap_xy2ij(gm, x, y, i, j);
+
+    for (step = 0; step < NWALKMAX; ++step) {
+        int exit;
+
+        if (ii < 0 || jj < 0 || ii >= gm->nce1 || jj >= gm->nce2)
+            break;
+        exit = cell_findexit(gm, ii, jj, x, y);
+        if (exit < 0) {
+            *i = ii;
+            *j = jj;
+            return 1;
+        }
+        if (exit > 3)
+            break;
+        ii += di[exit];
+        jj += dj[exit];
+    }
+
+    return gridmap_xy2ij(gm, x, y, i, j);
+}
+
+/** Sets options for the batch mapping functions. Should be called before
+ * the grid map is used from several threads.
+ * @param gm Grid map
+ * @param flags Combination of GRIDMAP_BATCH_* flags:
+ *              GRIDMAP_BATCH_WALK -- locate cells by gridmap_xy2ij_hint()
+ *                starting from the cell of the previous point
+ *              GRIDMAP_BATCH_MORTON, GRIDMAP_BATCH_HILBERT -- in
+ *                gridmap_xy2fij_batch(), process points in the order of
+ *                their position on the Morton (Z-order) or Hilbert curve
+ *                through the bounding rectangle of the points; the results
+ *                are returned in the original order
+ */
+void gridmap_setbatchflags(gridmap* gm, int flags)
+{
+    gm->batchflags = flags;
+}
+
+/** Calculates coefficients of the bilinear mapping for a cell.
+ * @param gm Grid map
+ * @param i I index of the cell
+ * @param j J index of the cell
+ */
+static void cell_setcoeffs(gridmap* gm, int i, int j)
+{
+    double** gx = gm->gx;
+    double** gy = gm->gy;
+    cellcoeffs* cc = &gm->coeffs[j * gm->nce1 + i];
+
+    cc->a = gx[j][i] - gx[j][i + 1] - gx[j + 1][i] + gx[j + 1][i + 1];
+    cc->b = gx[j][i + 1] - gx[j][i];
+    cc->c = gx[j + 1][i] - gx[j][i];
+    cc->d = gx[j][i];
+    cc->e = gy[j][i] - gy[j][i + 1] - gy[j + 1][i] + gy[j + 1][i + 1];
+    cc->f = gy[j][i + 1] - gy[j][i];
+    cc->g = gy[j + 1][i] - gy[j][i];
+    cc->h = gy[j][i];
+    cc->A = cc->a * cc->f - cc->b * cc->e;
+    cc->degenerate = (fabs(cc->A) < EPS_ZERO);
+    cc->sign = 0;
+    if (!cc->degenerate && isfinite(cc->A + cc->a * cc->h - cc->d * cc->e + cc->c * cc->f - cc->b * cc->g + cc->c * cc->h - cc->d * cc->g)) {
+        cc->sign = calc_branch(gm, i, j, (gx[j][i] + gx[j][i + 1] + gx[j + 1][i] + gx[j + 1][i + 1]) / 4.0, (gy[j][i] + gy[j][i + 1] + gy[j + 1][i] + gy[j + 1][i + 1]) / 4.0);
+        if (cc->sign == 0)
+            cc->sign = gm->sign;
+    }
+}
+
+/** Precomputes coefficients of the bilinear mapping for all cells of the
+ * grid, so that the conversions between physical and index space do not
+ * need to access the grid nodes. Takes about 80 bytes per cell. Must be
+ * called before the map is used concurrently.
  *
- * @param gm a tree structure returned from xytoij_init
+ * The results are bitwise identical to those calculated from the grid
+ * nodes, except that the branch of sqrt() in the inverse mapping is
+ * calculated for each cell separately (at the cell centre) rather than
+ * once for the grid (see gridmap_setbranch()).
+ *
+ * Does nothing for geographic grid maps, for which the mapping is conducted
+ * in the plane tangent to the sphere at the point.
+ *
+ * @param gm Grid map
+ */
+void gridmap_buildcoeffs(gridmap* gm)
+{
+    int i, j;
+
+    if (gm->coeffs != NULL || gm->type == GRIDMAP_TYPE_KDTREEGEO)
+        return;
+
+    gm->coeffs = malloc((size_t) gm->nce1 * gm->nce2 * sizeof(cellcoeffs));
+    for (j = 0; j < gm->nce2; ++j)
+        for (i = 0; i < gm->nce1; ++i)
+            cell_setcoeffs(gm, i, j);
+}
+
+/** Updates a grid map after the coordinates of the grid nodes within a
+ * rectangle in index space have been modified (e.g. by editing the grid in
+ * place). This is usually much faster than building the map again:
+ *
+ * -- for the binary tree, only the boundaries of the tree nodes whose
+ *    subgrids contain modified grid nodes are formed again;
+ * -- for the kd-tree, only the smallest subtree containing the old and the
+ *    new positions of the modified grid nodes is built again;
+ * -- the precomputed cell coefficients (see gridmap_buildcoeffs()) are
+ *    recalculated for the cells adjacent to the modified grid nodes only.
+ *
+ * The spatial hash and the raster, as well as a binary tree or a kd-tree
+ * that can not be updated (e.g. if the set of valid grid nodes has changed or
+ * a node of the kd-tree has moved outside its bounding rectangle), are built
+ * again.
+ *
+ * A map loaded by gridmap_load() can not be updated, as its grid nodes are
+ * read-only.
+ *
+ * @param gm Grid map
+ * @param imin Minimal I index of the modified nodes
+ * @param imax Maximal I index of the modified nodes
+ * @param jmin Minimal J index of the modified nodes
+ * @param jmax Maximal J index of the modified nodes
+ */
+void gridmap_update_region(gridmap* gm, int imin, int imax, int jmin, int jmax)
+{
+    int sign;
+    int i, j;
+
+    if (gm->data != NULL)
+        gu_quit("gridmap_update_region(): can not update a grid map loaded from an index file");
+
+    if (imin < 0)
+        imin = 0;
+    if (imax > gm->nce1)
+        imax = gm->nce1;
+    if (jmin < 0)
+        jmin = 0;
+    if (jmax > gm->nce2)
+        jmax = gm->nce2;
+    if (imin > imax || jmin > jmax)
+        return;
+
+    if (gm->type == GRIDMAP_TYPE_BINARY) {
+        if (!gridbmap_update_region(gm->map, imin, imax, jmin, jmax)) {
+            gridbmap_destroy(gm->map);
+            gm->map = gridbmap_build(gm->nce1, gm->nce2, gm->gx, gm->gy);
+        }
+    } else if (gm->type == GRIDMAP_TYPE_KDTREE || gm->type == GRIDMAP_TYPE_KDTREEGEO) {
+        if (!gridkmap_update_region(gm->map, imin, imax, jmin, jmax)) {
+            gridkmap_destroy(gm->map);
+            gm->map = gridkmap_build(gm->nce1, gm->nce2, gm->gx, gm->gy, gm->type == GRIDMAP_TYPE_KDTREEGEO);
+        }
+    } else if (gm->type == GRIDMAP_TYPE_HASH) {
+        gridhmap_destroy(gm->map);
+        gm->map = gridhmap_build(gm->nce1, gm->nce2, gm->gx, gm->gy);
+    } else if (gm->type == GRIDMAP_TYPE_RASTER) {
+        gridrmap_destroy(gm->map);
+        gm->map = gridrmap_build(gm->nce1, gm->nce2, gm->gx, gm->gy);
+    }
+
+    /*
+     * the branch of sqrt() for the grid is used for the cells where it can
+     * not be calculated, so that the coefficients of all cells need to be
+     * recalculated if it changes
+     */
+    sign = gm->sign;
+    gridmap_setbranch(gm);
+    if (gm->coeffs != NULL) {
+        if (gm->sign != sign) {
+            free(gm->coeffs);
+            gm->coeffs = NULL;
+            gridmap_buildcoeffs(gm);
+        } else
+            for (j = (jmin > 0) ? jmin - 1 : 0; j <= jmax && j < gm->nce2; ++j)
+                for (i = (imin > 0) ? imin - 1 : 0; i <= imax && i < gm->nce1; ++i)
+                    cell_setcoeffs(gm, i, j);
+    }
+}
+
+/** Shifts longitude by a multiple of 360 degrees to be within 180 degrees
+ * of a reference longitude.
+ */
+static double unwrap(double lon, double lon0)
+{
+    while (lon - lon0 > 180.0)
+        lon -= 360.0;
+    while (lon - lon0 < -180.0)
+        lon += 360.0;
+
+    return lon;
+}
+
+/** Calculates (x,y) coordinates for a point with specified fractional
+ * indices (i,j) for a grid map with cached node arrays.
+ * @param gm Grid map
  * @param fi I indice value
  * @param fj J indice value
  * @param x Pointer to returned X coordinate
  * @param y Pointer to returned Y coordinate
  * @return non-zero if successful
  */
-int gridmap_fij2xy(gridmap* gm, double fi, double fj, double* x, double* y)
+static int fij2xy(gridmap* gm, double fi, double fj, double* x, double* y)
 {
     int status = 1;
-    double** gx = NULL;
-    double** gy = NULL;
-    int nce1 = -1, nce2 = -1;
+    double** gx = gm->gx;
+    double** gy = gm->gy;
+    int nce1 = gm->nce1;
+    int nce2 = gm->nce2;
     int i, j;
     double u, v;
     double a, b, c, d, e, f, g, h;
 
-    if (gm->type == GRIDMAP_TYPE_BINARY) {
-        gx = gridbmap_getxnodes(gm->map);
-        gy = gridbmap_getynodes(gm->map);
-        nce1 = gridbmap_getnce1(gm->map);
-        nce2 = gridbmap_getnce2(gm->map);
-    } else if (gm->type == GRIDMAP_TYPE_KDTREE) {
-        gx = gridkmap_getxnodes(gm->map);
-        gy = gridkmap_getynodes(gm->map);
-        nce1 = gridkmap_getnce1(gm->map);
-        nce2 = gridkmap_getnce2(gm->map);
-    }
-
     /*
      * Trim I to range 0 to nce1 
      */
@@ -190,7 +737,20 @@ int gridmap_fij2xy(gridmap* gm, double fi, double fj, double* x, double* y)
     u = fi - i;
     v = fj - j;
 
-    if (u == 0.0 && v == 0.0) {
+    if (gm->type == GRIDMAP_TYPE_KDTREEGEO) {
+        /*
+         * interpolate longitudes unwrapped relative to the first corner
+         */
+        int i1 = (u == 0.0) ? i : i + 1;
+        int j1 = (v == 0.0) ? j : j + 1;
+        double x00 = gx[j][i];
+        double x10 = unwrap(gx[j][i1], x00);
+        double x01 = unwrap(gx[j1][i], x00);
+        double x11 = unwrap(gx[j1][i1], x00);
+
+        *x = x00 * (1.0 - u) * (1.0 - v) + x10 * u * (1.0 - v) + x01 * (1.0 - u) * v + x11 * u * v;
+        *y = gy[j][i] * (1.0 - u) * (1.0 - v) + gy[j][i1] * u * (1.0 - v) + gy[j1][i] * (1.0 - u) * v + gy[j1][i1] * u * v;
+    } else if (u == 0.0 && v == 0.0) {
         *x = gx[j][i];
         *y = gy[j][i];
     } else if (u == 0.0) {
@@ -199,6 +759,11 @@ int gridmap_fij2xy(gridmap* gm, double fi, double fj, double* x, double* y)
     } else if (v == 0.0) {
         *x = gx[j][i + 1] * u + gx[j][i] * (1.0 - u);
         *y = gy[j][i + 1] * u + gy[j][i] * (1.0 - u);
+    } else if (gm->coeffs != NULL) {
+        cellcoeffs* cc = &gm->coeffs[j * nce1 + i];
+
+        *x = cc->a * u * v + cc->b * u + cc->c * v + cc->d;
+        *y = cc->e * u * v + cc->f * u + cc->g * v + cc->h;
     } else {
         a = gx[j][i] - gx[j][i + 1] - gx[j + 1][i] + gx[j + 1][i + 1];
         b = gx[j][i + 1] - gx[j][i];
@@ -216,36 +781,40 @@ int gridmap_fij2xy(gridmap* gm, double fi, double fj, double* x, double* y)
     return status;
 }
 
-/** Calculates the branch of sqrt() to be taken in gridbmap_xy2fij(). Has to be
- * called only once for a grid.
+/** Calculates (x,y) coordinates for a point within the grid with
+ * specified fractional indices (i,j).
+ *
+ * The transformation used to compute the coords is a forward
+ * tetragonal bilinear texture mapping.
+ *
+ * @param gm a tree structure returned from xytoij_init
+ * @param fi I indice value
+ * @param fj J indice value
+ * @param x Pointer to returned X coordinate
+ * @param y Pointer to returned Y coordinate
+ * @return non-zero if successful
+ */
+int gridmap_fij2xy(gridmap* gm, double fi, double fj, double* x, double* y)
+{
+    return fij2xy(gm, fi, fj, x, y);
+}
+
+/** Calculates the branch of sqrt() to be taken in xy2fij() for a given cell.
  * 
  * @param gm Grid map
- * @param x X coordinate
- * @param y Y coordinate
+ * @param i I index of the cell
+ * @param j J index of the cell
+ * @param x X coordinate of a point within the cell
+ * @param y Y coordinate of a point within the cell
  * @return 1 or -1 if successful; 0 otherwhile
  */
-static int calc_branch(gridmap* gm, double x, double y)
+static int calc_branch(gridmap* gm, int i, int j, double x, double y)
 {
-    int i, j;
-    double** gx = NULL;
-    double** gy = NULL;
+    double** gx = gm->gx;
+    double** gy = gm->gy;
     int sign = 1;
     double error[2];
 
-    /*
-     * normally one tries xytoij() before calling calc_branch() 
-     */
-    if (gridmap_xy2ij(gm, x, y, &i, &j) == 0)
-        return 0;               /* failed */
-
-    if (gm->type == GRIDMAP_TYPE_BINARY) {
-        gx = gridbmap_getxnodes(gm->map);
-        gy = gridbmap_getynodes(gm->map);
-    } else if (gm->type == GRIDMAP_TYPE_KDTREE) {
-        gx = gridkmap_getxnodes(gm->map);
-        gy = gridkmap_getynodes(gm->map);
-    }
-
     {
         double a = gx[j][i] - gx[j][i + 1] - gx[j + 1][i] + gx[j + 1][i + 1];
         double b = gx[j][i + 1] - gx[j][i];
@@ -295,6 +864,210 @@ static int calc_branch(gridmap* gm, double x, double y)
     return -1;
 }
 
+/** Sets the branch of sqrt() to be taken in xy2fij() for the grid. Uses the
+ * centre of the first valid non-degenerate cell. Is called once when the map
+ * is built, so that the mapping does not modify the map afterwards.
+ *
+ * @param gm Grid map
+ */
+static void gridmap_setbranch(gridmap* gm)
+{
+    double** gx = gm->gx;
+    double** gy = gm->gy;
+    int i, j;
+
+    gm->sign = 0;
+    for (j = 0; j < gm->nce2; ++j) {
+        for (i = 0; i < gm->nce1; ++i) {
+            double x, y;
+
+            if (!isfinite(gx[j][i] + gx[j][i + 1] + gx[j + 1][i] + gx[j + 1][i + 1]))
+                continue;
+            x = (gx[j][i] + gx[j][i + 1] + gx[j + 1][i] + gx[j + 1][i + 1]) / 4.0;
+            y = (gy[j][i] + gy[j][i + 1] + gy[j + 1][i] + gy[j + 1][i + 1]) / 4.0;
+            gm->sign = calc_branch(gm, i, j, x, y);
+            if (gm->sign != 0)
+                return;
+        }
+    }
+}
+
+/** Calculates fractional indices of a point within a given grid cell using
+ * the precomputed cell coefficients.
+ * @param gm Grid map
+ * @param i I index of the cell containing the point
+ * @param j J index of the cell containing the point
+ * @param x X coordinate
+ * @param y Y coordinate
+ * @param fi Pointer to returned fractional I index
+ * @param fj Pointer to returned fractional J index
+ * @return 1 if successful, 0 otherwise
+ */
+static int xy2fij_coeffs(gridmap* gm, int i, int j, double x, double y, double* fi, double* fj)
+{
+    cellcoeffs* cc = &gm->coeffs[j * gm->nce1 + i];
+    double B = cc->e * x - cc->a * y + cc->a * cc->h - cc->d * cc->e + cc->c * cc->f - cc->b * cc->g;
+    double C = cc->g * x - cc->c * y + cc->c * cc->h - cc->d * cc->g;
+    double u, v, d1, d2;
+
+    if (cc->degenerate)
+        u = -C / B * (1.0 + cc->A * C / B / B);
+    else {
+        if (cc->sign == 0)
+            return 0;           /* failed */
+        u = (-B + cc->sign * sqrt(B * B - 4.0 * cc->A * C)) / (2.0 * cc->A);
+    }
+    d1 = cc->a * u + cc->c;
+    d2 = cc->e * u + cc->g;
+    v = (fabs(d2) > fabs(d1)) ? (y - cc->f * u - cc->h) / d2 : (x - cc->b * u - cc->d) / d1;
+
+    if (u < 0.0)
+        u = 0.0;
+    else if (u >= 1.0)
+        u = 1.0 - EPS;
+    if (v < 0.0)
+        v = 0.0;
+    else if (v >= 1.0)
+        v = 1.0 - EPS;
+
+    *fi = i + u;
+    *fj = j + v;
+
+    return 1;
+}
+
+/** Calculates fractional indices of a point within a given grid cell from
+ * the coordinates of the cell corners.
+ * @param sign Branch of sqrt()
+ * @param i I index of the cell containing the point
+ * @param j J index of the cell containing the point
+ * @param xs X coordinates of corners (i, j), (i + 1, j), (i, j + 1) and
+ *           (i + 1, j + 1)
+ * @param ys Y coordinates of the corners
+ * @param x X coordinate
+ * @param y Y coordinate
+ * @param fi Pointer to returned fractional I index
+ * @param fj Pointer to returned fractional J index
+ * @return 1 if successful, 0 otherwise
+ */
+static int xy2fij_corners(int sign, int i, int j, const double* xs, const double* ys, double x, double y, double* fi, double* fj)
+{
+    double a = xs[0] - xs[1] - xs[2] + xs[3];
+    double b = xs[1] - xs[0];
+    double c = xs[2] - xs[0];
+    double d = xs[0];
+    double e = ys[0] - ys[1] - ys[2] + ys[3];
+    double f = ys[1] - ys[0];
+    double g = ys[2] - ys[0];
+    double h = ys[0];
+
+    double A = a * f - b * e;
+    double B = e * x - a * y + a * h - d * e + c * f - b * g;
+    double C = g * x - c * y + c * h - d * g;
+
+    double u, v, d1, d2;
+
+    if (fabs(A) < EPS_ZERO)
+        u = -C / B * (1.0 + A * C / B / B);
+    else {
+        if (sign == 0)
+            return 0;           /* failed */
+        u = (-B + sign * sqrt(B * B - 4.0 * A * C)) / (2.0 * A);
+    }
+    d1 = a * u + c;
+    d2 = e * u + g;
+    v = (fabs(d2) > fabs(d1)) ? (y - f * u - h) / d2 : (x - b * u - d) / d1;
+
+    if (u < 0.0)
+        u = 0.0;
+    else if (u >= 1.0)
+        u = 1.0 - EPS;
+    if (v < 0.0)
+        v = 0.0;
+    else if (v >= 1.0)
+        v = 1.0 - EPS;
+
+    *fi = i + u;
+    *fj = j + v;
+
+    return 1;
+}
+
+/** Calculates fractional indices of a point within a given grid cell from
+ * the cell nodes.
+ * @param gm Grid map
+ * @param i I index of the cell containing the point
+ * @param j J index of the cell containing the point
+ * @param x X coordinate
+ * @param y Y coordinate
+ * @param fi Pointer to returned fractional I index
+ * @param fj Pointer to returned fractional J index
+ * @return 1 if successful, 0 otherwise
+ */
+static int xy2fij_nodes(gridmap* gm, int i, int j, double x, double y, double* fi, double* fj)
+{
+    double** gx = gm->gx;
+    double** gy = gm->gy;
+    double xs[4], ys[4];
+
+    xs[0] = gx[j][i];
+    xs[1] = gx[j][i + 1];
+    xs[2] = gx[j + 1][i];
+    xs[3] = gx[j + 1][i + 1];
+    ys[0] = gy[j][i];
+    ys[1] = gy[j][i + 1];
+    ys[2] = gy[j + 1][i];
+    ys[3] = gy[j + 1][i + 1];
+
+    return xy2fij_corners(gm->sign, i, j, xs, ys, x, y, fi, fj);
+}
+
+/** Calculates fractional indices of a point within a given grid cell for a
+ * geographic grid map. The cell corners are projected on the plane tangent
+ * to the sphere at the point, so that the mapping is not affected by the
+ * dateline and is accurate near the poles.
+ * @param gm Grid map
+ * @param i I index of the cell containing the point
+ * @param j J index of the cell containing the point
+ * @param x Longitude (degrees)
+ * @param y Latitude (degrees)
+ * @param fi Pointer to returned fractional I index
+ * @param fj Pointer to returned fractional J index
+ * @return 1 if successful, 0 otherwise
+ */
+static int xy2fij_geo(gridmap* gm, int i, int j, double x, double y, double* fi, double* fj)
+{
+    double** gx = gm->gx;
+    double** gy = gm->gy;
+    double basis[9];
+    double xs[4], ys[4];
+
+    gu_tangentplane(x, y, basis);
+    if (!gu_gnomonic(basis, gx[j][i], gy[j][i], &xs[0], &ys[0]) || !gu_gnomonic(basis, gx[j][i + 1], gy[j][i + 1], &xs[1], &ys[1]) || !gu_gnomonic(basis, gx[j + 1][i], gy[j + 1][i], &xs[2], &ys[2]) || !gu_gnomonic(basis, gx[j + 1][i + 1], gy[j + 1][i + 1], &xs[3], &ys[3]))
+        return 0;
+
+    return xy2fij_corners(gm->sign, i, j, xs, ys, 0.0, 0.0, fi, fj);
+}
+
+/** Calculates fractional indices of a point within a given grid cell.
+ * @param gm Grid map
+ * @param i I index of the cell containing the point
+ * @param j J index of the cell containing the point
+ * @param x X coordinate
+ * @param y Y coordinate
+ * @param fi Pointer to returned fractional I index
+ * @param fj Pointer to returned fractional J index
+ * @return 1 if successful, 0 otherwise
+ */
+static int xy2fij(gridmap* gm, int i, int j, double x, double y, double* fi, double* fj)
+{
+    if (gm->type == GRIDMAP_TYPE_KDTREEGEO)
+        return xy2fij_geo(gm, i, j, x, y, fi, fj);
+    if (gm->coeffs != NULL)
+        return xy2fij_coeffs(gm, i, j, x, y, fi, fj);
+    return xy2fij_nodes(gm, i, j, x, y, fi, fj);
+}
+
 /** Calculates (x,y) coordinates for a point within a numerical grid specified
  * by fractional indices (i,j).
  *
@@ -314,8 +1087,6 @@ static int calc_branch(gridmap* gm, double x, double y)
 int gridmap_xy2fij(gridmap* gm, double x, double y, double* fi, double* fj)
 {
     int i, j;
-    double** gx = NULL;
-    double** gy = NULL;
 
     *fi = NaN;
     *fj = NaN;
@@ -323,15 +1094,42 @@ int gridmap_xy2fij(gridmap* gm, double x, double y, double* fi, double* fj)
     if (gridmap_xy2ij(gm, x, y, &i, &j) == 0)
         return 0;               /* failed */
 
-    if (gm->type == GRIDMAP_TYPE_BINARY) {
-        gx = gridbmap_getxnodes(gm->map);
-        gy = gridbmap_getynodes(gm->map);
-    } else if (gm->type == GRIDMAP_TYPE_KDTREE) {
-        gx = gridkmap_getxnodes(gm->map);
-        gy = gridkmap_getynodes(gm->map);
-    }
+    return xy2fij(gm, i, j, x, y, fi, fj);
+}
 
-    {
+/** Puts a point located in a cell into a lane of a block for
+ * xy2fij_lanes(). The coefficients are calculated in the same way as in
+ * xy2fij_coeffs() or xy2fij_nodes(), so that the results are the same.
+ * @param gm Grid map
+ * @param l Block of points
+ * @param k Lane
+ * @param id Index of the point in the batch
+ * @param i I index of the cell containing the point
+ * @param j J index of the cell containing the point
+ * @param x X coordinate
+ * @param y Y coordinate
+ */
+static void lanes_set(gridmap* gm, lanes* l, int k, int id, int i, int j, double x, double y)
+{
+    if (gm->coeffs != NULL) {
+        cellcoeffs* cc = &gm->coeffs[j * gm->nce1 + i];
+
+        l->a[k] = cc->a;
+        l->b[k] = cc->b;
+        l->c[k] = cc->c;
+        l->d[k] = cc->d;
+        l->e[k] = cc->e;
+        l->f[k] = cc->f;
+        l->g[k] = cc->g;
+        l->h[k] = cc->h;
+        l->A[k] = cc->A;
+        l->B[k] = cc->e * x - cc->a * y + cc->a * cc->h - cc->d * cc->e + cc->c * cc->f - cc->b * cc->g;
+        l->C[k] = cc->g * x - cc->c * y + cc->c * cc->h - cc->d * cc->g;
+        l->sign[k] = cc->sign;
+        l->degenerate[k] = cc->degenerate ? 1.0 : 0.0;
+    } else {
+        double** gx = gm->gx;
+        double** gy = gm->gy;
         double a = gx[j][i] - gx[j][i + 1] - gx[j + 1][i] + gx[j + 1][i + 1];
         double b = gx[j][i + 1] - gx[j][i];
         double c = gx[j + 1][i] - gx[j][i];
@@ -341,66 +1139,441 @@ int gridmap_xy2fij(gridmap* gm, double x, double y, double* fi, double* fj)
         double g = gy[j + 1][i] - gy[j][i];
         double h = gy[j][i];
 
-        double A = a * f - b * e;
-        double B = e * x - a * y + a * h - d * e + c * f - b * g;
-        double C = g * x - c * y + c * h - d * g;
+        l->a[k] = a;
+        l->b[k] = b;
+        l->c[k] = c;
+        l->d[k] = d;
+        l->e[k] = e;
+        l->f[k] = f;
+        l->g[k] = g;
+        l->h[k] = h;
+        l->A[k] = a * f - b * e;
+        l->B[k] = e * x - a * y + a * h - d * e + c * f - b * g;
+        l->C[k] = g * x - c * y + c * h - d * g;
+        l->sign[k] = gm->sign;
+        l->degenerate[k] = (fabs(l->A[k]) < EPS_ZERO) ? 1.0 : 0.0;
+    }
+    l->x[k] = x;
+    l->y[k] = y;
+    l->status[k] = l->degenerate[k] != 0.0 || l->sign[k] != 0.0;
+    l->fi0[k] = (l->status[k]) ? i : NaN;
+    l->fj0[k] = (l->status[k]) ? j : NaN;
+    l->id[k] = id;
+}
+
+/** Calculates fractional indices for a full block of points located in
+ * cells. Does the same as xy2fij_coeffs() for each lane, but without
+ * branches: both roots are calculated and the right one is selected, so
+ * that the loop can be vectorised by the compiler.
+ * @param l Block of points
+ * @param fi Output array of fractional I indices [NLANE]
+ * @param fj Output array of fractional J indices [NLANE]
+ */
+static void xy2fij_lanes(lanes* l, double* fi, double* fj)
+{
+    int k;
 
-        double u, v, d1, d2;
+#if defined(_OPENMP)
+#pragma omp simd
+#endif
+    for (k = 0; k < NLANE; ++k) {
+        double A = l->A[k];
+        double B = l->B[k];
+        double C = l->C[k];
+        double ulin = -C / B * (1.0 + A * C / B / B);
+        double uquad = (-B + l->sign[k] * sqrt(B * B - 4.0 * A * C)) / (2.0 * A);
+        double u = (l->degenerate[k] != 0.0) ? ulin : uquad;
+        double d1 = l->a[k] * u + l->c[k];
+        double d2 = l->e[k] * u + l->g[k];
+        double vy = (l->y[k] - l->f[k] * u - l->h[k]) / d2;
+        double vx = (l->x[k] - l->b[k] * u - l->d[k]) / d1;
+        double v = (fabs(d2) > fabs(d1)) ? vy : vx;
 
-        if (fabs(A) < EPS_ZERO)
-            u = -C / B * (1.0 + A * C / B / B);
-        else {
-            if (gm->sign == 0) {
-                gm->sign = calc_branch(gm, x, y);
-                if (gm->sign == 0)
-                    return 0;   /* failed */
+        u = (u < 0.0) ? 0.0 : u;
+        u = (u >= 1.0) ? 1.0 - EPS : u;
+        v = (v < 0.0) ? 0.0 : v;
+        v = (v >= 1.0) ? 1.0 - EPS : v;
+
+        fi[k] = l->fi0[k] + u;
+        fj[k] = l->fj0[k] + v;
+    }
+}
+
+/** Finds cells containing an array of points. The map type is resolved once
+ * for the whole array rather than for each point.
+ * @param gm Grid map
+ * @param n Number of points
+ * @param x Array of X coordinates
+ * @param y Array of Y coordinates
+ * @param stride Distance between consecutive points in the input arrays
+ *               (in doubles)
+ * @param i Output array of I indices [n]
+ * @param j Output array of J indices [n]
+ */
+static void locate(gridmap* gm, int n, double* x, double* y, int stride, int* i, int* j)
+{
+    int ii;
+
+    if (gm->batchflags & GRIDMAP_BATCH_WALK) {
+        int ihint = -1, jhint = -1;
+
+        for (ii = 0; ii < n; ++ii, x += stride, y += stride) {
+            i[ii] = ihint;
+            j[ii] = jhint;
+            if (gridmap_xy2ij_hint(gm, *x, *y, &i[ii], &j[ii])) {
+                ihint = i[ii];
+                jhint = j[ii];
             }
-            u = (-B + gm->sign * sqrt(B * B - 4.0 * A * C)) / (2.0 * A);
         }
-        d1 = a * u + c;
-        d2 = e * u + g;
-        v = (fabs(d2) > fabs(d1)) ? (y - f * u - h) / d2 : (x - b * u - d) / d1;
+        return;
+    }
+
+    for (ii = 0; ii < n; ++ii) {
+        i[ii] = -1;
+        j[ii] = -1;
+    }
+
+    if (gm->type == GRIDMAP_TYPE_BINARY) {
+        gridbmap* map = gm->map;
 
-        if (u < 0.0)
-            u = 0.0;
-        else if (u >= 1.0)
-            u = 1.0 - EPS;
-        if (v < 0.0)
-            v = 0.0;
-        else if (v >= 1.0)
-            v = 1.0 - EPS;
+        for (ii = 0; ii < n; ++ii, x += stride, y += stride)
+            if (isfinite(*x + *y))
+                (void) gridbmap_xy2ij(map, *x, *y, &i[ii], &j[ii]);
+    } else if (gm->type == GRIDMAP_TYPE_KDTREE || gm->type == GRIDMAP_TYPE_KDTREEGEO) {
+        gridkmap* map = gm->map;
 
-        *fi = i + u;
-        *fj = j + v;
+        for (ii = 0; ii < n; ++ii, x += stride, y += stride)
+            if (isfinite(*x + *y))
+                (void) gridkmap_xy2ij(map, *x, *y, &i[ii], &j[ii]);
+    } else if (gm->type == GRIDMAP_TYPE_HASH) {
+        gridhmap* map = gm->map;
+
+        for (ii = 0; ii < n; ++ii, x += stride, y += stride)
+            if (isfinite(*x + *y))
+                (void) gridhmap_xy2ij(map, *x, *y, &i[ii], &j[ii]);
+    } else if (gm->type == GRIDMAP_TYPE_RASTER) {
+        gridrmap* map = gm->map;
+
+        for (ii = 0; ii < n; ++ii, x += stride, y += stride)
+            if (isfinite(*x + *y))
+                (void) gridrmap_xy2ij(map, *x, *y, &i[ii], &j[ii]);
     }
+}
 
-    return 1;
+/** Calculates fractional indices for an array of points in the given
+ * order.
+ */
+static int xy2fij_batch(gridmap* gm, int n, double* x, double* y, int stride, double* fi, double* fj, int* status)
+{
+    int nsuccess = 0;
+    int ii;
+
+#if defined(_OPENMP)
+#pragma omp parallel for reduction(+:nsuccess) schedule(dynamic)
+#endif
+    for (ii = 0; ii < n; ii += NBATCH) {
+        int nb = (n - ii < NBATCH) ? n - ii : NBATCH;
+        double* xx = &x[(size_t) ii * stride];
+        double* yy = &y[(size_t) ii * stride];
+        int i[NBATCH], j[NBATCH];
+        lanes l;
+        int nl = 0;
+        int k;
+
+        locate(gm, nb, xx, yy, stride, i, j);
+
+        for (k = 0; k < nb; ++k) {
+            fi[ii + k] = NaN;
+            fj[ii + k] = NaN;
+            if (status != NULL)
+                status[ii + k] = 0;
+        }
+
+        /*
+         * solve full blocks of located points together; the rest (and
+         * all points of a geographic map) one by one
+         */
+        for (k = 0; k < nb; ++k) {
+            if (i[k] < 0)
+                continue;
+            if (gm->type != GRIDMAP_TYPE_KDTREEGEO) {
+                lanes_set(gm, &l, nl, k, i[k], j[k], xx[k * stride], yy[k * stride]);
+                nl++;
+                if (nl == NLANE) {
+                    double lfi[NLANE], lfj[NLANE];
+                    int kk;
+
+                    xy2fij_lanes(&l, lfi, lfj);
+                    for (kk = 0; kk < NLANE; ++kk) {
+                        fi[ii + l.id[kk]] = lfi[kk];
+                        fj[ii + l.id[kk]] = lfj[kk];
+                        if (status != NULL)
+                            status[ii + l.id[kk]] = l.status[kk];
+                        nsuccess += l.status[kk];
+                    }
+                    nl = 0;
+                }
+            } else {
+                int success = xy2fij(gm, i[k], j[k], xx[k * stride], yy[k * stride], &fi[ii + k], &fj[ii + k]);
+
+                if (status != NULL)
+                    status[ii + k] = success;
+                nsuccess += success;
+            }
+        }
+        for (k = 0; k < nl; ++k) {
+            int id = l.id[k];
+            int success = xy2fij(gm, i[id], j[id], xx[id * stride], yy[id * stride], &fi[ii + id], &fj[ii + id]);
+
+            if (status != NULL)
+                status[ii + id] = success;
+            nsuccess += success;
+        }
+    }
+
+    return nsuccess;
 }
 
-/**
+/** Spreads the lower 16 bits of an integer to its even bits.
  */
-int gridmap_getnce1(gridmap* gm)
+static uint32_t spreadbits(uint32_t v)
 {
-    int nce1 = -1;
+    v &= 0x0000ffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
 
-    if (gm->type == GRIDMAP_TYPE_BINARY)
-        nce1 = gridbmap_getnce1(gm->map);
-    else if (gm->type == GRIDMAP_TYPE_KDTREE)
-        nce1 = gridkmap_getnce1(gm->map);
+    return v;
+}
+
+/** Calculates the position of a point on the Hilbert curve filling the
+ * NCURVE x NCURVE grid.
+ * @param ix X index, 0 <= ix < NCURVE
+ * @param iy Y index, 0 <= iy < NCURVE
+ * @return Position on the curve
+ */
+static uint32_t hilbertkey(uint32_t ix, uint32_t iy)
+{
+    uint32_t d = 0;
+    uint32_t s;
+
+    for (s = NCURVE / 2; s > 0; s /= 2) {
+        uint32_t rx = (ix & s) > 0;
+        uint32_t ry = (iy & s) > 0;
 
-    return nce1;
+        d += s * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            uint32_t tmp;
+
+            if (rx == 1) {
+                ix = NCURVE - 1 - ix;
+                iy = NCURVE - 1 - iy;
+            }
+            tmp = ix;
+            ix = iy;
+            iy = tmp;
+        }
+    }
+
+    return d;
+}
+
+/** Orders points along a space-filling curve (Morton or Hilbert) through the
+ * bounding rectangle of the points. Points with non-finite coordinates go
+ * last.
+ * @param hilbert Flag: use Hilbert curve (otherwise Morton curve)
+ * @param n Number of points
+ * @param x Array of X coordinates
+ * @param y Array of Y coordinates
+ * @param stride Distance between consecutive points in the input arrays
+ *               (in doubles)
+ * @return Array of point indices in the curve order [n]; to be freed by the
+ *         caller
+ */
+static int* curve_order(int hilbert, int n, double* x, double* y, int stride)
+{
+    double xmin = DBL_MAX, xmax = -DBL_MAX, ymin = DBL_MAX, ymax = -DBL_MAX;
+    double xscale, yscale;
+    uint32_t* keys = malloc((size_t) n * 2 * sizeof(uint32_t));
+    uint32_t* keys2 = &keys[n];
+    int* ids = malloc((size_t) n * 2 * sizeof(int));
+    int* ids2 = &ids[n];
+    int ii, pass;
+
+    for (ii = 0; ii < n; ++ii) {
+        double xx = x[(size_t) ii * stride];
+        double yy = y[(size_t) ii * stride];
+
+        if (!isfinite(xx + yy))
+            continue;
+        if (xx < xmin)
+            xmin = xx;
+        if (xx > xmax)
+            xmax = xx;
+        if (yy < ymin)
+            ymin = yy;
+        if (yy > ymax)
+            ymax = yy;
+    }
+    xscale = (xmax > xmin) ? (NCURVE - 1) / (xmax - xmin) : 0.0;
+    yscale = (ymax > ymin) ? (NCURVE - 1) / (ymax - ymin) : 0.0;
+
+    for (ii = 0; ii < n; ++ii) {
+        double xx = x[(size_t) ii * stride];
+        double yy = y[(size_t) ii * stride];
+
+        if (isfinite(xx + yy)) {
+            uint32_t ix = (uint32_t) ((xx - xmin) * xscale);
+            uint32_t iy = (uint32_t) ((yy - ymin) * yscale);
+
+            keys[ii] = (hilbert) ? hilbertkey(ix, iy) : (spreadbits(ix) | (spreadbits(iy) << 1));
+        } else
+            keys[ii] = UINT32_MAX;
+        ids[ii] = ii;
+    }
+
+    /*
+     * LSD radix sort by bytes of the key
+     */
+    for (pass = 0; pass < 4; ++pass) {
+        int shift = pass * 8;
+        int count[257];
+        int b;
+
+        memset(count, 0, sizeof(count));
+        for (ii = 0; ii < n; ++ii)
+            count[((keys[ii] >> shift) & 0xff) + 1]++;
+        for (b = 0; b < 256; ++b)
+            count[b + 1] += count[b];
+        for (ii = 0; ii < n; ++ii) {
+            int pos = count[(keys[ii] >> shift) & 0xff]++;
+
+            keys2[pos] = keys[ii];
+            ids2[pos] = ids[ii];
+        }
+        memcpy(keys, keys2, (size_t) n * sizeof(uint32_t));
+        memcpy(ids, ids2, (size_t) n * sizeof(int));
+    }
+
+    free(keys);
+    return ids;
+}
+
+/** Calculates fractional indices for an array of points. Equivalent to
+ * calling gridmap_xy2fij() for each point, but resolves the map type and
+ * the node arrays once per block of points.
+ *
+ * @param gm Grid map
+ * @param n Number of points
+ * @param x Array of X coordinates
+ * @param y Array of Y coordinates
+ * @param stride Distance between consecutive points in the input arrays
+ *               (in doubles); 1 for plain arrays
+ * @param fi Output array of fractional I indices [n] (NaN on failure)
+ * @param fj Output array of fractional J indices [n] (NaN on failure)
+ * @param status Output array of return values of gridmap_xy2fij() [n]; can
+ *               be NULL
+ * @return Number of successfully mapped points
+ *
+ * If compiled with OpenMP, the blocks of points are mapped in parallel; the
+ * number of threads can be set by OMP_NUM_THREADS.
+ *
+ * If GRIDMAP_BATCH_MORTON or GRIDMAP_BATCH_HILBERT is set (see
+ * gridmap_setbatchflags()), the points are mapped in the order along the
+ * curve, so that consecutive searches visit nearby parts of the map.
+ */
+int gridmap_xy2fij_batch(gridmap* gm, int n, double* x, double* y, int stride, double* fi, double* fj, int* status)
+{
+    int* order;
+    double* buf;
+    int* sstatus;
+    int nsuccess, ii;
+
+    if (!(gm->batchflags & (GRIDMAP_BATCH_MORTON | GRIDMAP_BATCH_HILBERT)) || n < 2)
+        return xy2fij_batch(gm, n, x, y, stride, fi, fj, status);
+
+    order = curve_order(gm->batchflags & GRIDMAP_BATCH_HILBERT, n, x, y, stride);
+    buf = malloc((size_t) n * 4 * sizeof(double));
+    sstatus = malloc((size_t) n * sizeof(int));
+    for (ii = 0; ii < n; ++ii) {
+        buf[ii] = x[(size_t) order[ii] * stride];
+        buf[n + ii] = y[(size_t) order[ii] * stride];
+    }
+    nsuccess = xy2fij_batch(gm, n, buf, &buf[n], 1, &buf[2 * n], &buf[3 * n], sstatus);
+    for (ii = 0; ii < n; ++ii) {
+        fi[order[ii]] = buf[2 * n + ii];
+        fj[order[ii]] = buf[3 * n + ii];
+        if (status != NULL)
+            status[order[ii]] = sstatus[ii];
+    }
+    free(sstatus);
+    free(buf);
+    free(order);
+
+    return nsuccess;
+}
+
+/** Calculates physical coordinates for an array of points specified by
+ * fractional indices. Equivalent to calling gridmap_fij2xy() for each point.
+ *
+ * @param gm Grid map
+ * @param n Number of points
+ * @param fi Array of fractional I indices
+ * @param fj Array of fractional J indices
+ * @param stride Distance between consecutive points in the input arrays
+ *               (in doubles); 1 for plain arrays
+ * @param x Output array of X coordinates [n]
+ * @param y Output array of Y coordinates [n]
+ * @param status Output array of return values of gridmap_fij2xy() [n]; can
+ *               be NULL
+ * @return Number of points with indices within the grid
+ *
+ * If compiled with OpenMP, the points are mapped in parallel.
+ */
+int gridmap_fij2xy_batch(gridmap* gm, int n, double* fi, double* fj, int stride, double* x, double* y, int* status)
+{
+    int nsuccess = 0;
+    int ii;
+
+#if defined(_OPENMP)
+#pragma omp parallel for reduction(+:nsuccess) schedule(static)
+#endif
+    for (ii = 0; ii < n; ++ii) {
+        int success = fij2xy(gm, fi[(size_t) ii * stride], fj[(size_t) ii * stride], &x[ii], &y[ii]);
+
+        if (status != NULL)
+            status[ii] = success;
+        nsuccess += success;
+    }
+
+    return nsuccess;
+}
+
+/**
+ */
+int gridmap_getnce1(gridmap* gm)
+{
+    return gm->nce1;
 }
 
 /**
  */
 int gridmap_getnce2(gridmap* gm)
 {
-    int nce2 = -1;
+    return gm->nce2;
+}
 
-    if (gm->type == GRIDMAP_TYPE_BINARY)
-        nce2 = gridbmap_getnce2(gm->map);
-    else if (gm->type == GRIDMAP_TYPE_KDTREE)
-        nce2 = gridkmap_getnce2(gm->map);
+/**
+ */
+double** gridmap_getxnodes(gridmap* gm)
+{
+    return gm->gx;
+}
 
-    return nce2;
+/**
+ */
+double** gridmap_getynodes(gridmap* gm)
+{
+    return gm->gy;
 }
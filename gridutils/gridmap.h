@@ -13,8 +13,10 @@
  *  
  * Purpose:        Calculates transformations between physical and index
  *                 space within a numerical grid. Mapping xy->ij can now
- *                 be conducted by one of two algorithms: via rendering grid
- *                 into a spatial binary tree and via kd-tree with grid nodes.
+ *                 be conducted by one of four algorithms: via rendering grid
+ *                 into a spatial binary tree, via kd-tree with grid nodes
+ *                 (also on the sphere, for geographic grids), via uniform
+ *                 spatial hash of grid cells and via precomputed raster.
  *
  * Revisions:
  *
@@ -23,20 +25,40 @@
 #if !defined(_GRIDMAP_H)
 #define _GRIDMAP_H
 
+#include <stdint.h>
+
 #define GRIDMAP_TYPE_BINARY 0
 #define GRIDMAP_TYPE_KDTREE 1
+#define GRIDMAP_TYPE_HASH 2
+#define GRIDMAP_TYPE_KDTREEGEO 3        /* kd-tree on the sphere; X and Y are
+                                         * longitude and latitude */
+#define GRIDMAP_TYPE_RASTER 4
 #define GRIDMAP_TYPE_DEF GRIDMAP_TYPE_BINARY
 
+#define GRIDMAP_BATCH_WALK 1
+#define GRIDMAP_BATCH_MORTON 2
+#define GRIDMAP_BATCH_HILBERT 4
+
 struct gridmap;
 typedef struct gridmap gridmap;
 
 gridmap* gridmap_build(int nce1, int nce2, double** gx, double** gy, int type);
 gridmap* gridmap_build2(gridnodes* gn);
 void gridmap_destroy(gridmap* gm);
+void gridmap_save(gridmap* gm, char* fname, uint64_t checksum);
+gridmap* gridmap_load(char* fname, uint64_t checksum);
 int gridmap_fij2xy(gridmap* gm, double fi, double fj, double* x, double* y);
 int gridmap_xy2ij(gridmap* gm, double x, double y, int* i, int* j);
+int gridmap_xy2ij_hint(gridmap* gm, double x, double y, int* i, int* j);
 int gridmap_xy2fij(gridmap* gm, double x, double y, double* fi, double* fj);
+int gridmap_xy2fij_batch(gridmap* gm, int n, double* x, double* y, int stride, double* fi, double* fj, int* status);
+int gridmap_fij2xy_batch(gridmap* gm, int n, double* fi, double* fj, int stride, double* x, double* y, int* status);
+void gridmap_setbatchflags(gridmap* gm, int flags);
+void gridmap_buildcoeffs(gridmap* gm);
+void gridmap_update_region(gridmap* gm, int imin, int imax, int jmin, int jmax);
 int gridmap_getnce1(gridmap* gm);
 int gridmap_getnce2(gridmap* gm);
+double** gridmap_getxnodes(gridmap* gm);
+double** gridmap_getynodes(gridmap* gm);
 
 #endif
@@ -29,7 +29,6 @@
 #include "kdtree.h"
 
 #define BUFSIZE 10240
-#define SEED 5555
 
 /* Deviation from Orthogonality = 90 - theta
  * Aspect Ratio = max(dx,dy) / min(dx,dy)
@@ -536,21 +535,34 @@ static void fij2xy(gridnodes* gn, double fi, double fj, int i, int j, double* x,
     }
 }
 
-/**
+/** Builds a kd-tree with positions in index space of the valid cells formed
+ * by the nodes of a grid of cell centre type.
+ * @param gn Grid nodes (of NT_CEN type)
+ * @return kd-tree
  */
-static void shuffle(size_t n, size_t ids[])
+static kdtree* build_celltree(gridnodes* gn)
 {
-    size_t i;
-
-    srand48(SEED);
-
-    for (i = 0; i < n; ++i) {
-        size_t ii = (size_t) ((double) n * drand48());
-        size_t tmp = ids[i];
+    kdtree* kt = kd_create(2);  /* 2 dimensions */
+    double* pos[2];
+    size_t n;
+    int i, j;
 
-        ids[i] = ids[ii];
-        ids[ii] = tmp;
+    n = (size_t) (gn->nx - 1) * (gn->ny - 1);
+    pos[0] = malloc(n * 2 * sizeof(double));
+    pos[1] = &pos[0][n];
+    for (j = 0, n = 0; j < gn->ny - 1; ++j) {
+        for (i = 0; i < gn->nx - 1; ++i) {
+            if (!isnan(gn->gx[j][i]) && !isnan(gn->gx[j + 1][i]) && !isnan(gn->gx[j][i + 1]) && !isnan(gn->gx[j + 1][i + 1])) {
+                pos[0][n] = (double) i + 0.5;
+                pos[1][n] = (double) j + 0.5;
+                n++;
+            }
+        }
     }
+    kd_build_balanced(kt, n, pos);
+    free(pos[0]);
+
+    return kt;
 }
 
 /** Transforms grid nodes of one type into grid nodes of another type.
@@ -600,42 +612,62 @@ gridnodes* gridnodes_transform(gridnodes* gn, NODETYPE type)
     } else if (gn->type == NT_COR) {
         if (type == NT_CEN) {
             gridmap* gm = gridmap_build(gn->nx - 1, gn->ny - 1, gn->gx, gn->gy, gridnodes_getmaptype(gn));
+            double* fi = NULL;
+            double* fj = NULL;
 
             gn1->nx = gn->nx - 1;
             gn1->ny = gn->ny - 1;
             gn1->gx = gu_alloc2d(gn1->ny, gn1->nx, sizeof(double));
             gn1->gy = gu_alloc2d(gn1->ny, gn1->nx, sizeof(double));
 
+            fi = malloc(gn1->nx * sizeof(double));
+            fj = malloc(gn1->nx * sizeof(double));
+
             /*
              * this may take a while 
              */
-            for (j = 0; j < gn1->ny; ++j)
+            for (i = 0; i < gn1->nx; ++i)
+                fi[i] = i + 0.5;
+            for (j = 0; j < gn1->ny; ++j) {
                 for (i = 0; i < gn1->nx; ++i)
-                    gridmap_fij2xy(gm, i + 0.5, j + 0.5, &gn1->gx[j][i], &gn1->gy[j][i]);
+                    fj[i] = j + 0.5;
+                (void) gridmap_fij2xy_batch(gm, gn1->nx, fi, fj, 1, gn1->gx[j], gn1->gy[j], NULL);
+            }
 
+            free(fi);
+            free(fj);
             gridmap_destroy(gm);
         } else if (type == NT_DD) {
             gridmap* gm = gridmap_build(gn->nx - 1, gn->ny - 1, gn->gx, gn->gy, gridnodes_getmaptype(gn));
+            double* fi = NULL;
+            double* fj = NULL;
 
             gn1->nx = gn->nx * 2 - 1;
             gn1->ny = gn->ny * 2 - 1;
             gn1->gx = gu_alloc2d(gn1->ny, gn1->nx, sizeof(double));
             gn1->gy = gu_alloc2d(gn1->ny, gn1->nx, sizeof(double));
 
+            fi = malloc(gn1->nx * sizeof(double));
+            fj = malloc(gn1->nx * sizeof(double));
+
             /*
              * this may take a while 
              */
-            for (j = 0; j < gn1->ny; ++j)
+            for (i = 0; i < gn1->nx; ++i)
+                fi[i] = i / 2.0;
+            for (j = 0; j < gn1->ny; ++j) {
                 for (i = 0; i < gn1->nx; ++i)
-                    gridmap_fij2xy(gm, i / 2.0, j / 2.0, &gn1->gx[j][i], &gn1->gy[j][i]);
+                    fj[i] = j / 2.0;
+                (void) gridmap_fij2xy_batch(gm, gn1->nx, fi, fj, 1, gn1->gx[j], gn1->gy[j], NULL);
+            }
 
+            free(fi);
+            free(fj);
             gridmap_destroy(gm);
         }
     } else if (gn->type == NT_CEN) {
         if (type == NT_COR) {
-            kdtree* kt = kd_create(2);  /* 2 dimensions */
-            size_t* ids = NULL;
-            size_t n, ii;
+            kdtree* kt = build_celltree(gn);
             int i, j;
 
             gn1->nx = gn->nx + 1;
@@ -643,36 +675,6 @@ gridnodes* gridnodes_transform(gridnodes* gn, NODETYPE type)
             gn1->gx = gu_alloc2d(gn1->ny, gn1->nx, sizeof(double));
             gn1->gy = gu_alloc2d(gn1->ny, gn1->nx, sizeof(double));
 
-            /*
-             * shuffle the grid nodes
-             */
-            n = (gn->nx - 1) * (gn->ny - 1);
-            ids = malloc(n * sizeof(size_t));
-            for (j = 0, ii = 0; j < gn->ny - 1; ++j)
-                for (i = 0; i < gn->nx - 1; ++i, ++ii)
-                    ids[ii] = j * gn->nx + i;
-            shuffle(n, ids);
-
-            /*
-             * put positions of cells formed by cell centers into kd tree
-             */
-            for (ii = 0; ii < n; ++ii) {
-                size_t id = ids[ii];
-
-                i = id % gn->nx;
-                j = id / gn->nx;
-
-                if (!isnan(gn->gx[j][i]) && !isnan(gn->gx[j + 1][i]) && !isnan(gn->gx[j][i + 1]) && !isnan(gn->gx[j + 1][i + 1])) {
-                    double pos[2];
-
-                    pos[0] = (double) i + 0.5;
-                    pos[1] = (double) j + 0.5;
-                    kd_insertnode(kt, pos, id);
-                }
-            }
-
-            free(ids);
-
             /*
              * for each node coordinate find the nearest point in the kd tree;
              * if it is in a neighbour cell - then extrapolate the cell
@@ -701,9 +703,7 @@ gridnodes* gridnodes_transform(gridnodes* gn, NODETYPE type)
             gridnodes_validate_cor(gn1);
             kd_destroy(kt);
         } else if (type == NT_DD) {
-            kdtree* kt = kd_create(2);  /* 2 dimensions */
-            size_t* ids = NULL;
-            size_t n, ii;
+            kdtree* kt = build_celltree(gn);
             int i, j;
 
             gn1->nx = gn->nx * 2 + 1;
@@ -711,36 +711,6 @@ gridnodes* gridnodes_transform(gridnodes* gn, NODETYPE type)
             gn1->gx = gu_alloc2d(gn1->ny, gn1->nx, sizeof(double));
             gn1->gy = gu_alloc2d(gn1->ny, gn1->nx, sizeof(double));
 
-            /*
-             * shuffle the grid nodes
-             */
-            n = (gn->nx - 1) * (gn->ny - 1);
-            ids = malloc(n * sizeof(size_t));
-            for (j = 0, ii = 0; j < gn->ny - 1; ++j)
-                for (i = 0; i < gn->nx - 1; ++i, ++ii)
-                    ids[ii] = j * gn->nx + i;
-            shuffle(n, ids);
-
-            /*
-             * put positions of the cells formed by cell centes into kd tree
-             */
-            for (ii = 0; ii < n; ++ii) {
-                int id = ids[ii];
-
-                i = id % gn->nx;
-                j = id / gn->nx;
-
-                if (!isnan(gn->gx[j][i]) && !isnan(gn->gx[j + 1][i]) && !isnan(gn->gx[j][i + 1]) && !isnan(gn->gx[j + 1][i + 1])) {
-                    double pos[2];
-
-                    pos[0] = (double) i + 0.5;
-                    pos[1] = (double) j + 0.5;
-                    kd_insertnode(kt, pos, id);
-                }
-            }
-
-            free(ids);
-
             /*
              * for each node coordinate find the nearest point in the kd tree;
              * if it is in a neighbour cell - then extrapolate the cell
@@ -0,0 +1,637 @@
+/******************************************************************************
+ *
+ * File:           gridrmap.c
+ *
+ * Created:        16 October 2026
+ *
+ * Purpose:        Mapping of curvilinear grids based on a precomputed raster.
+ *                 The extent of valid cells is covered by a fine regular XY
+ *                 raster. A pixel that lies inside a single cell stores the
+ *                 id of this cell, so that the search for a point in this
+ *                 pixel is a single lookup; other pixels store a short list
+ *                 of cells overlapping the pixel that are tested one by one.
+ *                 Takes more memory than the spatial hash (gridhmap.c), but
+ *                 most of the searches do not test any cell.
+ *
+ * Revisions:
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <float.h>
+#include "poly.h"
+#include "gridrmap.h"
+#include "gucommon.h"
+
+#define NPIXPERCELL 64          /* pixels per valid cell */
+#define NPIXMAX (1 << 26)       /* maximal number of pixels */
+#define PIXMARGIN 0.01          /* margin added to a pixel when testing
+                                 * cells (relative to pixel size) */
+
+#define PIX_EMPTY -1            /* pixel does not overlap any cell */
+
+/*
+ * Relation of a cell to a pixel
+ */
+#define CELL_OUTSIDE 0
+#define CELL_COVERS 1
+#define CELL_OVERLAPS 2
+
+struct gridrmap {
+    int nce1;                   /* number of cells in e1 direction */
+    int nce2;                   /* number of cells in e2 direction */
+    double** gx;                /* reference to array of X coords
+                                 * [nce2+1][nce1+1] */
+    double** gy;                /* reference to array of Y coords
+                                 * [nce2+1][nce1+1] */
+    double xmin;                /* extent of valid cells */
+    double xmax;
+    double ymin;
+    double ymax;
+    int nx;                     /* number of pixels in X direction */
+    int ny;                     /* number of pixels in Y direction */
+    double rdx;                 /* inverse pixel width */
+    double rdy;                 /* inverse pixel height */
+    int* pixels;                /* for each pixel: id of the cell (j * nce1
+                                 * + i) the pixel is inside of; PIX_EMPTY;
+                                 * or (-2 - k) for the list of candidate
+                                 * cells starting at cands[k] [nx * ny] */
+    int* cands;                 /* lists of candidate cell ids, each ended
+                                 * by -1 [ncands] */
+    size_t ncands;
+    int attached;               /* flag: the raster belongs to a mapped
+                                 * index file */
+};
+
+/** Checks whether a cell is valid (all corner nodes are valid).
+ * @param gm Grid map
+ * @param i I index of the cell
+ * @param j J index of the cell
+ * @return 1 for yes, 0 for no
+ */
+static int cell_isvalid(gridrmap* gm, int i, int j)
+{
+    double** gx = gm->gx;
+    double** gy = gm->gy;
+
+    return isfinite(gx[j][i] + gx[j][i + 1] + gx[j + 1][i] + gx[j + 1][i + 1] + gy[j][i] + gy[j][i + 1] + gy[j + 1][i] + gy[j + 1][i + 1]);
+}
+
+/** Gets coordinates of cell corners in the order of a contour.
+ * @param gm Grid map
+ * @param i I index of the cell
+ * @param j J index of the cell
+ * @param xs Output X coordinates [4]
+ * @param ys Output Y coordinates [4]
+ */
+static void cell_getcorners(gridrmap* gm, int i, int j, double* xs, double* ys)
+{
+    double** gx = gm->gx;
+    double** gy = gm->gy;
+
+    xs[0] = gx[j][i];
+    xs[1] = gx[j][i + 1];
+    xs[2] = gx[j + 1][i + 1];
+    xs[3] = gx[j + 1][i];
+    ys[0] = gy[j][i];
+    ys[1] = gy[j][i + 1];
+    ys[2] = gy[j + 1][i + 1];
+    ys[3] = gy[j + 1][i];
+}
+
+/** Gets range of pixels overlapped by the bounding rectangle of a cell.
+ * @param gm Grid map
+ * @param xs X coordinates of cell corners [4]
+ * @param ys Y coordinates of cell corners [4]
+ * @param ix1 Output minimal pixel X index
+ * @param ix2 Output maximal pixel X index
+ * @param iy1 Output minimal pixel Y index
+ * @param iy2 Output maximal pixel Y index
+ */
+static void cell_getpixels(gridrmap* gm, double* xs, double* ys, int* ix1, int* ix2, int* iy1, int* iy2)
+{
+    double xmin = fmin(fmin(xs[0], xs[1]), fmin(xs[2], xs[3]));
+    double xmax = fmax(fmax(xs[0], xs[1]), fmax(xs[2], xs[3]));
+    double ymin = fmin(fmin(ys[0], ys[1]), fmin(ys[2], ys[3]));
+    double ymax = fmax(fmax(ys[0], ys[1]), fmax(ys[2], ys[3]));
+
+    *ix1 = (int) floor((xmin - gm->xmin) * gm->rdx - PIXMARGIN);
+    *ix2 = (int) floor((xmax - gm->xmin) * gm->rdx + PIXMARGIN);
+    *iy1 = (int) floor((ymin - gm->ymin) * gm->rdy - PIXMARGIN);
+    *iy2 = (int) floor((ymax - gm->ymin) * gm->rdy + PIXMARGIN);
+    if (*ix1 < 0)
+        *ix1 = 0;
+    if (*iy1 < 0)
+        *iy1 = 0;
+    if (*ix2 >= gm->nx)
+        *ix2 = gm->nx - 1;
+    if (*iy2 >= gm->ny)
+        *iy2 = gm->ny - 1;
+}
+
+/** Checks whether a segment intersects a rectangle (Liang-Barsky clipping).
+ * @param x1 X coordinate of the first end
+ * @param y1 Y coordinate of the first end
+ * @param x2 X coordinate of the second end
+ * @param y2 Y coordinate of the second end
+ * @param rect Rectangle {xmin, xmax, ymin, ymax}
+ * @return 1 for yes, 0 for no
+ */
+static int segment_intersectsrect(double x1, double y1, double x2, double y2, double* rect)
+{
+    double p[4], q[4];
+    double t1 = 0.0, t2 = 1.0;
+    int k;
+
+    p[0] = x1 - x2;
+    q[0] = x1 - rect[0];
+    p[1] = x2 - x1;
+    q[1] = rect[1] - x1;
+    p[2] = y1 - y2;
+    q[2] = y1 - rect[2];
+    p[3] = y2 - y1;
+    q[3] = rect[3] - y1;
+
+    for (k = 0; k < 4; ++k) {
+        if (p[k] == 0.0) {
+            if (q[k] < 0.0)
+                return 0;
+        } else {
+            double t = q[k] / p[k];
+
+            if (p[k] < 0.0) {
+                if (t > t2)
+                    return 0;
+                if (t > t1)
+                    t1 = t;
+            } else {
+                if (t < t1)
+                    return 0;
+                if (t < t2)
+                    t2 = t;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/** Finds relation of a cell to a pixel, with the pixel expanded by a small
+ * margin.
+ * @param gm Grid map
+ * @param xs X coordinates of cell corners [4]
+ * @param ys Y coordinates of cell corners [4]
+ * @param ix X index of the pixel
+ * @param iy Y index of the pixel
+ * @return CELL_OUTSIDE, CELL_COVERS or CELL_OVERLAPS
+ */
+static int cell_relatepixel(gridrmap* gm, double* xs, double* ys, int ix, int iy)
+{
+    double dx = 1.0 / gm->rdx;
+    double dy = 1.0 / gm->rdy;
+    double rect[4];
+    int k;
+
+    rect[0] = gm->xmin + dx * (ix - PIXMARGIN);
+    rect[1] = gm->xmin + dx * (ix + 1 + PIXMARGIN);
+    rect[2] = gm->ymin + dy * (iy - PIXMARGIN);
+    rect[3] = gm->ymin + dy * (iy + 1 + PIXMARGIN);
+
+    for (k = 0; k < 4; ++k) {
+        int k1 = (k + 1) % 4;
+
+        if (segment_intersectsrect(xs[k], ys[k], xs[k1], ys[k1], rect))
+            return CELL_OVERLAPS;
+    }
+
+    /*
+     * the cell boundary does not cross the pixel, therefore the pixel is
+     * either inside or outside the cell
+     */
+    if (poly_containspoint2(4, xs, ys, (rect[0] + rect[1]) / 2.0, (rect[2] + rect[3]) / 2.0))
+        return CELL_COVERS;
+    return CELL_OUTSIDE;
+}
+
+/** Finds relation of a cell to each pixel in a range, with pixels expanded
+ * by a small margin. For a convex cell, uses the values of the linear
+ * functions of the cell edges at the pixel corners: the pixel is inside the
+ * cell if it is on the inner side of all edges, and outside if it is on the
+ * outer side of an edge or outside the bounding rectangle of the cell
+ * (otherwise it is considered to overlap the cell). Other cells are tested
+ * by cell_relatepixel().
+ * @param gm Grid map
+ * @param xs X coordinates of cell corners [4]
+ * @param ys Y coordinates of cell corners [4]
+ * @param ix1 Minimal pixel X index
+ * @param ix2 Maximal pixel X index
+ * @param iy1 Minimal pixel Y index
+ * @param iy2 Maximal pixel Y index
+ * @param rel Output relations by pixel [(iy2 - iy1 + 1) * (ix2 - ix1 + 1)]
+ */
+static void cell_relatepixels(gridrmap* gm, double* xs, double* ys, int ix1, int ix2, int iy1, int iy2, int* rel)
+{
+    int nx = ix2 - ix1 + 1;
+    double dx = 1.0 / gm->rdx;
+    double dy = 1.0 / gm->rdy;
+    double a[4], b[4], c[4], lo[4], hi[4];
+    double cross[4];
+    double sign;
+    double xmin, xmax, ymin, ymax;
+    int ix, iy, k;
+
+    for (k = 0; k < 4; ++k) {
+        int k1 = (k + 1) % 4;
+        int k2 = (k + 2) % 4;
+
+        cross[k] = (xs[k1] - xs[k]) * (ys[k2] - ys[k1]) - (ys[k1] - ys[k]) * (xs[k2] - xs[k1]);
+    }
+    if (cross[0] > 0.0 && cross[1] > 0.0 && cross[2] > 0.0 && cross[3] > 0.0)
+        sign = 1.0;
+    else if (cross[0] < 0.0 && cross[1] < 0.0 && cross[2] < 0.0 && cross[3] < 0.0)
+        sign = -1.0;
+    else {
+        for (iy = iy1; iy <= iy2; ++iy)
+            for (ix = ix1; ix <= ix2; ++ix)
+                rel[(iy - iy1) * nx + ix - ix1] = cell_relatepixel(gm, xs, ys, ix, iy);
+        return;
+    }
+
+    /*
+     * edge functions a * x + b * y + c, positive inside the cell; their
+     * minimum and maximum over a pixel (with the margin) are the value at
+     * the pixel's lower left corner plus lo[] and hi[]
+     */
+    for (k = 0; k < 4; ++k) {
+        int k1 = (k + 1) % 4;
+        double tol;
+
+        a[k] = -sign * (ys[k1] - ys[k]);
+        b[k] = sign * (xs[k1] - xs[k]);
+        c[k] = -a[k] * xs[k] - b[k] * ys[k];
+        tol = (fabs(a[k]) * dx + fabs(b[k]) * dy) * PIXMARGIN;
+        lo[k] = fmin(0.0, a[k] * dx) + fmin(0.0, b[k] * dy) - tol;
+        hi[k] = fmax(0.0, a[k] * dx) + fmax(0.0, b[k] * dy) + tol;
+    }
+    xmin = fmin(fmin(xs[0], xs[1]), fmin(xs[2], xs[3])) - dx * PIXMARGIN;
+    xmax = fmax(fmax(xs[0], xs[1]), fmax(xs[2], xs[3])) + dx * PIXMARGIN;
+    ymin = fmin(fmin(ys[0], ys[1]), fmin(ys[2], ys[3])) - dy * PIXMARGIN;
+    ymax = fmax(fmax(ys[0], ys[1]), fmax(ys[2], ys[3])) + dy * PIXMARGIN;
+
+    for (iy = iy1; iy <= iy2; ++iy) {
+        double y0 = gm->ymin + dy * iy;
+        double x0 = gm->xmin + dx * ix1;
+        int* r = &rel[(iy - iy1) * nx];
+        double e[4];
+
+        for (k = 0; k < 4; ++k)
+            e[k] = a[k] * x0 + b[k] * y0 + c[k];
+
+        for (ix = ix1; ix <= ix2; ++ix, x0 += dx, ++r) {
+            *r = CELL_COVERS;
+            if (x0 > xmax || x0 + dx < xmin || y0 > ymax || y0 + dy < ymin)
+                *r = CELL_OUTSIDE;
+            for (k = 0; k < 4; ++k) {
+                if (e[k] + hi[k] < 0.0)
+                    *r = CELL_OUTSIDE;
+                else if (e[k] + lo[k] <= 0.0 && *r == CELL_COVERS)
+                    *r = CELL_OVERLAPS;
+                e[k] += a[k] * dx;
+            }
+        }
+    }
+}
+
+/** Builds a grid map structure to facilitate conversion from coordinate
+ * to index space.
+ *
+ * @param nce1 number of cells in e1 direction
+ * @param nce2 number of cells in e2 direction
+ * @param gx array of X coordinates [nce2 + 1][nce1 + 1]
+ * @param gy array of Y coordinates [nce2 + 1][nce1 + 1]
+ * @return a map to be used by xy2ij
+ */
+gridrmap* gridrmap_build(int nce1, int nce2, double** gx, double** gy)
+{
+    gridrmap* gm = malloc(sizeof(gridrmap));
+    int* counts = NULL;
+    int* rel = NULL;
+    size_t nrel = 0;
+    int ncells = 0;
+    size_t npixels, p;
+    int i, j, ix, iy;
+
+    gm->nce1 = nce1;
+    gm->nce2 = nce2;
+    gm->gx = gx;
+    gm->gy = gy;
+    gm->attached = 0;
+    gm->xmin = DBL_MAX;
+    gm->xmax = -DBL_MAX;
+    gm->ymin = DBL_MAX;
+    gm->ymax = -DBL_MAX;
+
+    for (j = 0; j < nce2; ++j) {
+        for (i = 0; i < nce1; ++i) {
+            int di, dj;
+
+            if (!cell_isvalid(gm, i, j))
+                continue;
+            ncells++;
+            for (dj = 0; dj < 2; ++dj) {
+                for (di = 0; di < 2; ++di) {
+                    double x = gx[j + dj][i + di];
+                    double y = gy[j + dj][i + di];
+
+                    if (x < gm->xmin)
+                        gm->xmin = x;
+                    if (x > gm->xmax)
+                        gm->xmax = x;
+                    if (y < gm->ymin)
+                        gm->ymin = y;
+                    if (y > gm->ymax)
+                        gm->ymax = y;
+                }
+            }
+        }
+    }
+    if (ncells == 0) {
+        gm->xmin = 0.0;
+        gm->xmax = 0.0;
+        gm->ymin = 0.0;
+        gm->ymax = 0.0;
+    }
+
+    /*
+     * about NPIXPERCELL square pixels per cell
+     */
+    {
+        double w = gm->xmax - gm->xmin;
+        double h = gm->ymax - gm->ymin;
+        double n = (double) ncells * NPIXPERCELL;
+
+        if (n > NPIXMAX)
+            n = NPIXMAX;
+        if (w > 0.0 && h > 0.0) {
+            double ratio = w / h;
+
+            gm->nx = (int) ceil(sqrt(n * ratio));
+            gm->ny = (int) ceil(sqrt(n / ratio));
+        } else {
+            gm->nx = (w > 0.0) ? (int) n : 1;
+            gm->ny = (h > 0.0) ? (int) n : 1;
+        }
+        if (gm->nx < 1)
+            gm->nx = 1;
+        if (gm->ny < 1)
+            gm->ny = 1;
+        gm->rdx = (w > 0.0) ? (double) gm->nx / w : 1.0;
+        gm->rdy = (h > 0.0) ? (double) gm->ny / h : 1.0;
+    }
+    npixels = (size_t) gm->nx * gm->ny;
+
+    /*
+     * count cells overlapping each pixel, with the covering cell (if any)
+     * in `pixels'
+     */
+    gm->pixels = malloc(npixels * sizeof(int));
+    for (p = 0; p < npixels; ++p)
+        gm->pixels[p] = PIX_EMPTY;
+    counts = calloc(npixels, sizeof(int));
+    for (j = 0; j < nce2; ++j) {
+        for (i = 0; i < nce1; ++i) {
+            double xs[4], ys[4];
+            int ix1, ix2, iy1, iy2;
+
+            if (!cell_isvalid(gm, i, j))
+                continue;
+            cell_getcorners(gm, i, j, xs, ys);
+            cell_getpixels(gm, xs, ys, &ix1, &ix2, &iy1, &iy2);
+            if (ix2 < ix1 || iy2 < iy1)
+                continue;
+            if ((size_t) (ix2 - ix1 + 1) * (iy2 - iy1 + 1) > nrel) {
+                nrel = (size_t) (ix2 - ix1 + 1) * (iy2 - iy1 + 1);
+                rel = realloc(rel, nrel * sizeof(int));
+            }
+            cell_relatepixels(gm, xs, ys, ix1, ix2, iy1, iy2, rel);
+            for (iy = iy1; iy <= iy2; ++iy) {
+                for (ix = ix1; ix <= ix2; ++ix) {
+                    int r = rel[(iy - iy1) * (ix2 - ix1 + 1) + ix - ix1];
+
+                    p = (size_t) iy * gm->nx + ix;
+                    if (r == CELL_OUTSIDE)
+                        continue;
+                    counts[p]++;
+                    gm->pixels[p] = (r == CELL_COVERS) ? j * nce1 + i : PIX_EMPTY;
+                }
+            }
+        }
+    }
+
+    /*
+     * allocate candidate lists for pixels not covered by a single cell
+     */
+    gm->ncands = 0;
+    for (p = 0; p < npixels; ++p) {
+        if (counts[p] == 0 || (counts[p] == 1 && gm->pixels[p] >= 0))
+            continue;
+        if (gm->ncands > (size_t) INT_MAX - 2)
+            gu_quit("gridrmap_build(): too many candidate cells");
+        gm->pixels[p] = -2 - (int) gm->ncands;
+        gm->ncands += counts[p] + 1;
+        counts[p] = 0;
+    }
+    gm->cands = malloc((gm->ncands + 1) * sizeof(int));
+    for (p = 0; p < gm->ncands + 1; ++p)
+        gm->cands[p] = -1;
+
+    /*
+     * fill the lists (in the order of cell ids)
+     */
+    for (j = 0; j < nce2; ++j) {
+        for (i = 0; i < nce1; ++i) {
+            double xs[4], ys[4];
+            int ix1, ix2, iy1, iy2;
+
+            if (!cell_isvalid(gm, i, j))
+                continue;
+            cell_getcorners(gm, i, j, xs, ys);
+            cell_getpixels(gm, xs, ys, &ix1, &ix2, &iy1, &iy2);
+            if (ix2 < ix1 || iy2 < iy1)
+                continue;
+            cell_relatepixels(gm, xs, ys, ix1, ix2, iy1, iy2, rel);
+            for (iy = iy1; iy <= iy2; ++iy) {
+                for (ix = ix1; ix <= ix2; ++ix) {
+                    p = (size_t) iy * gm->nx + ix;
+                    if (gm->pixels[p] > PIX_EMPTY)
+                        continue;
+                    if (rel[(iy - iy1) * (ix2 - ix1 + 1) + ix - ix1] == CELL_OUTSIDE)
+                        continue;
+                    gm->cands[-2 - gm->pixels[p] + counts[p]] = j * nce1 + i;
+                    counts[p]++;
+                }
+            }
+        }
+    }
+    free(counts);
+    free(rel);
+
+    return gm;
+}
+
+/**
+ */
+void gridrmap_destroy(gridrmap* gm)
+{
+    if (!gm->attached) {
+        free(gm->pixels);
+        free(gm->cands);
+    }
+    free(gm);
+}
+
+/** Writes the raster of a grid map to a binary file.
+ * @param gm Grid map
+ * @param f File
+ */
+void gridrmap_write(gridrmap* gm, FILE* f)
+{
+    double params[6];
+    int dims[2];
+
+    params[0] = gm->xmin;
+    params[1] = gm->xmax;
+    params[2] = gm->ymin;
+    params[3] = gm->ymax;
+    params[4] = gm->rdx;
+    params[5] = gm->rdy;
+    dims[0] = gm->nx;
+    dims[1] = gm->ny;
+    gu_writeblock(f, params, sizeof(params));
+    gu_writeblock(f, dims, sizeof(dims));
+    gu_writeblock(f, &gm->ncands, sizeof(size_t));
+    gu_writeblock(f, gm->pixels, (size_t) gm->nx * gm->ny * sizeof(int));
+    gu_writeblock(f, gm->cands, (gm->ncands + 1) * sizeof(int));
+}
+
+/** Creates a grid map with the raster written by gridrmap_write() to a file
+ * that has been mapped to memory. The raster is used in place.
+ *
+ * @param nce1 number of cells in e1 direction
+ * @param nce2 number of cells in e2 direction
+ * @param gx array of X coordinates [nce2 + 1][nce1 + 1]
+ * @param gy array of Y coordinates [nce2 + 1][nce1 + 1]
+ * @param pos Pointer to the position of the raster in the mapped file; is
+ *            advanced past the raster
+ * @param end End of the mapped file
+ * @return Grid map
+ */
+gridrmap* gridrmap_attach(int nce1, int nce2, double** gx, double** gy, char** pos, char* end)
+{
+    gridrmap* gm = malloc(sizeof(gridrmap));
+    double* params = gu_readblock(pos, end, 6 * sizeof(double));
+    int* dims = gu_readblock(pos, end, 2 * sizeof(int));
+
+    if (dims[0] <= 0 || dims[1] <= 0)
+        gu_quit("gridrmap_attach(): incompatible raster data");
+
+    gm->nce1 = nce1;
+    gm->nce2 = nce2;
+    gm->gx = gx;
+    gm->gy = gy;
+    gm->xmin = params[0];
+    gm->xmax = params[1];
+    gm->ymin = params[2];
+    gm->ymax = params[3];
+    gm->rdx = params[4];
+    gm->rdy = params[5];
+    gm->nx = dims[0];
+    gm->ny = dims[1];
+    gm->ncands = *(size_t*) gu_readblock(pos, end, sizeof(size_t));
+    gm->pixels = gu_readblock(pos, end, (size_t) gm->nx * gm->ny * sizeof(int));
+    gm->cands = gu_readblock(pos, end, (gm->ncands + 1) * sizeof(int));
+    gm->attached = 1;
+
+    return gm;
+}
+
+/** Calculates indices (i,j) of a grid cell containing point (x,y).
+ *
+ * @param gm Grid map
+ * @param x X coordinate
+ * @param y Y coordinate
+ * @param iout pointer to returned I indice value
+ * @param jout pointer to returned J indice value
+ * @return 1 if successful, 0 otherwhile
+ */
+int gridrmap_xy2ij(gridrmap* gm, double x, double y, int* iout, int* jout)
+{
+    int ix, iy, v;
+    int* cand;
+
+    if (x < gm->xmin || y < gm->ymin || x > gm->xmax || y > gm->ymax)
+        return 0;
+
+    ix = (int) ((x - gm->xmin) * gm->rdx);
+    iy = (int) ((y - gm->ymin) * gm->rdy);
+    if (ix >= gm->nx)
+        ix = gm->nx - 1;
+    if (iy >= gm->ny)
+        iy = gm->ny - 1;
+    v = gm->pixels[(size_t) iy * gm->nx + ix];
+
+    if (v >= 0) {
+        *iout = v % gm->nce1;
+        *jout = v / gm->nce1;
+        return 1;
+    }
+    if (v == PIX_EMPTY)
+        return 0;
+
+    for (cand = &gm->cands[-2 - v]; *cand >= 0; ++cand) {
+        int i = *cand % gm->nce1;
+        int j = *cand / gm->nce1;
+        double xs[4], ys[4];
+
+        cell_getcorners(gm, i, j, xs, ys);
+        if (poly_containspoint2(4, xs, ys, x, y)) {
+            *iout = i;
+            *jout = j;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ */
+int gridrmap_getnce1(gridrmap* gm)
+{
+    return gm->nce1;
+}
+
+/**
+ */
+int gridrmap_getnce2(gridrmap* gm)
+{
+    return gm->nce2;
+}
+
+/**
+ */
+double** gridrmap_getxnodes(gridrmap* gm)
+{
+    return gm->gx;
+}
+
+/**
+ */
+double** gridrmap_getynodes(gridrmap* gm)
+{
+    return gm->gy;
+}
@@ -0,0 +1,30 @@
+/******************************************************************************
+ *
+ * File:           gridrmap.h
+ *
+ * Created:        16 October 2026
+ *
+ * Purpose:        Calculates transformations between physical and index
+ *                 space for a numerical grid using a precomputed raster
+ *
+ * Revisions:
+ *
+ *****************************************************************************/
+
+#if !defined(_GRIDRMAP_H)
+#define _GRIDRMAP_H
+
+struct gridrmap;
+typedef struct gridrmap gridrmap;
+
+gridrmap* gridrmap_build(int nce1, int nce2, double** gx, double** gy);
+void gridrmap_destroy(gridrmap* gm);
+void gridrmap_write(gridrmap* gm, FILE* f);
+gridrmap* gridrmap_attach(int nce1, int nce2, double** gx, double** gy, char** pos, char* end);
+int gridrmap_xy2ij(gridrmap* gm, double x, double y, int* i, int* j);
+int gridrmap_getnce1(gridrmap* gm);
+int gridrmap_getnce2(gridrmap* gm);
+double** gridrmap_getxnodes(gridrmap* gm);
+double** gridrmap_getynodes(gridrmap* gm);
+
+#endif
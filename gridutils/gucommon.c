@@ -20,10 +20,16 @@
 #include <limits.h>
 #include <assert.h>
 #include <errno.h>
+#include <stdint.h>
+#include <math.h>
 #include "version.h"
 #include "gucommon.h"
 
 #define BUFSIZE 10240
+#define BLOCKALIGN 8
+#define FNV_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+#define DEG2RAD (M_PI / 180.0)
 
 static void gu_quit_def(char* format, ...);
 
@@ -155,3 +161,157 @@ int** gu_readmask(char* fname, int nx, int ny)
 
     return v;
 }
+
+/** Calculates 64-bit checksum of a block of memory. The FNV-1a hash is
+ * applied to 8-byte words of the data (and to single bytes of the remainder),
+ * so that long blocks are processed fast. A checksum of a block can be
+ * continued with the next block if the size of the former is a multiple of 8
+ * bytes.
+ * @param checksum Checksum of the preceding data; 0 to start
+ * @param data Data
+ * @param size Size of the data in bytes
+ * @return Checksum
+ */
+uint64_t gu_checksum(uint64_t checksum, const void* data, size_t size)
+{
+    const unsigned char* p = data;
+    size_t i;
+
+    if (checksum == 0)
+        checksum = FNV_BASIS;
+    for (i = 0; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t w;
+
+        memcpy(&w, &p[i], sizeof(uint64_t));
+        checksum ^= w;
+        checksum *= FNV_PRIME;
+    }
+    for (; i < size; ++i) {
+        checksum ^= p[i];
+        checksum *= FNV_PRIME;
+    }
+
+    return checksum;
+}
+
+/** Calculates 64-bit checksum of the contents of a file (see gu_checksum()).
+ * @param checksum Checksum of the preceding data; 0 to start
+ * @param fname File name
+ * @return Checksum
+ */
+uint64_t gu_checksumfile(uint64_t checksum, char* fname)
+{
+    FILE* f = gu_fopen(fname, "r");
+    char buf[BUFSIZE];
+    size_t n;
+
+    while ((n = fread(buf, 1, BUFSIZE, f)) > 0)
+        checksum = gu_checksum(checksum, buf, n);
+    if (ferror(f))
+        gu_quit("%s: read error", fname);
+    fclose(f);
+
+    return checksum;
+}
+
+/** Writes a block of data to a binary file, padding it to a multiple of 8
+ * bytes, so that the next block can be accessed in place after the file is
+ * mapped to memory.
+ * @param f File
+ * @param data Data
+ * @param size Size of the data in bytes
+ */
+void gu_writeblock(FILE* f, const void* data, size_t size)
+{
+    static const char zeros[BLOCKALIGN] = { 0 };
+    size_t npad = (BLOCKALIGN - size % BLOCKALIGN) % BLOCKALIGN;
+
+    if (size > 0 && fwrite(data, 1, size, f) != size)
+        gu_quit("gu_writeblock(): %s", strerror(errno));
+    if (npad > 0 && fwrite(zeros, 1, npad, f) != npad)
+        gu_quit("gu_writeblock(): %s", strerror(errno));
+}
+
+/** Gets a block of data written by gu_writeblock() from a file mapped to
+ * memory.
+ * @param pos Pointer to the current position in the mapped file; is advanced
+ *            to the next block
+ * @param end End of the mapped file
+ * @param size Size of the data in bytes
+ * @return Pointer to the data
+ */
+void* gu_readblock(char** pos, char* end, size_t size)
+{
+    char* data = *pos;
+    size_t npad = (BLOCKALIGN - size % BLOCKALIGN) % BLOCKALIGN;
+
+    if (size > (size_t) (end - data) || npad > (size_t) (end - data) - size)
+        gu_quit("gu_readblock(): unexpected end of data");
+    *pos = data + size + npad;
+
+    return data;
+}
+
+/** Converts longitude and latitude to Cartesian coordinates on the unit
+ * sphere.
+ * @param lon Longitude (degrees)
+ * @param lat Latitude (degrees)
+ * @param xyz Output coordinates [3]
+ */
+void gu_lonlat2xyz(double lon, double lat, double xyz[])
+{
+    double coslat = cos(lat * DEG2RAD);
+
+    xyz[0] = coslat * cos(lon * DEG2RAD);
+    xyz[1] = coslat * sin(lon * DEG2RAD);
+    xyz[2] = sin(lat * DEG2RAD);
+}
+
+/** Calculates the basis of the plane tangent to the unit sphere at a point:
+ * the position of the point and the unit vectors pointing east and north.
+ * @param lon Longitude of the point (degrees)
+ * @param lat Latitude of the point (degrees)
+ * @param basis Output basis [9]
+ */
+void gu_tangentplane(double lon, double lat, double basis[])
+{
+    double sinlon = sin(lon * DEG2RAD);
+    double coslon = cos(lon * DEG2RAD);
+    double sinlat = sin(lat * DEG2RAD);
+    double coslat = cos(lat * DEG2RAD);
+
+    basis[0] = coslat * coslon;
+    basis[1] = coslat * sinlon;
+    basis[2] = sinlat;
+    basis[3] = -sinlon;
+    basis[4] = coslon;
+    basis[5] = 0.0;
+    basis[6] = -sinlat * coslon;
+    basis[7] = -sinlat * sinlon;
+    basis[8] = coslat;
+}
+
+/** Projects a point on the plane tangent to the unit sphere (gnomonic
+ * projection). The projection maps great circles to straight lines.
+ * @param basis Basis of the tangent plane (see gu_tangentplane())
+ * @param lon Longitude of the point (degrees)
+ * @param lat Latitude of the point (degrees)
+ * @param x Output X coordinate (eastwards)
+ * @param y Output Y coordinate (northwards)
+ * @return 1 if successful, 0 if the point is not in the hemisphere centred
+ *         at the tangent point
+ */
+int gu_gnomonic(const double basis[], double lon, double lat, double* x, double* y)
+{
+    double xyz[3];
+    double dot;
+
+    gu_lonlat2xyz(lon, lat, xyz);
+    dot = xyz[0] * basis[0] + xyz[1] * basis[1] + xyz[2] * basis[2];
+    if (!(dot > 0.0))
+        return 0;
+    *x = (xyz[0] * basis[3] + xyz[1] * basis[4] + xyz[2] * basis[5]) / dot;
+    *y = (xyz[0] * basis[6] + xyz[1] * basis[7] + xyz[2] * basis[8]) / dot;
+
+    return 1;
+}
@@ -15,6 +15,7 @@
 #if !defined(_GUCOMMON_H)
 #define _GUCOMMON_H
 
+#include <stdint.h>
 #include "guquit.h"
 
 extern int gu_verbose;          /* set verbosity from your application */
@@ -24,5 +25,12 @@ FILE* gu_fopen(const char* path, const char* mode);
 void* gu_alloc2d(size_t nj, size_t ni, size_t unitsize);
 void gu_free2d(void* dummy);
 int** gu_readmask(char* fname, int nx, int ny);
+uint64_t gu_checksum(uint64_t checksum, const void* data, size_t size);
+uint64_t gu_checksumfile(uint64_t checksum, char* fname);
+void gu_writeblock(FILE* f, const void* data, size_t size);
+void* gu_readblock(char** pos, char* end, size_t size);
+void gu_lonlat2xyz(double lon, double lat, double xyz[]);
+void gu_tangentplane(double lon, double lat, double basis[]);
+int gu_gnomonic(const double basis[], double lon, double lat, double* x, double* y);
 
 #endif
@@ -20,10 +20,22 @@
 #include <math.h>
 #include <float.h>
 #include <stdint.h>
+#include <stddef.h>
 #include "kdtree.h"
 
 #define NALLOCSTART 1024
 #define SEED 5555
+#define NDIMLOCAL 8
+#define NTASKMIN 65536          /* minimal number of nodes in a subtree for
+                                 * building it in a parallel task */
+#define NHITSSTART 64           /* initial size of the range query
+                                 * buffer */
+#define NBUCKETMAX 32           /* maximal number of nodes in a leaf bucket */
+#define NHEADER 7               /* number of size_t entries in the header
+                                 * written by kd_write() */
+#define PAD8(n) (((n) + 7) / 8 * 8)
+#define NSTACK 256              /* size of the explicit stack of the 2D and
+                                 * 3D searches */
 
 struct resnode;
 typedef struct resnode resnode;
@@ -36,6 +48,18 @@ struct kdnode {
     size_t right;
 };
 
+/*
+ * node of a bucketed tree; the nodes are stored in preorder, so that the
+ * left child of an internal node follows it
+ */
+typedef struct {
+    double split;               /* split coordinate */
+    size_t right;               /* position of the right child */
+    size_t start;               /* position of the first node of a leaf */
+    int dir;                    /* split direction; -1 for a leaf */
+    int n;                      /* number of nodes in a leaf */
+} kdbnode;
+
 struct kdtree {
     int ndim;
     size_t nnodes;
@@ -44,6 +68,30 @@ struct kdtree {
     double* coords;
     double* min;
     double* max;
+
+    /*
+     * bucketed tree (see kd_build_bucketed()) 
+     */
+    int bucketsize;             /* 0 if the tree is not bucketed */
+    size_t nbnodes;
+    kdbnode* bnodes;
+    double* soa;                /* node coordinates in leaf order by
+                                 * dimension [ndim][nnodes] */
+
+    /*
+     * compact bucketed tree (see kd_build_compact()); `nodes', `coords' and
+     * `soa' are not used
+     */
+    int compact;
+    float* soa32;               /* node coordinates relative to `min' in
+                                 * leaf order by dimension [ndim][nnodes] */
+    uint32_t* ids32;            /* original node ids [nnodes] */
+
+    /*
+     * nearest node search specialised for the number of dimensions (NULL if
+     * not available); returns SIZE_MAX if the search can not be completed
+     */
+    size_t (*findnearest) (const kdtree* tree, const double* coords);
 };
 
 struct resnode {
@@ -59,6 +107,59 @@ struct kdset {
     int beingread;
 };
 
+/*
+ * a node found by a range query
+ */
+typedef struct {
+    size_t id;
+    double dist;                /* squared distance */
+} kdhit;
+
+/*
+ * reusable context for range queries; the results are stored in a
+ * contiguous buffer that only grows
+ */
+struct kdquery {
+    size_t size;
+    size_t nallocated;
+    kdhit* hits;
+};
+
+/*
+ * entry of the explicit stack of the 2D and 3D nearest node searches
+ */
+typedef struct {
+    size_t id;                  /* node position */
+    int task;                   /* TASK_* */
+    double rd;                  /* squared distance from the point to the
+                                 * subtree rectangle */
+    double off[3];              /* offsets of the point from the subtree
+                                 * rectangle by dimension */
+} kdstackentry;
+
+#define TASK_SEARCH 0           /* search the subtree */
+#define TASK_SEARCHIFNEAR 1     /* search the subtree if its rectangle is
+                                 * nearer than the nearest node found */
+#define TASK_CHECKNODE 2        /* check the node itself */
+
+static size_t findnearest2(const kdtree* tree, const double* coords);
+static size_t findnearest3(const kdtree* tree, const double* coords);
+
+/*
+ * state of a k nearest nodes search; the found nodes are kept in a max-heap
+ * with the farthest node on top
+ */
+typedef struct {
+    const double* coords;       /* search point */
+    size_t k;                   /* number of nodes to find */
+    size_t n;                   /* number of nodes found so far */
+    size_t* ids;                /* node ids [k] */
+    double* dists;              /* squared distances [k] */
+    double* minmax;             /* hyperrect of the current subtree (for a
+                                 * bucketed tree -- offsets of the point from
+                                 * it by dimension) */
+} knnsearch;
+
 /**
  */
 kdtree* kd_create(int ndim)
@@ -72,6 +173,19 @@ kdtree* kd_create(int ndim)
     tree->nallocated = 0;
     tree->nodes = NULL;
     tree->coords = NULL;
+    tree->bucketsize = 0;
+    tree->nbnodes = 0;
+    tree->bnodes = NULL;
+    tree->soa = NULL;
+    tree->compact = 0;
+    tree->soa32 = NULL;
+    tree->ids32 = NULL;
+    if (ndim == 2)
+        tree->findnearest = findnearest2;
+    else if (ndim == 3)
+        tree->findnearest = findnearest3;
+    else
+        tree->findnearest = NULL;
     tree->min = malloc(ndim * 2 * sizeof(double));
     tree->max = &tree->min[ndim];
     for (i = 0; i < ndim; ++i) {
@@ -89,6 +203,10 @@ void kd_destroy(kdtree* tree)
     if (tree->nallocated > 0) {
         free(tree->nodes);
         free(tree->coords);
+        free(tree->bnodes);
+        free(tree->soa);
+        free(tree->soa32);
+        free(tree->ids32);
     }
     free(tree->min);
     free(tree);
@@ -135,7 +253,7 @@ void kd_insertnode(kdtree* tree, const double* coords, size_t id_orig)
             tree->nallocated = NALLOCSTART;
         tree->nodes = realloc(tree->nodes, tree->nallocated * sizeof(kdnode));
         tree->coords = realloc(tree->coords, tree->nallocated * tree->ndim * sizeof(double));
-        if (tree->nallocated == NALLOCSTART)
+        if (tree->nnodes == 0)
             tree->nodes[0].id = SIZE_MAX;
     }
 
@@ -182,7 +300,7 @@ void kd_insertnodes(kdtree* tree, size_t n, double** src, int randomise)
         tree->nallocated += n;
         tree->nodes = realloc(tree->nodes, tree->nallocated * sizeof(kdnode));
         tree->coords = realloc(tree->coords, tree->nallocated * tree->ndim * sizeof(double));
-        if (tree->nallocated == n)
+        if (tree->nnodes == 0)
             tree->nodes[0].id = SIZE_MAX;
     }
 
@@ -217,6 +335,554 @@ void kd_insertnodes(kdtree* tree, size_t n, double** src, int randomise)
     free(coords);
 }
 
+/** Partially sorts node ids so that the k-th id is that of the node with the
+ * k-th smallest coordinate; the nodes before it have coordinates that are
+ * smaller or equal, and the nodes after it -- greater or equal.
+ * @param v Node coordinates
+ * @param ids Node ids [n]
+ * @param n Number of nodes
+ * @param k Position of the node to be selected
+ */
+static void select_kth(const double* v, size_t* ids, size_t n, size_t k)
+{
+    ptrdiff_t lo = 0;
+    ptrdiff_t hi = n - 1;
+
+    while (hi > lo) {
+        double pivot = v[ids[lo + (hi - lo) / 2]];
+        ptrdiff_t i = lo;
+        ptrdiff_t j = hi;
+
+        while (i <= j) {
+            while (v[ids[i]] < pivot)
+                i++;
+            while (v[ids[j]] > pivot)
+                j--;
+            if (i <= j) {
+                size_t tmp = ids[i];
+
+                ids[i] = ids[j];
+                ids[j] = tmp;
+                i++;
+                j--;
+            }
+        }
+        if ((ptrdiff_t) k <= j)
+            hi = j;
+        else if ((ptrdiff_t) k >= i)
+            lo = i;
+        else
+            return;
+    }
+}
+
+/** Builds a balanced subtree with nodes stored in preorder.
+ * @param tree The tree
+ * @param src Node coordinates [ndim][]
+ * @param ids Ids of the subtree nodes [n]
+ * @param n Number of nodes in the subtree
+ * @param pos Position of the subtree root in the node array
+ * @param dir Split direction of the subtree root
+ */
+static void _kd_buildbalanced(kdtree* tree, double** src, size_t* ids, size_t n, size_t pos, int dir)
+{
+    int ndim = tree->ndim;
+    size_t m = n / 2;
+    kdnode* node = &tree->nodes[pos];
+    int newdir = (dir + 1) % ndim;
+    int i;
+
+    select_kth(src[dir], ids, n, m);
+    node->id = pos;
+    node->id_orig = ids[m];
+    node->dir = dir;
+    node->left = (m > 0) ? pos + 1 : SIZE_MAX;
+    node->right = (n - m > 1) ? pos + 1 + m : SIZE_MAX;
+    for (i = 0; i < ndim; ++i)
+        tree->coords[pos * ndim + i] = src[i][ids[m]];
+
+    if (m > 0) {
+#if defined(_OPENMP)
+#pragma omp task if (n >= NTASKMIN)
+#endif
+        _kd_buildbalanced(tree, src, ids, m, pos + 1, newdir);
+    }
+    if (n - m > 1)
+        _kd_buildbalanced(tree, src, &ids[m + 1], n - m - 1, pos + 1 + m, newdir);
+#if defined(_OPENMP)
+#pragma omp taskwait
+#endif
+}
+
+/** Builds a balanced tree from an array of nodes by recursive median
+ * partitioning. The nodes are stored in preorder (depth-first traversal
+ * order). If compiled with OpenMP, large subtrees are built in parallel; the
+ * resulting tree does not depend on the number of threads.
+ *
+ * The tree must be empty; otherwise the nodes are inserted by
+ * kd_insertnodes().
+ *
+ * @param tree The tree
+ * @param n Number of nodes
+ * @param src Node coordinates [ndim][n]; nodes with non-finite first
+ *            coordinate are skipped
+ */
+void kd_build_balanced(kdtree* tree, size_t n, double** src)
+{
+    int ndim = tree->ndim;
+    size_t* ids = NULL;
+    size_t nvalid, i;
+    int j;
+
+    if (tree->nnodes > 0) {
+        kd_insertnodes(tree, n, src, 1);
+        return;
+    }
+
+    ids = malloc(n * sizeof(size_t));
+    for (i = 0, nvalid = 0; i < n; ++i) {
+        if (!isfinite(src[0][i]))
+            continue;
+        ids[nvalid++] = i;
+        for (j = 0; j < ndim; ++j) {
+            if (src[j][i] < tree->min[j])
+                tree->min[j] = src[j][i];
+            if (src[j][i] > tree->max[j])
+                tree->max[j] = src[j][i];
+        }
+    }
+    if (nvalid == 0) {
+        free(ids);
+        return;
+    }
+
+    if (tree->nallocated < nvalid) {
+        tree->nallocated = nvalid;
+        tree->nodes = realloc(tree->nodes, tree->nallocated * sizeof(kdnode));
+        tree->coords = realloc(tree->coords, tree->nallocated * ndim * sizeof(double));
+    }
+
+#if defined(_OPENMP)
+#pragma omp parallel
+#pragma omp single
+#endif
+    _kd_buildbalanced(tree, src, ids, nvalid, 0, 0);
+    tree->nnodes = nvalid;
+
+    free(ids);
+}
+
+/** Gets the number of nodes of a bucketed subtree.
+ */
+static size_t countbnodes(size_t n, int bucketsize)
+{
+    if (n <= (size_t) bucketsize)
+        return 1;
+    return 1 + countbnodes(n / 2, bucketsize) + countbnodes(n - n / 2, bucketsize);
+}
+
+/** Builds a bucketed subtree. Internal nodes split the subtree nodes at the
+ * median of the coordinate with the largest spread.
+ * @param tree The tree
+ * @param src Node coordinates [ndim][]
+ * @param ids Ids of the subtree nodes [n]
+ * @param n Number of nodes in the subtree
+ * @param pos Position of the subtree root in the bucket node array
+ * @param start Position of the first subtree node in the node array
+ */
+static void _kd_buildbucketed(kdtree* tree, double** src, size_t* ids, size_t n, size_t pos, size_t start)
+{
+    int ndim = tree->ndim;
+    kdbnode* bnode = &tree->bnodes[pos];
+    size_t m = n / 2;
+    size_t i;
+    int j;
+
+    if (n <= (size_t) tree->bucketsize) {
+        bnode->split = NAN;
+        bnode->right = SIZE_MAX;
+        bnode->start = start;
+        bnode->dir = -1;
+        bnode->n = n;
+        if (tree->compact) {
+            for (i = 0; i < n; ++i) {
+                tree->ids32[start + i] = (uint32_t) ids[i];
+                for (j = 0; j < ndim; ++j)
+                    tree->soa32[j * tree->nnodes + start + i] = (float) (src[j][ids[i]] - tree->min[j]);
+            }
+            return;
+        }
+        for (i = 0; i < n; ++i) {
+            kdnode* node = &tree->nodes[start + i];
+
+            node->id = start + i;
+            node->id_orig = ids[i];
+            node->dir = 0;
+            node->left = SIZE_MAX;
+            node->right = SIZE_MAX;
+            for (j = 0; j < ndim; ++j) {
+                tree->coords[(start + i) * ndim + j] = src[j][ids[i]];
+                tree->soa[j * tree->nnodes + start + i] = src[j][ids[i]];
+            }
+        }
+        return;
+    }
+
+    {
+        double maxspread = -1.0;
+
+        bnode->dir = 0;
+        for (j = 0; j < ndim; ++j) {
+            double* v = src[j];
+            double min = v[ids[0]];
+            double max = v[ids[0]];
+
+            for (i = 1; i < n; ++i) {
+                if (v[ids[i]] < min)
+                    min = v[ids[i]];
+                else if (v[ids[i]] > max)
+                    max = v[ids[i]];
+            }
+            if (max - min > maxspread) {
+                maxspread = max - min;
+                bnode->dir = j;
+            }
+        }
+    }
+
+    select_kth(src[bnode->dir], ids, n, m);
+    bnode->split = src[bnode->dir][ids[m]];
+    bnode->right = pos + 1 + countbnodes(m, tree->bucketsize);
+    bnode->start = start;
+    bnode->n = n;
+
+#if defined(_OPENMP)
+#pragma omp task if (n >= NTASKMIN)
+#endif
+    _kd_buildbucketed(tree, src, ids, m, pos + 1, start);
+    _kd_buildbucketed(tree, src, &ids[m], n - m, bnode->right, start + m);
+#if defined(_OPENMP)
+#pragma omp taskwait
+#endif
+}
+
+/**
+ */
+static void build_bucketed(kdtree* tree, size_t n, double** src, int bucketsize, int compact)
+{
+    int ndim = tree->ndim;
+    size_t* ids = NULL;
+    size_t nvalid, i;
+    int j;
+
+    if (tree->nnodes > 0) {
+        kd_insertnodes(tree, n, src, 1);
+        return;
+    }
+
+    if (bucketsize < 1)
+        bucketsize = 1;
+    else if (bucketsize > NBUCKETMAX)
+        bucketsize = NBUCKETMAX;
+
+    ids = malloc(n * sizeof(size_t));
+    for (i = 0, nvalid = 0; i < n; ++i) {
+        if (!isfinite(src[0][i]))
+            continue;
+        ids[nvalid++] = i;
+        for (j = 0; j < ndim; ++j) {
+            if (src[j][i] < tree->min[j])
+                tree->min[j] = src[j][i];
+            if (src[j][i] > tree->max[j])
+                tree->max[j] = src[j][i];
+        }
+    }
+    if (nvalid == 0) {
+        free(ids);
+        return;
+    }
+
+    tree->bucketsize = bucketsize;
+    tree->nnodes = nvalid;
+    tree->nbnodes = countbnodes(nvalid, bucketsize);
+    tree->bnodes = malloc(tree->nbnodes * sizeof(kdbnode));
+    if (compact && n <= UINT32_MAX) {
+        tree->compact = 1;
+        tree->nallocated = nvalid;
+        tree->soa32 = malloc(nvalid * ndim * sizeof(float));
+        tree->ids32 = malloc(nvalid * sizeof(uint32_t));
+    } else {
+        if (tree->nallocated < nvalid) {
+            tree->nallocated = nvalid;
+            tree->nodes = realloc(tree->nodes, tree->nallocated * sizeof(kdnode));
+            tree->coords = realloc(tree->coords, tree->nallocated * ndim * sizeof(double));
+        }
+        tree->soa = malloc(nvalid * ndim * sizeof(double));
+    }
+
+#if defined(_OPENMP)
+#pragma omp parallel
+#pragma omp single
+#endif
+    _kd_buildbucketed(tree, src, ids, nvalid, 0, 0);
+
+    free(ids);
+}
+
+/** Builds a balanced bucketed tree from an array of nodes. Unlike the tree
+ * built by kd_build_balanced(), the leaves of this tree contain buckets of
+ * up to `bucketsize' nodes, which makes the tree shallower. The coordinates
+ * of the nodes of each bucket are also stored by dimension, so that the
+ * distances to them are calculated in loops that can be vectorised by the
+ * compiler.
+ *
+ * The node ids of a bucketed tree follow the order of the buckets. Nodes
+ * can not be inserted into a bucketed tree. The tree must be empty;
+ * otherwise the nodes are inserted by kd_insertnodes().
+ *
+ * @param tree The tree
+ * @param n Number of nodes
+ * @param src Node coordinates [ndim][n]; nodes with non-finite first
+ *            coordinate are skipped
+ * @param bucketsize Maximal number of nodes in a bucket (1 to 32; 8 to 32
+ *            is recommended)
+ */
+void kd_build_bucketed(kdtree* tree, size_t n, double** src, int bucketsize)
+{
+    build_bucketed(tree, n, src, bucketsize, 0);
+}
+
+/** Builds a compact bucketed tree. Same as kd_build_bucketed(), but the
+ * node coordinates are stored in single precision (relative to the
+ * boundary rectangle) and the original node ids -- as 32-bit integers. This
+ * takes about 12 bytes per node in 2D instead of about 70. The searches
+ * are approximate: distances are calculated to the rounded node
+ * coordinates. kd_getnodecoords() is not available for a compact tree.
+ *
+ * If there are 2^32 nodes or more, the tree is built by
+ * kd_build_bucketed().
+ *
+ * @param tree The tree
+ * @param n Number of nodes
+ * @param src Node coordinates [ndim][n]; nodes with non-finite first
+ *            coordinate are skipped
+ * @param bucketsize Maximal number of nodes in a bucket (1 to 32)
+ */
+void kd_build_compact(kdtree* tree, size_t n, double** src, int bucketsize)
+{
+    build_bucketed(tree, n, src, bucketsize, 1);
+}
+
+/*
+ * original id of a node and its position
+ */
+typedef struct {
+    size_t id;
+    size_t pos;
+} idpos;
+
+/**
+ */
+static int cmp_idpos(const void* p1, const void* p2)
+{
+    const idpos* e1 = p1;
+    const idpos* e2 = p2;
+
+    if (e1->id < e2->id)
+        return -1;
+    if (e1->id > e2->id)
+        return 1;
+    return 0;
+}
+
+/** Builds a bucketed subtree again after some of its nodes have been
+ * updated. The nodes are indexed locally by their positions within the
+ * subtree; the original ids are restored afterwards.
+ * @param tree The tree
+ * @param pos Position of the subtree root
+ * @param ks Updated nodes within the subtree [nk]
+ * @param nk Number of updated nodes within the subtree
+ * @param where Positions of the updated nodes in the tree
+ * @param src New coordinates of the updated nodes
+ */
+static void _kd_rebuildsubtree(kdtree* tree, size_t pos, size_t* ks, size_t nk, size_t* where, double** src)
+{
+    int ndim = tree->ndim;
+    kdbnode* bnode = &tree->bnodes[pos];
+    size_t start = bnode->start;
+    size_t n = bnode->n;
+    size_t* ids = malloc(n * sizeof(size_t));
+    size_t* orig = malloc(n * sizeof(size_t));
+    double* coords[NDIMLOCAL];
+    double** v = (ndim <= NDIMLOCAL) ? coords : malloc(ndim * sizeof(double*));
+    size_t i, k;
+    int j;
+
+    for (j = 0; j < ndim; ++j)
+        v[j] = malloc(n * sizeof(double));
+    for (i = 0; i < n; ++i) {
+        ids[i] = i;
+        orig[i] = kd_getnodeorigid(tree, start + i);
+        for (j = 0; j < ndim; ++j)
+            v[j][i] = (tree->compact) ? (double) tree->soa32[j * tree->nnodes + start + i] + tree->min[j] : tree->soa[j * tree->nnodes + start + i];
+    }
+    for (k = 0; k < nk; ++k)
+        for (j = 0; j < ndim; ++j)
+            v[j][where[ks[k]] - start] = src[j][ks[k]];
+
+    _kd_buildbucketed(tree, v, ids, n, pos, start);
+
+    for (i = start; i < start + n; ++i) {
+        if (tree->compact)
+            tree->ids32[i] = (uint32_t) orig[tree->ids32[i]];
+        else
+            tree->nodes[i].id_orig = orig[tree->nodes[i].id_orig];
+    }
+
+    for (j = 0; j < ndim; ++j)
+        free(v[j]);
+    if (v != coords)
+        free(v);
+    free(orig);
+    free(ids);
+}
+
+/** Updates a bucketed subtree. If none of the updated nodes crosses the
+ * split of the subtree root, the halves are updated separately; otherwise
+ * the subtree is built again.
+ * @param tree The tree
+ * @param pos Position of the subtree root
+ * @param ks Updated nodes within the subtree [nk]
+ * @param nk Number of updated nodes within the subtree
+ * @param where Positions of the updated nodes in the tree
+ * @param src New coordinates of the updated nodes
+ */
+static void _kd_updatesubtree(kdtree* tree, size_t pos, size_t* ks, size_t nk, size_t* where, double** src)
+{
+    kdbnode* bnode = &tree->bnodes[pos];
+    size_t mid = bnode->start + bnode->n / 2;
+    size_t nleft, k;
+
+    if (nk == 0)
+        return;
+
+    if (bnode->dir >= 0) {
+        for (k = 0; k < nk; ++k) {
+            double v = src[bnode->dir][ks[k]];
+
+            if ((where[ks[k]] < mid) ? v > bnode->split : v < bnode->split)
+                break;
+        }
+        if (k == nk) {
+            for (k = 0, nleft = 0; k < nk; ++k) {
+                if (where[ks[k]] < mid) {
+                    size_t tmp = ks[nleft];
+
+                    ks[nleft++] = ks[k];
+                    ks[k] = tmp;
+                }
+            }
+            _kd_updatesubtree(tree, pos + 1, ks, nleft, where, src);
+            _kd_updatesubtree(tree, bnode->right, &ks[nleft], nk - nleft, where, src);
+            return;
+        }
+    }
+
+    _kd_rebuildsubtree(tree, pos, ks, nk, where, src);
+}
+
+/** Updates coordinates of some nodes of a bucketed tree. The subtrees with
+ * updated nodes that cross the splits of their roots (and the leaves with
+ * updated nodes) are built again in place; the rest of the tree is not
+ * changed. This works because the layout of a bucketed subtree depends on
+ * the number of its nodes only.
+ *
+ * The update is not possible (and the tree needs to be built again) if the
+ * tree is not bucketed or has been attached to mapped data, if an updated
+ * node moves outside the boundary rectangle of the tree, or if a node
+ * becomes valid or invalid (i.e. its first coordinate changes from
+ * non-finite to finite or vice versa).
+ *
+ * @param tree The tree
+ * @param n Number of updated nodes
+ * @param ids Original ids of the updated nodes [n]
+ * @param src New coordinates of the updated nodes [ndim][n]
+ * @return 1 if successful, 0 if the tree can not be updated
+ */
+int kd_updatenodes(kdtree* tree, size_t n, size_t* ids, double** src)
+{
+    int ndim = tree->ndim;
+    idpos* sorted;
+    size_t* where;              /* positions of the updated nodes */
+    size_t* ks;                 /* valid updated nodes */
+    size_t nk, i, k;
+    int j;
+
+    if (tree->bucketsize == 0 || tree->nallocated == 0)
+        return 0;
+    if (n == 0)
+        return 1;
+
+    /*
+     * find the positions of the updated nodes in the tree
+     */
+    sorted = malloc(n * sizeof(idpos));
+    for (k = 0; k < n; ++k) {
+        sorted[k].id = ids[k];
+        sorted[k].pos = k;
+    }
+    qsort(sorted, n, sizeof(idpos), cmp_idpos);
+    where = malloc(n * sizeof(size_t));
+    ks = malloc(n * sizeof(size_t));
+    for (k = 0; k < n; ++k)
+        where[k] = SIZE_MAX;
+    for (i = 0; i < tree->nnodes; ++i) {
+        idpos key;
+        idpos* found;
+
+        key.id = kd_getnodeorigid(tree, i);
+        if (key.id < sorted[0].id || key.id > sorted[n - 1].id)
+            continue;
+        found = bsearch(&key, sorted, n, sizeof(idpos), cmp_idpos);
+        if (found != NULL)
+            where[found->pos] = i;
+    }
+    free(sorted);
+    for (k = 0; k < n; ++k) {
+        if (!isfinite(src[0][k])) {
+            if (where[k] != SIZE_MAX)
+                goto failed;
+            continue;
+        }
+        if (where[k] == SIZE_MAX)
+            goto failed;
+        for (j = 0; j < ndim; ++j)
+            if (!(src[j][k] >= tree->min[j] && src[j][k] <= tree->max[j]))
+                goto failed;
+    }
+
+    for (k = 0, nk = 0; k < n; ++k)
+        if (where[k] != SIZE_MAX)
+            ks[nk++] = k;
+    _kd_updatesubtree(tree, 0, ks, nk, where, src);
+    free(ks);
+
+    free(where);
+    return 1;
+
+  failed:
+    free(ks);
+    free(where);
+    return 0;
+}
+
+/**
+ */
+int kd_getndim(const kdtree* tree)
+{
+    return tree->ndim;
+}
+
 /**
  */
 size_t kd_getsize(kdtree* tree)
@@ -241,6 +907,208 @@ static double disttohyperrect(int ndim, const double* min, const double* max, co
     return dist;
 }
 
+/** Moves the top element of the max-heap down to restore the heap order.
+ */
+static void heap_siftdown(size_t* ids, double* dists, size_t n, size_t i)
+{
+    size_t id = ids[i];
+    double dist = dists[i];
+
+    while (2 * i + 1 < n) {
+        size_t child = 2 * i + 1;
+
+        if (child + 1 < n && dists[child + 1] > dists[child])
+            child++;
+        if (dists[child] <= dist)
+            break;
+        ids[i] = ids[child];
+        dists[i] = dists[child];
+        i = child;
+    }
+    ids[i] = id;
+    dists[i] = dist;
+}
+
+/** Adds a node to the set of found nodes if it is nearer than the farthest
+ * found node or if fewer than k nodes have been found.
+ */
+static void knn_add(knnsearch* s, size_t id, double dist)
+{
+    if (s->n < s->k) {
+        size_t i = s->n++;
+
+        while (i > 0 && s->dists[(i - 1) / 2] < dist) {
+            s->ids[i] = s->ids[(i - 1) / 2];
+            s->dists[i] = s->dists[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        s->ids[i] = id;
+        s->dists[i] = dist;
+    } else if (dist < s->dists[0]) {
+        s->ids[0] = id;
+        s->dists[0] = dist;
+        heap_siftdown(s->ids, s->dists, s->n, 0);
+    }
+}
+
+/** Calculates squared distances from a point to the nodes of a bucket.
+ */
+static void bucket_dists(const kdtree* tree, const kdbnode* leaf, const double* coords, double* dists)
+{
+    int n = leaf->n;
+    int i, j;
+
+    for (j = 0; j < n; ++j)
+        dists[j] = 0.0;
+    if (tree->compact) {
+        for (i = 0; i < tree->ndim; ++i) {
+            const float* v = &tree->soa32[i * tree->nnodes + leaf->start];
+            double c = coords[i] - tree->min[i];
+
+            for (j = 0; j < n; ++j)
+                dists[j] += ((double) v[j] - c) * ((double) v[j] - c);
+        }
+        return;
+    }
+    for (i = 0; i < tree->ndim; ++i) {
+        const double* v = &tree->soa[i * tree->nnodes + leaf->start];
+        double c = coords[i];
+
+        for (j = 0; j < n; ++j)
+            dists[j] += (v[j] - c) * (v[j] - c);
+    }
+}
+
+/** Calculates offsets of a point from the tree boundary rectangle by
+ * dimension.
+ * @return Squared distance from the point to the boundary rectangle
+ */
+static double getoffsets(const kdtree* tree, const double* coords, double* off)
+{
+    double dist = 0.0;
+    int i;
+
+    for (i = 0; i < tree->ndim; ++i) {
+        if (coords[i] < tree->min[i])
+            off[i] = coords[i] - tree->min[i];
+        else if (coords[i] > tree->max[i])
+            off[i] = coords[i] - tree->max[i];
+        else
+            off[i] = 0.0;
+        dist += off[i] * off[i];
+    }
+
+    return dist;
+}
+
+/** Searches for the nearest node in a bucketed subtree. The farther
+ * subtrees are pruned by the distance to their rectangles, which is updated
+ * incrementally from the offsets of the point by dimension.
+ * @param tree The tree
+ * @param pos Position of the subtree root
+ * @param coords Coordinates of the point
+ * @param off Offsets of the point from the subtree rectangle [ndim]
+ * @param rd Squared distance from the point to the subtree rectangle
+ * @param result Nearest node found so far
+ * @param resdist Squared distance to the nearest node found so far
+ */
+static void _kd_findnearestbucket(const kdtree* tree, size_t pos, const double* coords, double* off, double rd, size_t* result, double* resdist)
+{
+    const kdbnode* bnode = &tree->bnodes[pos];
+    double d;
+
+    if (bnode->dir < 0) {
+        double dists[NBUCKETMAX];
+        int j;
+
+        bucket_dists(tree, bnode, coords, dists);
+        for (j = 0; j < bnode->n; ++j) {
+            if (dists[j] < *resdist) {
+                *result = bnode->start + j;
+                *resdist = dists[j];
+            }
+        }
+        return;
+    }
+
+    d = coords[bnode->dir] - bnode->split;
+    _kd_findnearestbucket(tree, (d < 0.0) ? pos + 1 : bnode->right, coords, off, rd, result, resdist);
+    {
+        double offold = off[bnode->dir];
+
+        rd += d * d - offold * offold;
+        if (rd < *resdist) {
+            off[bnode->dir] = d;
+            _kd_findnearestbucket(tree, (d < 0.0) ? bnode->right : pos + 1, coords, off, rd, result, resdist);
+            off[bnode->dir] = offold;
+        }
+    }
+}
+
+/**
+ */
+static void _kd_findknearestbucket(const kdtree* tree, size_t pos, double rd, knnsearch* s)
+{
+    const kdbnode* bnode = &tree->bnodes[pos];
+    double d;
+
+    if (bnode->dir < 0) {
+        double dists[NBUCKETMAX];
+        int j;
+
+        bucket_dists(tree, bnode, s->coords, dists);
+        for (j = 0; j < bnode->n; ++j)
+            knn_add(s, bnode->start + j, dists[j]);
+        return;
+    }
+
+    d = s->coords[bnode->dir] - bnode->split;
+    _kd_findknearestbucket(tree, (d < 0.0) ? pos + 1 : bnode->right, rd, s);
+    {
+        double offold = s->minmax[bnode->dir];
+
+        rd += d * d - offold * offold;
+        if (s->n < s->k || rd < s->dists[0]) {
+            s->minmax[bnode->dir] = d;
+            _kd_findknearestbucket(tree, (d < 0.0) ? bnode->right : pos + 1, rd, s);
+            s->minmax[bnode->dir] = offold;
+        }
+    }
+}
+
+/**
+ */
+static void _kd_findnodeswithinrangebucket(const kdtree* tree, size_t pos, const double* coords, double range, kdquery* q)
+{
+    const kdbnode* bnode = &tree->bnodes[pos];
+    double d;
+
+    if (bnode->dir < 0) {
+        double dists[NBUCKETMAX];
+        int j;
+
+        bucket_dists(tree, bnode, coords, dists);
+        for (j = 0; j < bnode->n; ++j) {
+            if (dists[j] > range * range)
+                continue;
+            if (q->size == q->nallocated) {
+                q->nallocated = (q->nallocated == 0) ? NHITSSTART : q->nallocated * 2;
+                q->hits = realloc(q->hits, q->nallocated * sizeof(kdhit));
+            }
+            q->hits[q->size].id = bnode->start + j;
+            q->hits[q->size].dist = dists[j];
+            q->size++;
+        }
+        return;
+    }
+
+    d = coords[bnode->dir] - bnode->split;
+    if (d <= range)
+        _kd_findnodeswithinrangebucket(tree, pos + 1, coords, range, q);
+    if (d >= -range)
+        _kd_findnodeswithinrangebucket(tree, bnode->right, coords, range, q);
+}
+
 /**
  */
 static void _kdset_insert(kdset* set, size_t id, double dist, int ordered)
@@ -299,7 +1167,7 @@ static int _kd_findnodeswithinrange(const kdtree* tree, int id, const double* co
 
     dx = coords[node->dir] - nodecoords[node->dir];
     ret = _kd_findnodeswithinrange(tree, dx <= 0.0 ? node->left : node->right, coords, range, set, ordered);
-    if (fabs(dx) < range) {
+    if (fabs(dx) <= range) {
         added_res += ret;
         ret = _kd_findnodeswithinrange(tree, dx <= 0.0 ? node->right : node->left, coords, range, set, ordered);
     }
@@ -319,12 +1187,151 @@ kdset* kd_findnodeswithinrange(const kdtree* tree, const double* coords, double
     rset->root = NULL;
     rset->size = 0;
 
+    if (tree->bucketsize > 0) {
+        kdquery q = { 0, 0, NULL };
+        size_t i;
+
+        if (tree->nnodes > 0)
+            _kd_findnodeswithinrangebucket(tree, 0, coords, range, &q);
+        for (i = 0; i < q.size; ++i)
+            _kdset_insert(rset, q.hits[i].id, q.hits[i].dist, ordered);
+        rset->size = q.size;
+        free(q.hits);
+
+        return rset;
+    }
+
     ret = _kd_findnodeswithinrange(tree, 0, coords, range, rset, ordered);
     rset->size = ret;
 
     return rset;
 }
 
+/** Creates a context for range queries with kd_findnodeswithinrange2().
+ */
+kdquery* kdquery_create(void)
+{
+    kdquery* q = malloc(sizeof(kdquery));
+
+    q->size = 0;
+    q->nallocated = 0;
+    q->hits = NULL;
+
+    return q;
+}
+
+/**
+ */
+void kdquery_destroy(kdquery* q)
+{
+    if (q == NULL)
+        return;
+    free(q->hits);
+    free(q);
+}
+
+/**
+ */
+size_t kdquery_getsize(const kdquery* q)
+{
+    return q->size;
+}
+
+/** Gets a node found by the last range query.
+ * @param q The query context
+ * @param i Index of the found node (0 <= i < kdquery_getsize(q))
+ * @param dist Output distance to the node
+ * @return Node id
+ */
+size_t kdquery_getnode(const kdquery* q, size_t i, double* dist)
+{
+    if (i >= q->size) {
+        *dist = NAN;
+        return SIZE_MAX;
+    }
+    *dist = sqrt(q->hits[i].dist);
+
+    return q->hits[i].id;
+}
+
+/**
+ */
+static void _kd_findnodeswithinrange2(const kdtree* tree, size_t id, const double* coords, double range, kdquery* q)
+{
+    int ndim = tree->ndim;
+
+    while (id != SIZE_MAX) {
+        kdnode* node = &tree->nodes[id];
+        double* nodecoords = &tree->coords[id * ndim];
+        double dist, dx;
+        int i;
+
+        for (i = 0, dist = 0.0; i < ndim; i++)
+            dist += (nodecoords[i] - coords[i]) * (nodecoords[i] - coords[i]);
+
+        if (dist <= range * range) {
+            if (q->size == q->nallocated) {
+                q->nallocated = (q->nallocated == 0) ? NHITSSTART : q->nallocated * 2;
+                q->hits = realloc(q->hits, q->nallocated * sizeof(kdhit));
+            }
+            q->hits[q->size].id = id;
+            q->hits[q->size].dist = dist;
+            q->size++;
+        }
+
+        dx = coords[node->dir] - nodecoords[node->dir];
+        if (fabs(dx) <= range)
+            _kd_findnodeswithinrange2(tree, dx <= 0.0 ? node->right : node->left, coords, range, q);
+        id = (dx <= 0.0) ? node->left : node->right;
+    }
+}
+
+/**
+ */
+static int cmp_hits(const void* p1, const void* p2)
+{
+    const kdhit* h1 = p1;
+    const kdhit* h2 = p2;
+
+    if (h1->dist < h2->dist)
+        return -1;
+    if (h1->dist > h2->dist)
+        return 1;
+    if (h1->id < h2->id)
+        return -1;
+    if (h1->id > h2->id)
+        return 1;
+    return 0;
+}
+
+/** Finds nodes within a range from the specified point. Unlike
+ * kd_findnodeswithinrange(), stores the results in the query context, which
+ * can be reused for subsequent queries without further memory allocation.
+ * @param tree The tree
+ * @param coords Coordinates of the point
+ * @param range Search radius
+ * @param ordered Flag: sort the results by increasing distance (nodes at
+ *        equal distances are sorted by id)
+ * @param q The query context (the results of the previous query are
+ *        discarded)
+ * @return Number of nodes found
+ */
+size_t kd_findnodeswithinrange2(const kdtree* tree, const double* coords, double range, int ordered, kdquery* q)
+{
+    q->size = 0;
+    if (tree->nnodes == 0)
+        return 0;
+
+    if (tree->bucketsize > 0)
+        _kd_findnodeswithinrangebucket(tree, 0, coords, range, q);
+    else
+        _kd_findnodeswithinrange2(tree, 0, coords, range, q);
+    if (ordered && q->size > 1)
+        qsort(q->hits, q->size, sizeof(kdhit), cmp_hits);
+
+    return q->size;
+}
+
 /**
  */
 static void _kd_findnearestnode(const kdtree* tree, const size_t nodeid, const double* coords, size_t* result, double* resdist, double* minmax)
@@ -404,16 +1411,347 @@ static void _kd_findnearestnode(const kdtree* tree, const size_t nodeid, const d
     }
 }
 
+/** Gets offset of a coordinate from an interval.
+ */
+static double getoffset(double x, double min, double max)
+{
+    if (x < min)
+        return x - min;
+    else if (x > max)
+        return x - max;
+    return 0.0;
+}
+
+/** Searches for the nearest node in a 2D bucketed tree. Same as
+ * _kd_findnearestbucket(), but with an explicit stack of the farther
+ * subtrees and unrolled distance calculations.
+ * @return Nearest node; SIZE_MAX if the tree is too deep for the stack
+ */
+static size_t findnearestbucket2(const kdtree* tree, const double* coords)
+{
+    kdstackentry stack[NSTACK];
+    int nstack = 0;
+    double x = coords[0];
+    double y = coords[1];
+    size_t result = SIZE_MAX;
+    double resdist = DBL_MAX;
+    kdstackentry e;
+
+    e.id = 0;
+    e.off[0] = getoffset(x, tree->min[0], tree->max[0]);
+    e.off[1] = getoffset(y, tree->min[1], tree->max[1]);
+    e.rd = e.off[0] * e.off[0] + e.off[1] * e.off[1];
+
+    while (1) {
+        const kdbnode* bnode = &tree->bnodes[e.id];
+        double dists[NBUCKETMAX];
+        int n, j;
+
+        /*
+         * descend to the nearer leaf, stacking the farther subtrees
+         */
+        while (bnode->dir >= 0) {
+            double d = coords[bnode->dir] - bnode->split;
+            kdstackentry* far;
+
+            if (nstack == NSTACK)
+                return SIZE_MAX;
+            far = &stack[nstack++];
+            *far = e;
+            far->id = (d < 0.0) ? bnode->right : e.id + 1;
+            far->rd = e.rd + (d * d - e.off[bnode->dir] * e.off[bnode->dir]);
+            far->off[bnode->dir] = d;
+            e.id = (d < 0.0) ? e.id + 1 : bnode->right;
+            bnode = &tree->bnodes[e.id];
+        }
+
+        n = bnode->n;
+        if (tree->compact) {
+            const float* vx = &tree->soa32[bnode->start];
+            const float* vy = &tree->soa32[tree->nnodes + bnode->start];
+            double cx = x - tree->min[0];
+            double cy = y - tree->min[1];
+
+            for (j = 0; j < n; ++j)
+                dists[j] = ((double) vx[j] - cx) * ((double) vx[j] - cx) + ((double) vy[j] - cy) * ((double) vy[j] - cy);
+        } else {
+            const double* vx = &tree->soa[bnode->start];
+            const double* vy = &tree->soa[tree->nnodes + bnode->start];
+
+            for (j = 0; j < n; ++j)
+                dists[j] = (vx[j] - x) * (vx[j] - x) + (vy[j] - y) * (vy[j] - y);
+        }
+        for (j = 0; j < n; ++j) {
+            if (dists[j] < resdist) {
+                result = bnode->start + j;
+                resdist = dists[j];
+            }
+        }
+
+        do {
+            if (nstack == 0)
+                return result;
+            e = stack[--nstack];
+        } while (!(e.rd < resdist));
+    }
+}
+
+/** Searches for the nearest node in a 3D bucketed tree. Same as
+ * _kd_findnearestbucket(), but with an explicit stack of the farther
+ * subtrees and unrolled distance calculations.
+ * @return Nearest node; SIZE_MAX if the tree is too deep for the stack
+ */
+static size_t findnearestbucket3(const kdtree* tree, const double* coords)
+{
+    kdstackentry stack[NSTACK];
+    int nstack = 0;
+    double x = coords[0];
+    double y = coords[1];
+    double z = coords[2];
+    size_t result = SIZE_MAX;
+    double resdist = DBL_MAX;
+    kdstackentry e;
+
+    e.id = 0;
+    e.off[0] = getoffset(x, tree->min[0], tree->max[0]);
+    e.off[1] = getoffset(y, tree->min[1], tree->max[1]);
+    e.off[2] = getoffset(z, tree->min[2], tree->max[2]);
+    e.rd = e.off[0] * e.off[0] + e.off[1] * e.off[1] + e.off[2] * e.off[2];
+
+    while (1) {
+        const kdbnode* bnode = &tree->bnodes[e.id];
+        double dists[NBUCKETMAX];
+        int n, j;
+
+        /*
+         * descend to the nearer leaf, stacking the farther subtrees
+         */
+        while (bnode->dir >= 0) {
+            double d = coords[bnode->dir] - bnode->split;
+            kdstackentry* far;
+
+            if (nstack == NSTACK)
+                return SIZE_MAX;
+            far = &stack[nstack++];
+            *far = e;
+            far->id = (d < 0.0) ? bnode->right : e.id + 1;
+            far->rd = e.rd + (d * d - e.off[bnode->dir] * e.off[bnode->dir]);
+            far->off[bnode->dir] = d;
+            e.id = (d < 0.0) ? e.id + 1 : bnode->right;
+            bnode = &tree->bnodes[e.id];
+        }
+
+        n = bnode->n;
+        if (tree->compact) {
+            const float* vx = &tree->soa32[bnode->start];
+            const float* vy = &tree->soa32[tree->nnodes + bnode->start];
+            const float* vz = &tree->soa32[2 * tree->nnodes + bnode->start];
+            double cx = x - tree->min[0];
+            double cy = y - tree->min[1];
+            double cz = z - tree->min[2];
+
+            for (j = 0; j < n; ++j)
+                dists[j] = ((double) vx[j] - cx) * ((double) vx[j] - cx) + ((double) vy[j] - cy) * ((double) vy[j] - cy) + ((double) vz[j] - cz) * ((double) vz[j] - cz);
+        } else {
+            const double* vx = &tree->soa[bnode->start];
+            const double* vy = &tree->soa[tree->nnodes + bnode->start];
+            const double* vz = &tree->soa[2 * tree->nnodes + bnode->start];
+
+            for (j = 0; j < n; ++j)
+                dists[j] = (vx[j] - x) * (vx[j] - x) + (vy[j] - y) * (vy[j] - y) + (vz[j] - z) * (vz[j] - z);
+        }
+        for (j = 0; j < n; ++j) {
+            if (dists[j] < resdist) {
+                result = bnode->start + j;
+                resdist = dists[j];
+            }
+        }
+
+        do {
+            if (nstack == 0)
+                return result;
+            e = stack[--nstack];
+        } while (!(e.rd < resdist));
+    }
+}
+
+/** Searches for the nearest node in a 2D tree. Same as
+ * _kd_findnearestnode(), but with an explicit stack and unrolled distance
+ * calculations. The nodes are visited in the same order, so that the result
+ * is the same.
+ * @return Nearest node; SIZE_MAX if the tree is too deep for the stack
+ */
+static size_t findnearest2(const kdtree* tree, const double* coords)
+{
+    kdstackentry stack[NSTACK];
+    int nstack = 1;
+    double x = coords[0];
+    double y = coords[1];
+    size_t result = 0;
+    double resdist;
+
+    if (tree->bucketsize > 0)
+        return findnearestbucket2(tree, coords);
+
+    resdist = (tree->coords[0] - x) * (tree->coords[0] - x) + (tree->coords[1] - y) * (tree->coords[1] - y);
+    stack[0].id = 0;
+    stack[0].task = TASK_SEARCH;
+    stack[0].off[0] = getoffset(x, tree->min[0], tree->max[0]);
+    stack[0].off[1] = getoffset(y, tree->min[1], tree->max[1]);
+
+    while (nstack > 0) {
+        kdstackentry e = stack[--nstack];
+        const kdnode* node = &tree->nodes[e.id];
+        const double* p = &tree->coords[e.id * 2];
+        int dir = node->dir;
+        double d;
+        size_t nearer, farther;
+
+        if (e.task == TASK_CHECKNODE) {
+            double dist = (p[0] - x) * (p[0] - x) + (p[1] - y) * (p[1] - y);
+
+            if (dist <= resdist) {
+                result = e.id;
+                resdist = dist;
+            }
+            continue;
+        }
+        if (e.task == TASK_SEARCHIFNEAR && !(e.off[0] * e.off[0] + e.off[1] * e.off[1] < resdist))
+            continue;
+
+        if (nstack > NSTACK - 3)
+            return SIZE_MAX;
+        d = coords[dir] - p[dir];
+        nearer = (d <= 0.0) ? node->left : node->right;
+        farther = (d <= 0.0) ? node->right : node->left;
+        if (farther != SIZE_MAX) {
+            kdstackentry* far = &stack[nstack++];
+
+            far->id = farther;
+            far->task = TASK_SEARCHIFNEAR;
+            far->off[0] = e.off[0];
+            far->off[1] = e.off[1];
+            far->off[dir] = d;
+        }
+        stack[nstack].id = e.id;
+        stack[nstack++].task = TASK_CHECKNODE;
+        if (nearer != SIZE_MAX) {
+            e.id = nearer;
+            e.task = TASK_SEARCH;
+            stack[nstack++] = e;
+        }
+    }
+
+    return result;
+}
+
+/** Searches for the nearest node in a 3D tree. Same as
+ * _kd_findnearestnode(), but with an explicit stack and unrolled distance
+ * calculations. The nodes are visited in the same order, so that the result
+ * is the same.
+ * @return Nearest node; SIZE_MAX if the tree is too deep for the stack
+ */
+static size_t findnearest3(const kdtree* tree, const double* coords)
+{
+    kdstackentry stack[NSTACK];
+    int nstack = 1;
+    double x = coords[0];
+    double y = coords[1];
+    double z = coords[2];
+    size_t result = 0;
+    double resdist;
+
+    if (tree->bucketsize > 0)
+        return findnearestbucket3(tree, coords);
+
+    resdist = (tree->coords[0] - x) * (tree->coords[0] - x) + (tree->coords[1] - y) * (tree->coords[1] - y) + (tree->coords[2] - z) * (tree->coords[2] - z);
+    stack[0].id = 0;
+    stack[0].task = TASK_SEARCH;
+    stack[0].off[0] = getoffset(x, tree->min[0], tree->max[0]);
+    stack[0].off[1] = getoffset(y, tree->min[1], tree->max[1]);
+    stack[0].off[2] = getoffset(z, tree->min[2], tree->max[2]);
+
+    while (nstack > 0) {
+        kdstackentry e = stack[--nstack];
+        const kdnode* node = &tree->nodes[e.id];
+        const double* p = &tree->coords[e.id * 3];
+        int dir = node->dir;
+        double d;
+        size_t nearer, farther;
+
+        if (e.task == TASK_CHECKNODE) {
+            double dist = (p[0] - x) * (p[0] - x) + (p[1] - y) * (p[1] - y) + (p[2] - z) * (p[2] - z);
+
+            if (dist <= resdist) {
+                result = e.id;
+                resdist = dist;
+            }
+            continue;
+        }
+        if (e.task == TASK_SEARCHIFNEAR && !(e.off[0] * e.off[0] + e.off[1] * e.off[1] + e.off[2] * e.off[2] < resdist))
+            continue;
+
+        if (nstack > NSTACK - 3)
+            return SIZE_MAX;
+        d = coords[dir] - p[dir];
+        nearer = (d <= 0.0) ? node->left : node->right;
+        farther = (d <= 0.0) ? node->right : node->left;
+        if (farther != SIZE_MAX) {
+            kdstackentry* far = &stack[nstack++];
+
+            far->id = farther;
+            far->task = TASK_SEARCHIFNEAR;
+            far->off[0] = e.off[0];
+            far->off[1] = e.off[1];
+            far->off[2] = e.off[2];
+            far->off[dir] = d;
+        }
+        stack[nstack].id = e.id;
+        stack[nstack++].task = TASK_CHECKNODE;
+        if (nearer != SIZE_MAX) {
+            e.id = nearer;
+            e.task = TASK_SEARCH;
+            stack[nstack++] = e;
+        }
+    }
+
+    return result;
+}
+
 /**
  */
 size_t kd_findnearestnode(const kdtree* tree, const double* coords)
 {
     int ndim = tree->ndim;
-    double* minmax = malloc(ndim * 2 * sizeof(double));
+    double minmax_local[NDIMLOCAL * 2];
+    double* minmax;
     size_t result;
     double dist;
     int i;
 
+    if (tree->nnodes == 0)
+        return SIZE_MAX;
+    if (tree->findnearest != NULL) {
+        result = tree->findnearest(tree, coords);
+        if (result != SIZE_MAX)
+            return result;
+    }
+
+    minmax = (ndim <= NDIMLOCAL) ? minmax_local : malloc(ndim * 2 * sizeof(double));
+
+    if (tree->bucketsize > 0) {
+        result = SIZE_MAX;
+        dist = DBL_MAX;
+        _kd_findnearestbucket(tree, 0, coords, minmax, getoffsets(tree, coords, minmax), &result, &dist);
+        if (minmax != minmax_local)
+            free(minmax);
+        return result;
+    }
+
+    /*
+     * (the tree is not modified by the search, so that it can be conducted
+     * concurrently from several threads)
+     */
     for (i = 0; i < ndim * 2; ++i)
         minmax[i] = tree->min[i];
 
@@ -425,11 +1763,105 @@ size_t kd_findnearestnode(const kdtree* tree, const double* coords)
      */
     _kd_findnearestnode(tree, 0, coords, &result, &dist, minmax);
 
-    free(minmax);
+    if (minmax != minmax_local)
+        free(minmax);
 
     return result;
 }
 
+/**
+ */
+static void _kd_findknearest(const kdtree* tree, const size_t nodeid, knnsearch* s)
+{
+    int ndim = tree->ndim;
+    kdnode* node = &tree->nodes[nodeid];
+    double* nodecoords = &tree->coords[nodeid * ndim];
+    double* minmax = s->minmax;
+    int dir = node->dir;
+    int left = (s->coords[dir] - nodecoords[dir] <= 0.0);
+    size_t nearer_subtree = (left) ? node->left : node->right;
+    size_t farther_subtree = (left) ? node->right : node->left;
+    double* nearer_hyperrect_coord = (left) ? &minmax[ndim + dir] : &minmax[dir];
+    double* farther_hyperrect_coord = (left) ? &minmax[dir] : &minmax[ndim + dir];
+    double dist;
+    int i;
+
+    if (nearer_subtree != SIZE_MAX) {
+        double tmp = nearer_hyperrect_coord[0];
+
+        nearer_hyperrect_coord[0] = nodecoords[dir];
+        _kd_findknearest(tree, nearer_subtree, s);
+        nearer_hyperrect_coord[0] = tmp;
+    }
+
+    for (i = 0, dist = 0.0; i < ndim; ++i)
+        dist += (nodecoords[i] - s->coords[i]) * (nodecoords[i] - s->coords[i]);
+    knn_add(s, nodeid, dist);
+
+    if (farther_subtree != SIZE_MAX) {
+        double tmp = farther_hyperrect_coord[0];
+
+        farther_hyperrect_coord[0] = nodecoords[dir];
+        if (s->n < s->k || disttohyperrect(ndim, minmax, &minmax[ndim], s->coords) < s->dists[0])
+            _kd_findknearest(tree, farther_subtree, s);
+        farther_hyperrect_coord[0] = tmp;
+    }
+}
+
+/** Finds k nearest nodes. Does not allocate memory (for trees of up to 8
+ * dimensions).
+ * @param tree The tree
+ * @param coords Coordinates of the point
+ * @param k Number of nodes to find
+ * @param ids Output node ids, in order of increasing distance [k]
+ * @param dists Output distances to the nodes [k]
+ * @return Number of nodes found (smaller than k if the tree has fewer
+ *         nodes)
+ */
+size_t kd_findknearest(const kdtree* tree, const double* coords, size_t k, size_t* ids, double* dists)
+{
+    int ndim = tree->ndim;
+    double minmax_local[NDIMLOCAL * 2];
+    knnsearch s;
+    size_t i;
+
+    if (k == 0 || tree->nnodes == 0)
+        return 0;
+
+    s.coords = coords;
+    s.k = k;
+    s.n = 0;
+    s.ids = ids;
+    s.dists = dists;
+    s.minmax = (ndim <= NDIMLOCAL) ? minmax_local : malloc(ndim * 2 * sizeof(double));
+    if (tree->bucketsize > 0)
+        _kd_findknearestbucket(tree, 0, getoffsets(tree, coords, s.minmax), &s);
+    else {
+        memcpy(s.minmax, tree->min, ndim * 2 * sizeof(double));
+        _kd_findknearest(tree, 0, &s);
+    }
+    if (s.minmax != minmax_local)
+        free(s.minmax);
+
+    /*
+     * sort the heap in place by increasing distance
+     */
+    for (i = s.n - 1; i > 0; --i) {
+        size_t id = ids[0];
+        double dist = dists[0];
+
+        ids[0] = ids[i];
+        dists[0] = dists[i];
+        ids[i] = id;
+        dists[i] = dist;
+        heap_siftdown(ids, dists, i, 0);
+    }
+    for (i = 0; i < s.n; ++i)
+        dists[i] = sqrt(dists[i]);
+
+    return s.n;
+}
+
 /**
  */
 static void _clear_results(kdset* rset)
@@ -495,6 +1927,8 @@ size_t kdset_read(kdset* set, double* dist)
  */
 double* kd_getnodecoords(const kdtree* tree, size_t id)
 {
+    if (tree->compact)
+        return NULL;
     return &tree->coords[id * tree->ndim];
 }
 
@@ -502,6 +1936,8 @@ double* kd_getnodecoords(const kdtree* tree, size_t id)
  */
 size_t kd_getnodeorigid(const kdtree* tree, size_t id)
 {
+    if (tree->compact)
+        return tree->ids32[id];
 
     return (int) tree->nodes[id].id_orig;
 }
@@ -513,6 +1949,136 @@ double* kd_getminmax(const kdtree* tree)
     return tree->min;
 }
 
+/** Writes a block of data padded with zeros to a multiple of 8 bytes.
+ * @return 1 if successful, 0 otherwise
+ */
+static int writeblock(FILE* f, const void* data, size_t size)
+{
+    static const char zeros[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+
+    if (size > 0 && fwrite(data, 1, size, f) != size)
+        return 0;
+    if (PAD8(size) > size && fwrite(zeros, 1, PAD8(size) - size, f) != PAD8(size) - size)
+        return 0;
+
+    return 1;
+}
+
+/** Gets a block of data written by writeblock() and advances the position
+ * past it.
+ * @return Pointer to the block; NULL if the data is too short
+ */
+static void* attachblock(char** pos, char* end, size_t size)
+{
+    char* block = *pos;
+
+    if ((size_t) (end - *pos) < PAD8(size))
+        return NULL;
+    *pos += PAD8(size);
+
+    return block;
+}
+
+/** Writes the tree to a binary file. All blocks written have sizes that are
+ * multiples of 8 bytes, so that the tree can be used in place after the
+ * file is mapped to memory (see kd_attach()).
+ * @return 1 if successful, 0 otherwise
+ */
+int kd_write(const kdtree* tree, FILE* f)
+{
+    size_t ncoords = tree->nnodes * tree->ndim;
+    size_t sizes[NHEADER];
+
+    sizes[0] = tree->ndim;
+    sizes[1] = tree->nnodes;
+    sizes[2] = sizeof(kdnode);
+    sizes[3] = tree->bucketsize;
+    sizes[4] = tree->nbnodes;
+    sizes[5] = sizeof(kdbnode);
+    sizes[6] = tree->compact;
+    if (fwrite(sizes, sizeof(size_t), NHEADER, f) != NHEADER)
+        return 0;
+    if (!writeblock(f, tree->min, tree->ndim * 2 * sizeof(double)))
+        return 0;
+    if (!tree->compact) {
+        if (!writeblock(f, tree->nodes, tree->nnodes * sizeof(kdnode)))
+            return 0;
+        if (!writeblock(f, tree->coords, ncoords * sizeof(double)))
+            return 0;
+    }
+    if (tree->bucketsize > 0)
+        if (!writeblock(f, tree->bnodes, tree->nbnodes * sizeof(kdbnode)))
+            return 0;
+    if (tree->compact) {
+        if (!writeblock(f, tree->soa32, ncoords * sizeof(float)))
+            return 0;
+        if (!writeblock(f, tree->ids32, tree->nnodes * sizeof(uint32_t)))
+            return 0;
+    } else if (tree->bucketsize > 0)
+        if (!writeblock(f, tree->soa, ncoords * sizeof(double)))
+            return 0;
+
+    return 1;
+}
+
+/** Creates a tree from data written by kd_write() and mapped to memory. The
+ * nodes are used in place; the tree can be searched, but no nodes can be
+ * inserted.
+ * @param data Mapped data
+ * @param size Input: size of the data available; output: size of the data
+ *             used by the tree
+ * @return Tree; NULL if the data is incompatible or too short
+ */
+kdtree* kd_attach(void* data, size_t* size)
+{
+    size_t* sizes = data;
+    char* pos = (char*) &sizes[NHEADER];
+    char* end = (char*) data + *size;
+    kdtree* tree;
+    size_t ncoords;
+
+    if (*size < NHEADER * sizeof(size_t))
+        return NULL;
+    if (sizes[2] != sizeof(kdnode) || sizes[5] != sizeof(kdbnode) || sizes[0] < 1 || sizes[0] > *size || sizes[3] > NBUCKETMAX || sizes[6] > 1)
+        return NULL;
+    if (sizes[1] > *size || sizes[4] > *size || (sizes[6] && sizes[3] == 0))
+        return NULL;
+
+    tree = kd_create(sizes[0]);
+    tree->nnodes = sizes[1];
+    tree->bucketsize = sizes[3];
+    tree->nbnodes = sizes[4];
+    tree->compact = sizes[6];
+    ncoords = tree->nnodes * tree->ndim;
+    if (!attachblock(&pos, end, tree->ndim * 2 * sizeof(double)))
+        goto incompatible;
+    memcpy(tree->min, &sizes[NHEADER], tree->ndim * 2 * sizeof(double));
+    if (!tree->compact) {
+        if ((tree->nodes = attachblock(&pos, end, tree->nnodes * sizeof(kdnode))) == NULL)
+            goto incompatible;
+        if ((tree->coords = attachblock(&pos, end, ncoords * sizeof(double))) == NULL)
+            goto incompatible;
+    }
+    if (tree->bucketsize > 0)
+        if ((tree->bnodes = attachblock(&pos, end, tree->nbnodes * sizeof(kdbnode))) == NULL)
+            goto incompatible;
+    if (tree->compact) {
+        if ((tree->soa32 = attachblock(&pos, end, ncoords * sizeof(float))) == NULL)
+            goto incompatible;
+        if ((tree->ids32 = attachblock(&pos, end, tree->nnodes * sizeof(uint32_t))) == NULL)
+            goto incompatible;
+    } else if (tree->bucketsize > 0)
+        if ((tree->soa = attachblock(&pos, end, ncoords * sizeof(double))) == NULL)
+            goto incompatible;
+    *size = pos - (char*) data;
+
+    return tree;
+
+  incompatible:
+    kd_destroy(tree);
+    return NULL;
+}
+
 #if defined(STANDALONE)
 
 #include <stdarg.h>
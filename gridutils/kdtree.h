@@ -25,6 +25,9 @@ typedef struct kdnode kdnode;
 struct kdset;
 typedef struct kdset kdset;
 
+struct kdquery;
+typedef struct kdquery kdquery;
+
 /* create a kd-tree for "k"-dimensional data
  */
 kdtree* kd_create(int ndim);
@@ -41,6 +44,29 @@ void kd_insertnode(kdtree* tree, const double* coords, size_t id_orig);
  */
 void kd_insertnodes(kdtree* tree, size_t n, double** src, int randomise);
 
+/* build a balanced tree from an array of nodes (the tree must be empty)
+ */
+void kd_build_balanced(kdtree* tree, size_t n, double** src);
+
+/* build a balanced tree with buckets of up to `bucketsize' nodes in leaves
+ * (the tree must be empty)
+ */
+void kd_build_bucketed(kdtree* tree, size_t n, double** src, int bucketsize);
+
+/* build a bucketed tree with node coordinates stored in single precision
+ * and original node ids -- as 32-bit integers (the tree must be empty)
+ */
+void kd_build_compact(kdtree* tree, size_t n, double** src, int bucketsize);
+
+/* update coordinates of some nodes of a bucketed tree; return 0 if the tree
+ * needs to be built again
+ */
+int kd_updatenodes(kdtree* tree, size_t n, size_t* ids, double** src);
+
+/* get the number of dimensions
+ */
+int kd_getndim(const kdtree* tree);
+
 /* get the number of tree nodes
  */
 size_t kd_getsize(kdtree* tree);
@@ -49,11 +75,21 @@ size_t kd_getsize(kdtree* tree);
  */
 kdset* kd_findnodeswithinrange(const kdtree* tree, const double* coords, double range, int ordered);
 
+/* find any nearest nodes from the specified point within a range; store
+ * the results in a reusable query context; return the number of nodes found
+ */
+size_t kd_findnodeswithinrange2(const kdtree* tree, const double* coords, double range, int ordered, kdquery* q);
+
 /* find the nearest node
  */
 size_t kd_findnearestnode(const kdtree* tree, const double* coords);
 
-/* get position of a node
+/* find k nearest nodes (in order of increasing distance); return the number
+ * of nodes found
+ */
+size_t kd_findknearest(const kdtree* tree, const double* coords, size_t k, size_t* ids, double* dists);
+
+/* get position of a node (NULL for a compact tree)
  */
 double* kd_getnodecoords(const kdtree* tree, size_t id);
 
@@ -66,6 +102,14 @@ size_t kd_getnodeorigid(const kdtree* tree, size_t id);
  */
 double* kd_getminmax(const kdtree* tree);
 
+/* write the tree to a binary file
+ */
+int kd_write(const kdtree* tree, FILE* f);
+
+/* create a tree from data written by kd_write() and mapped to memory
+ */
+kdtree* kd_attach(void* data, size_t* size);
+
 /* read node id of the current result (SIZE_MAX if no more results are
  * available; advance the result set iterator)
  */
@@ -79,6 +123,22 @@ size_t kdset_getsize(const kdset* set);
  */
 void kdset_free(kdset* set);
 
+/* create a range query context
+ */
+kdquery* kdquery_create(void);
+
+/* get the number of nodes found by the last range query
+ */
+size_t kdquery_getsize(const kdquery* q);
+
+/* get the id of a node found by the last range query and the distance to it
+ */
+size_t kdquery_getnode(const kdquery* q, size_t i, double* dist);
+
+/* destroy a range query context
+ */
+void kdquery_destroy(kdquery* q);
+
 #define _KDTREE_H_
 #endif                          /* _KDTREE_H_ */
 
@@ -19,11 +19,38 @@
 #include <stdlib.h>
 #include <float.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
 #include "guquit.h"
 #include "poly.h"
 
 #define POLY_NSTART 4
 #define POLY_MAXLINELEN 2048
+#define POLY_NINDEXMIN 64       /* minimal number of points in a polygon for
+                                 * building the edge index */
+#define NENTRIESPEREDGE 8       /* maximal average number of bins an edge
+                                 * of an indexed polygon is stored in */
+#define EDGE_ONBOUNDARY INT_MAX
+#define NHASHPERPOINT 2         /* minimal number of vertex hash table
+                                 * entries per point */
+
+/*
+ * Index of polygon edges for point containment tests. The Y range of the
+ * polygon is divided into equal bins; each bin stores the edges that
+ * overlap it in Y, so that only these edges need to be tested for crossing
+ * a horizontal ray from a point within the bin.
+ */
+struct polyindex {
+    int nbins;                  /* number of bins */
+    double ymin;                /* minimal Y of the polygon */
+    double ymax;                /* maximal Y of the polygon */
+    double scale;               /* number of bins per unit of Y */
+    int* start;                 /* start of each bin in `edges' [nbins + 1] */
+    int* edges;                 /* edges by bin; edge i connects points i
+                                 * and (i + 1) % n */
+};
+
+static void poly_dropindex(poly* pl);
 
 /** Clears extent.
  * @param e Extent
@@ -80,6 +107,44 @@ static int point_equal(double x1, double y1, double x2, double y2, double eps)
     return ((fabs(x1 - x2) <= eps) && (fabs(y1 - y2) <= eps));
 }
 
+/** Gets the bin of an edge index containing a given Y coordinate.
+ * @param pi Edge index
+ * @param y Y coordinate
+ * @return Bin
+ */
+static int polyindex_getbin(polyindex* pi, double y)
+{
+    int b = (int) ((y - pi->ymin) * pi->scale);
+
+    if (b < 0)
+        return 0;
+    if (b >= pi->nbins)
+        return pi->nbins - 1;
+    return b;
+}
+
+/** Calculates the hash of a point for the vertex hash table.
+ * @param x X coordinate
+ * @param y Y coordinate
+ * @return Hash
+ */
+static uint64_t point_hash(double x, double y)
+{
+    uint64_t hx, hy;
+
+    /*
+     * -0.0 and 0.0 compare equal, so they must have equal hashes
+     */
+    if (x == 0.0)
+        x = 0.0;
+    if (y == 0.0)
+        y = 0.0;
+    memcpy(&hx, &x, sizeof(uint64_t));
+    memcpy(&hy, &y, sizeof(uint64_t));
+
+    return ((hx * 0x9E3779B97F4A7C15ULL) ^ hy) * 0xC2B2AE3D27D4EB4FULL;
+}
+
 /** Re-calculates extent of a polyline.
  * @param pl Polyline
  * @param x X coordinate
@@ -105,6 +170,8 @@ static void poly_recalcextent(poly* pl)
  */
 void poly_addpoint(poly* pl, double x, double y)
 {
+    poly_dropindex(pl);
+
     if (isnan(x) || isnan(y))
         gu_quit("poly_addpoint(): NaN detected");
 
@@ -129,6 +196,8 @@ void poly_addpoint(poly* pl, double x, double y)
  */
 void poly_addpointat(poly* pl, int index, double x, double y)
 {
+    poly_dropindex(pl);
+
     if (index > pl->n - 1) {
         poly_addpoint(pl, x, y);
         return;
@@ -157,6 +226,8 @@ void poly_append(poly* pl1, poly* pl2)
     int n = pl1->n + pl2->n;
     int sizechanged = 0;
 
+    poly_dropindex(pl1);
+
     while (n < pl1->nallocated) {
         pl1->nallocated *= 2;
         sizechanged = 1;
@@ -199,6 +270,8 @@ double poly_area(poly* pl)
  */
 void poly_clear(poly* pl)
 {
+    poly_dropindex(pl);
+
     pl->n = 0;
     extent_clear(&pl->e);
 }
@@ -217,6 +290,9 @@ poly* poly_copy(poly* pl)
     pl1->e.xmax = pl->e.xmax;
     pl1->e.ymin = pl->e.ymin;
     pl1->e.ymax = pl->e.ymax;
+    pl1->index = NULL;
+    pl1->nhash = 0;
+    pl1->hash = NULL;
 
     pl1->x = malloc(pl1->nallocated * sizeof(double));
     pl1->y = malloc(pl1->nallocated * sizeof(double));
@@ -239,6 +315,12 @@ void poly_close(poly* pl)
 /** Tests whether a point is inside a polygon.
  * The polyline is assumed to be closed: an extra line segment from the end 
  * point back to the start point is assumed if necessary.
+ *
+ * If the edge index of the polygon has been built (see poly_buildindex()),
+ * the test takes O(1 + k) operations, where k is the number of edges
+ * overlapping the point in Y; otherwise it takes O(n) operations. The
+ * polygon is not modified, so that concurrent tests are safe.
+ *
  * @param pl Polyline
  * @param x X coordinate
  * @param y Y coordinate
@@ -246,49 +328,194 @@ void poly_close(poly* pl)
  */
 int poly_containspoint(poly* pl, double x, double y)
 {
-    double* xs = pl->x;
-    double* ys = pl->y;
-    int n = pl->n;
+    if (pl->n <= 1)
+        return 0;
+    if (!extent_containspoint(&pl->e, x, y))
+        return 0;
+
+    if (pl->index != NULL)
+        return polyindex_containspoint(pl->index, pl->n, pl->x, pl->y, x, y);
+
+    return poly_containspoint2(pl->n, pl->x, pl->y, x, y);
+}
+
+/** Calculates the contribution of a polygon edge to the number of crossings
+ * of the horizontal ray from a point in positive X direction.
+ * @param x1 X coordinate of the edge start relative to the point
+ * @param y1 Y coordinate of the edge start relative to the point
+ * @param x2 X coordinate of the edge end relative to the point
+ * @param y2 Y coordinate of the edge end relative to the point
+ * @return Doubled number of crossings (signed for edges touching the ray at
+ *         a vertex); EDGE_ONBOUNDARY if the point is on the edge
+ */
+static int edge_hits(double x1, double y1, double x2, double y2)
+{
+    if (y1 == 0.0 && y2 == 0.0) {
+        if (x1 * x2 <= 0)
+            return EDGE_ONBOUNDARY;
+    } else if (y1 == 0.0) {
+        if (x1 == 0.0)
+            return EDGE_ONBOUNDARY;
+        if (x1 > 0.0)
+            return (y2 > 0.0) ? 1 : -1;
+    } else if (y2 == 0.0) {
+        if (x2 == 0.0)
+            return EDGE_ONBOUNDARY;
+        if (x2 > 0.0)
+            return (y1 < 0.0) ? 1 : -1;
+    } else if (y1 * y2 < 0.0) {
+        if (x1 > 0.0 && x2 > 0.0)
+            return 2;
+        else if (x1 * x2 <= 0.0) {
+            double xx = x1 - (x2 - x1) * y1 / (y2 - y1);
+
+            if (xx == 0)
+                return EDGE_ONBOUNDARY;
+            if (xx > 0.0)
+                return 2;
+        }
+    }
+
+    return 0;
+}
+
+/** Tests whether a point is inside a polygon specified by arrays of vertex
+ * coordinates. Same as poly_containspoint(), but does not require a poly
+ * structure and does not check the bounding rectangle; e.g., can be used for
+ * testing grid cells without allocating memory.
+ * @param n Number of vertices
+ * @param xs X coordinates of vertices [n]
+ * @param ys Y coordinates of vertices [n]
+ * @param x X coordinate
+ * @param y Y coordinate
+ * @return 1 for yes, 0 for no
+ */
+int poly_containspoint2(int n, double* xs, double* ys, double x, double y)
+{
     int hits;
-    int i;
+    int i, i0;
 
     if (n <= 1)
         return 0;
-    if (!extent_containspoint(&pl->e, x, y))
-        return 0;
 
-    for (i = 0, hits = 0; i < n; ++i) {
-        int i1 = (i + 1) % n;
-        double x1 = xs[i] - x;
-        double y1 = ys[i] - y;
-        double x2 = xs[i1] - x;
-        double y2 = ys[i1] - y;
-
-        if (y1 == 0.0 && y2 == 0.0) {
-            if (x1 * x2 <= 0)
-                return 1;
-        } else if (y1 == 0.0) {
-            if (x1 == 0.0)
-                return 1;
-            if (x1 > 0.0)
-                hits += (y2 > 0.0) ? 1 : -1;
-        } else if (y2 == 0.0) {
-            if (x2 == 0.0)
-                return 1;
-            if (x2 > 0.0)
-                hits += (y1 < 0.0) ? 1 : -1;
-        } else if (y1 * y2 < 0.0) {
-            if (x1 > 0.0 && x2 > 0.0)
-                hits += 2;
-            else if (x1 * x2 <= 0.0) {
-                double xx = x1 - (x2 - x1) * y1 / (y2 - y1);
-
-                if (xx == 0)
-                    return 1;
-                if (xx > 0.0)
-                    hits += 2;
-            }
+    /*
+     * edge i0 connects points i0 and i
+     */
+    for (i = 0, i0 = n - 1, hits = 0; i < n; i0 = i++) {
+        int h = edge_hits(xs[i0] - x, ys[i0] - y, xs[i] - x, ys[i] - y);
+
+        if (h == EDGE_ONBOUNDARY)
+            return 1;
+        hits += h;
+    }
+
+    if ((hits / 2) % 2)
+        return 1;
+
+    return 0;
+}
+
+/** Creates an edge index of a polygon specified by the Y coordinates of its
+ * vertices (the edges are binned by Y only). The number of bins is about
+ * the number of edges; it is reduced if the edges overlap too many bins on
+ * average (e.g. for a polygon with a few long edges).
+ * @param n Number of vertices
+ * @param ys Y coordinates of vertices [n]
+ * @return Edge index
+ */
+polyindex* polyindex_create(int n, double* ys)
+{
+    polyindex* pi = malloc(sizeof(polyindex));
+    size_t nentries;
+    int i, i1, b;
+
+    pi->ymin = DBL_MAX;
+    pi->ymax = -DBL_MAX;
+    for (i = 0; i < n; ++i) {
+        if (ys[i] < pi->ymin)
+            pi->ymin = ys[i];
+        if (ys[i] > pi->ymax)
+            pi->ymax = ys[i];
+    }
+
+    pi->nbins = (n > 0) ? n : 1;
+    pi->start = NULL;
+    do {
+        pi->scale = (pi->ymax > pi->ymin) ? (double) pi->nbins / (pi->ymax - pi->ymin) : 0.0;
+        pi->start = realloc(pi->start, (pi->nbins + 1) * sizeof(int));
+        memset(pi->start, 0, (pi->nbins + 1) * sizeof(int));
+        nentries = 0;
+        for (i = 0; i < n; ++i) {
+            int b1, b2;
+
+            i1 = (i + 1 < n) ? i + 1 : 0;
+            b1 = polyindex_getbin(pi, (ys[i] < ys[i1]) ? ys[i] : ys[i1]);
+            b2 = polyindex_getbin(pi, (ys[i] < ys[i1]) ? ys[i1] : ys[i]);
+            for (b = b1; b <= b2; ++b)
+                pi->start[b + 1]++;
+            nentries += b2 - b1 + 1;
         }
+        if (nentries <= (size_t) NENTRIESPEREDGE * n || pi->nbins == 1)
+            break;
+        pi->nbins /= 2;
+    } while (1);
+
+    for (b = 0; b < pi->nbins; ++b)
+        pi->start[b + 1] += pi->start[b];
+    pi->edges = malloc(nentries * sizeof(int));
+    for (i = 0; i < n; ++i) {
+        int b1, b2;
+
+        i1 = (i + 1 < n) ? i + 1 : 0;
+        b1 = polyindex_getbin(pi, (ys[i] < ys[i1]) ? ys[i] : ys[i1]);
+        b2 = polyindex_getbin(pi, (ys[i] < ys[i1]) ? ys[i1] : ys[i]);
+        for (b = b1; b <= b2; ++b)
+            pi->edges[pi->start[b]++] = i;
+    }
+    for (b = pi->nbins; b > 0; --b)
+        pi->start[b] = pi->start[b - 1];
+    pi->start[0] = 0;
+
+    return pi;
+}
+
+/** Destroys an edge index.
+ * @param pi Edge index
+ */
+void polyindex_destroy(polyindex* pi)
+{
+    free(pi->start);
+    free(pi->edges);
+    free(pi);
+}
+
+/** Tests whether a point is inside a polygon using its edge index. Gives
+ * the same result as poly_containspoint2().
+ * @param pi Edge index of the polygon (see polyindex_create())
+ * @param n Number of vertices
+ * @param xs X coordinates of vertices [n]
+ * @param ys Y coordinates of vertices [n]
+ * @param x X coordinate
+ * @param y Y coordinate
+ * @return 1 for yes, 0 for no
+ */
+int polyindex_containspoint(polyindex* pi, int n, double* xs, double* ys, double x, double y)
+{
+    int hits = 0;
+    int b, k;
+
+    if (n <= 1 || !(y >= pi->ymin && y <= pi->ymax))
+        return 0;
+
+    b = polyindex_getbin(pi, y);
+    for (k = pi->start[b]; k < pi->start[b + 1]; ++k) {
+        int i = pi->edges[k];
+        int i1 = (i + 1 < n) ? i + 1 : 0;
+        int h = edge_hits(xs[i] - x, ys[i] - y, xs[i1] - x, ys[i1] - y);
+
+        if (h == EDGE_ONBOUNDARY)
+            return 1;
+        hits += h;
     }
 
     if ((hits / 2) % 2)
@@ -297,6 +524,161 @@ int poly_containspoint(poly* pl, double x, double y)
     return 0;
 }
 
+/** Builds the edge index of a polygon used by poly_containspoint() and
+ * poly_containspoints(). It pays off for large polygons tested against many
+ * points. As it modifies the polygon, it must not be called concurrently
+ * with the tests. The index is discarded when the polygon is modified.
+ * @param pl Polyline
+ */
+void poly_buildindex(poly* pl)
+{
+    if (pl->index == NULL)
+        pl->index = polyindex_create(pl->n, pl->y);
+}
+
+/** Tests points against a set of polygon edges. The points are expected
+ * to lie in a common bin of the polygon's edge index, so that the edges
+ * stay in cache while the points are processed.
+ * @param n Number of polygon vertices
+ * @param xs X coordinates of vertices [n]
+ * @param ys Y coordinates of vertices [n]
+ * @param nedges Number of edges
+ * @param edges Edges (edge i connects points i and (i + 1) % n); NULL for
+ *              all edges of the polygon
+ * @param m Number of points
+ * @param px X coordinates of the points [m]
+ * @param py Y coordinates of the points [m]
+ * @param out Output: 1 if the point is inside the polygon, 0 otherwise [m]
+ */
+static void edges_containpoints(int n, double* xs, double* ys, int nedges, int* edges, int m, double* px, double* py, int* out)
+{
+    int p, k;
+
+    for (p = 0; p < m; ++p) {
+        double x = px[p];
+        double y = py[p];
+        int hits = 0;
+
+        out[p] = -1;
+        for (k = 0; k < nedges; ++k) {
+            int i = (edges == NULL) ? k : edges[k];
+            int i1 = (i + 1 < n) ? i + 1 : 0;
+            int h = edge_hits(xs[i] - x, ys[i] - y, xs[i1] - x, ys[i1] - y);
+
+            if (h == EDGE_ONBOUNDARY) {
+                out[p] = 1;
+                break;
+            }
+            hits += h;
+        }
+        if (out[p] < 0)
+            out[p] = (hits / 2) % 2;
+    }
+}
+
+/** Tests whether points are inside a polygon. Gives the same results as
+ * poly_containspoint() for each point. For a polygon with POLY_NINDEXMIN
+ * points or more, the points are sorted by the bins of the edge index, so
+ * that the points of each bin are tested together against the (cached)
+ * edges of this bin. The index built by poly_buildindex() is used if there
+ * is one; otherwise a temporary index is built. The polygon is not
+ * modified, so that concurrent tests are safe.
+ *
+ * @param pl Polyline
+ * @param n Number of points
+ * @param x X coordinates of the points [n]
+ * @param y Y coordinates of the points [n]
+ * @param out Output: 1 if the point is inside the polygon, 0 otherwise [n]
+ */
+void poly_containspoints(poly* pl, int n, double* x, double* y, int* out)
+{
+    polyindex* pi = NULL;
+    polyindex* pitmp = NULL;
+    int* ids = malloc(n * sizeof(int));
+    double* px = malloc(n * sizeof(double));
+    double* py = malloc(n * sizeof(double));
+    int* res = malloc(n * sizeof(int));
+    int* count = NULL;
+    int nbins = 1;
+    int m, i, b;
+
+    for (i = 0, m = 0; i < n; ++i) {
+        out[i] = 0;
+        if (pl->n > 1 && extent_containspoint(&pl->e, x[i], y[i]))
+            ids[m++] = i;
+    }
+
+    if (pl->index != NULL)
+        pi = pl->index;
+    else if (pl->n >= POLY_NINDEXMIN)
+        pi = pitmp = polyindex_create(pl->n, pl->y);
+    if (pi != NULL)
+        nbins = pi->nbins;
+
+    /*
+     * group the points by bins
+     */
+    count = calloc(nbins + 1, sizeof(int));
+    if (pi != NULL) {
+        for (i = 0; i < m; ++i)
+            count[polyindex_getbin(pi, y[ids[i]]) + 1]++;
+        for (b = 0; b < nbins; ++b)
+            count[b + 1] += count[b];
+        for (i = 0; i < m; ++i) {
+            int k = count[polyindex_getbin(pi, y[ids[i]])]++;
+
+            px[k] = x[ids[i]];
+            py[k] = y[ids[i]];
+            res[k] = ids[i];
+        }
+        for (b = nbins; b > 0; --b)
+            count[b] = count[b - 1];
+        count[0] = 0;
+    } else {
+        for (i = 0; i < m; ++i) {
+            px[i] = x[ids[i]];
+            py[i] = y[ids[i]];
+            res[i] = ids[i];
+        }
+        count[1] = m;
+    }
+    memcpy(ids, res, m * sizeof(int));
+
+    for (b = 0; b < nbins; ++b) {
+        int nedges = (pi != NULL) ? pi->start[b + 1] - pi->start[b] : pl->n;
+        int* edges = (pi != NULL) ? &pi->edges[pi->start[b]] : NULL;
+
+        edges_containpoints(pl->n, pl->x, pl->y, nedges, edges, count[b + 1] - count[b], &px[count[b]], &py[count[b]], &res[count[b]]);
+    }
+    for (i = 0; i < m; ++i)
+        out[ids[i]] = res[i];
+
+    if (pitmp != NULL)
+        polyindex_destroy(pitmp);
+    free(count);
+    free(res);
+    free(py);
+    free(px);
+    free(ids);
+}
+
+/** Discards the edge index and the vertex hash of a polygon after it has
+ * been modified.
+ * @param pl Polyline
+ */
+static void poly_dropindex(poly* pl)
+{
+    if (pl->index != NULL) {
+        polyindex_destroy(pl->index);
+        pl->index = NULL;
+    }
+    if (pl->hash != NULL) {
+        free(pl->hash);
+        pl->hash = NULL;
+        pl->nhash = 0;
+    }
+}
+
 /** Constructor.
  * @return Polyline
  */
@@ -308,6 +690,9 @@ poly* poly_create()
     pl->n = 0;
     pl->nallocated = POLY_NSTART;
     extent_clear(&pl->e);
+    pl->index = NULL;
+    pl->nhash = 0;
+    pl->hash = NULL;
 
     return pl;
 }
@@ -322,6 +707,8 @@ void poly_deletepoint(poly* pl, int index)
     double yy = pl->y[index];
     extent* e = &pl->e;
 
+    poly_dropindex(pl);
+
     memmove(&pl->x[index], &pl->x[index + 1], (pl->n - index - 1) * sizeof(double));
     memmove(&pl->y[index], &pl->y[index + 1], (pl->n - index - 1) * sizeof(double));
     pl->n--;
@@ -342,15 +729,56 @@ void poly_deletepoint(poly* pl, int index)
  */
 void poly_destroy(poly* pl)
 {
+    poly_dropindex(pl);
     free(pl->x);
     free(pl->y);
     free(pl);
 }
 
-/** Finds index of a point within polyline.
+/** Builds the vertex hash of a polyline, so that poly_findindex() takes
+ * O(1) operations rather than O(n). The hash is discarded when the polyline
+ * is modified.
  * @param pl Polyline
+ */
+void poly_buildhash(poly* pl)
+{
+    int nhash = 1;
+    int mask;
+    int i;
+
+    if (pl->hash != NULL)
+        return;
+
+    while (nhash < pl->n * NHASHPERPOINT)
+        nhash *= 2;
+    mask = nhash - 1;
+    pl->hash = malloc(nhash * sizeof(int));
+    for (i = 0; i < nhash; ++i)
+        pl->hash[i] = -1;
+    pl->nhash = nhash;
+
+    /*
+     * only the first occurence of a point is stored, as it is the one
+     * found by the linear search
+     */
+    for (i = 0; i < pl->n; ++i) {
+        double x = pl->x[i];
+        double y = pl->y[i];
+        int h = (int) ((point_hash(x, y) >> 32) & mask);
+
+        while (pl->hash[h] >= 0 && (pl->x[pl->hash[h]] != x || pl->y[pl->hash[h]] != y))
+            h = (h + 1) & mask;
+        if (pl->hash[h] < 0)
+            pl->hash[h] = i;
+    }
+}
+
+/** Finds index of a point within polyline. Uses the vertex hash if it has
+ * been built (see poly_buildhash()).
+ * @param pl Polyline
+ * @param x X coordinate
  * @param y Y coordinate
- * @return Index if found; -1 otherwise
+ * @return Index of the first occurence if found; -1 otherwise
  */
 int poly_findindex(poly* pl, double x, double y)
 {
@@ -359,6 +787,17 @@ int poly_findindex(poly* pl, double x, double y)
     int n = pl->n;
     int i;
 
+    if (pl->hash != NULL) {
+        int mask = pl->nhash - 1;
+        int h = (int) ((point_hash(x, y) >> 32) & mask);
+
+        for (i = pl->hash[h]; i >= 0; h = (h + 1) & mask, i = pl->hash[h])
+            if (x == xs[i] && y == ys[i])
+                return i;
+
+        return -1;
+    }
+
     for (i = 0; i < n; ++i) {
         if (x == xs[i] && y == ys[i])
             return i;
@@ -562,6 +1001,8 @@ void poly_resample(poly* pl, double eps)
     int n = pl->n;
     int i, nn;
 
+    poly_dropindex(pl);
+
     if (pl->n <= 1)
         return;
 
@@ -590,6 +1031,8 @@ void poly_reverse(poly* pl)
     int n2 = n / 2;
     int i, j;
 
+    poly_dropindex(pl);
+
     if (pl->n <= 1)
         return;
 
@@ -615,6 +1058,8 @@ void poly_despike(poly* pl, double maxdist)
     int n = pl->n;
     int i, nn;
 
+    poly_dropindex(pl);
+
     if (pl->n <= 1)
         return;
 
@@ -667,6 +1112,8 @@ void poly_compact(poly* pl, double eps)
     int ileft, imiddle, iright;
     int i;
 
+    poly_dropindex(pl);
+
     if (n <= 4)
         return;                 /* do not bother */
 
@@ -18,12 +18,22 @@ typedef struct {
     double ymax;
 } extent;
 
+struct polyindex;
+typedef struct polyindex polyindex;
+
 typedef struct {
     int n;                      /* number of points */
     int nallocated;             /* number of allocated points */
     extent e;                   /* bounding rectangle */
     double* x;                  /* array of x coordinates [n] */
     double* y;                  /* array of y coordinates [n] */
+    polyindex* index;           /* edge index for containment tests (or
+                                 * NULL); is built by poly_buildindex() */
+    int nhash;                  /* size of the vertex hash table (0 if
+                                 * there is no hash) */
+    int* hash;                  /* vertex hash table for poly_findindex()
+                                 * (or NULL); is built by
+                                 * poly_buildhash() */
 } poly;
 
 poly* poly_create();
@@ -36,6 +46,8 @@ double poly_area(poly* pl);
 void poly_clear(poly* pl);
 void poly_close(poly* pl);
 int poly_containspoint(poly* pl, double x, double y);
+int poly_containspoint2(int n, double* xs, double* ys, double x, double y);
+void poly_containspoints(poly* pl, int n, double* x, double* y, int* out);
 poly* poly_copy(poly* pl);
 void poly_deletepoint(poly* pl, int index);
 void poly_despike(poly* pl, double maxdist);
@@ -48,3 +60,9 @@ void poly_resample(poly* pl, double eps);
 void poly_reverse(poly* pl);
 void poly_write(poly* pl, FILE* fp);
 void poly_compact(poly* pl, double eps);
+void poly_buildindex(poly* pl);
+void poly_buildhash(poly* pl);
+
+polyindex* polyindex_create(int n, double* ys);
+void polyindex_destroy(polyindex* pi);
+int polyindex_containspoint(polyindex* pi, int n, double* xs, double* ys, double x, double y);
@@ -92,27 +92,128 @@ echo -n '-> '
 echo "20.5 10.5" | ../xy2ij -g gridpoints_DD.txt -o stdin -r -k | ../xy2ij -g gridpoints_DD.txt -o stdin
 echo
 
+echo "8. As p.6, using mapping via spatial hash:"
+echo "   point 1:"
+echo -n '     513252.3881 5186890.274 -> '
+echo "513252.3881 5186890.274" | ../xy2ij -g gridpoints_DD.txt -o stdin -m hash
+echo "     and back:"
+echo -n "     (index) "
+echo "513252.3881 5186890.274" | ../xy2ij -g gridpoints_DD.txt -o stdin -m hash |tr -d "\n"
+echo -n '-> '
+echo "513252.3881 5186890.274" | ../xy2ij -g gridpoints_DD.txt -o stdin -m hash | ../xy2ij -g gridpoints_DD.txt -o stdin -r
+echo "   point 2:"
+echo -n '     (index) 20.5 10.5 -> '
+echo "20.5 10.5" | ../xy2ij -g gridpoints_DD.txt -o stdin -r -m hash
+echo "     and back:"
+echo -n "     "`echo "20.5 10.5" | ../xy2ij -g gridpoints_DD.txt -o stdin -r -m hash |tr -d "\n"`
+echo -n '-> '
+echo "20.5 10.5" | ../xy2ij -g gridpoints_DD.txt -o stdin -r -m hash | ../xy2ij -g gridpoints_DD.txt -o stdin -m hash
+echo
+
+echo "9. As p.6, using mapping via precomputed raster:"
+echo "   point 1:"
+echo -n '     513252.3881 5186890.274 -> '
+echo "513252.3881 5186890.274" | ../xy2ij -g gridpoints_DD.txt -o stdin -m raster
+echo "     and back:"
+echo -n "     (index) "
+echo "513252.3881 5186890.274" | ../xy2ij -g gridpoints_DD.txt -o stdin -m raster |tr -d "\n"
+echo -n '-> '
+echo "513252.3881 5186890.274" | ../xy2ij -g gridpoints_DD.txt -o stdin -m raster | ../xy2ij -g gridpoints_DD.txt -o stdin -r
+echo "   point 2:"
+echo -n '     (index) 20.5 10.5 -> '
+echo "20.5 10.5" | ../xy2ij -g gridpoints_DD.txt -o stdin -r -m raster
+echo "     and back:"
+echo -n "     "`echo "20.5 10.5" | ../xy2ij -g gridpoints_DD.txt -o stdin -r -m raster |tr -d "\n"`
+echo -n '-> '
+echo "20.5 10.5" | ../xy2ij -g gridpoints_DD.txt -o stdin -r -m raster | ../xy2ij -g gridpoints_DD.txt -o stdin -m raster
+echo
+
+echo "10. As p.6, using grid map saved to an index file:"
+rm -f gridmap.idx
+echo "   point 1:"
+echo -n '     513252.3881 5186890.274 -> '
+echo "513252.3881 5186890.274" | ../xy2ij -g gridpoints_DD.txt -o stdin -M gridmap.idx
+echo "     and back:"
+echo -n "     (index) "
+echo "513252.3881 5186890.274" | ../xy2ij -g gridpoints_DD.txt -o stdin -M gridmap.idx |tr -d "\n"
+echo -n '-> '
+echo "513252.3881 5186890.274" | ../xy2ij -g gridpoints_DD.txt -o stdin -M gridmap.idx | ../xy2ij -g gridpoints_DD.txt -o stdin -r -M gridmap.idx
+echo "   point 2:"
+echo -n '     (index) 20.5 10.5 -> '
+echo "20.5 10.5" | ../xy2ij -g gridpoints_DD.txt -o stdin -r -M gridmap.idx
+echo "     and back:"
+echo -n "     "`echo "20.5 10.5" | ../xy2ij -g gridpoints_DD.txt -o stdin -r -M gridmap.idx |tr -d "\n"`
+echo -n '-> '
+echo "20.5 10.5" | ../xy2ij -g gridpoints_DD.txt -o stdin -r -M gridmap.idx | ../xy2ij -g gridpoints_DD.txt -o stdin -M gridmap.idx
+echo "   point 1, verifying the index file:"
+echo -n '     513252.3881 5186890.274 -> '
+echo "513252.3881 5186890.274" | GRIDMAP_VERIFY=1 ../xy2ij -g gridpoints_DD.txt -o stdin -M gridmap.idx
+echo
+
+echo -n "11. Converting cell centres to index space in Hilbert and Morton curve order..."
+../xy2ij -g gridpoints_DD.txt -o gridpoints_CE.txt -f > ij.txt
+../xy2ij -g gridpoints_DD.txt -o gridpoints_CE.txt -f -s hilbert > ij-s.txt
+../xy2ij -g gridpoints_DD.txt -o gridpoints_CE.txt -f -s morton > ij-m.txt
+if cmp -s ij.txt ij-s.txt && cmp -s ij.txt ij-m.txt
+then
+    echo "done"
+    echo "     (gridpoints_CE.txt -> ij-s.txt, ij-m.txt, same as without ordering)"
+else
+    echo "FAILED: results differ"
+fi
+echo
+
+echo -n "12. Updating grid maps after invalidating and restoring grid nodes..."
+if ./testupdate gridpoints_CO.txt 36 39 96 99 && ./testupdate gridpoints_CO.txt 72 75 16 19
+then
+    echo "done"
+    echo "     (same as built from scratch)"
+else
+    echo "FAILED: results differ"
+fi
+echo
+
+echo -n "13. Testing points against the boundary polygon in batch and with edge index..."
+if ./testpoly bound.txt
+then
+    echo "done"
+    echo "     (same as tested one by one)"
+else
+    echo "FAILED: results differ"
+fi
+echo
+
+echo -n "14. Searching kd-trees for grid nodes within range and for k nearest nodes..."
+if ./testkd gridpoints_CO.txt
+then
+    echo "done"
+    echo "     (same as found by brute force)"
+else
+    echo "FAILED: results differ"
+fi
+echo
+
 if [ -x ../gridbathy ]
 then
-    echo -n "8. Interpolating bathymetry with bivariate cubic spline..."
+    echo -n "15. Interpolating bathymetry with bivariate cubic spline..."
     ../gridbathy -b bathy.txt -g gridpoints_DD.txt > bathy-cs.txt
     echo "done"
     echo "     (bathy.txt -> bathy-cs.txt)"
     echo
 
-    echo -n "9. Interpolating bathymetry with linear interpolation..."
+    echo -n "16. Interpolating bathymetry with linear interpolation..."
     ../gridbathy -b bathy.txt -g gridpoints_DD.txt -a 3 > bathy-l.txt
     echo "done"
     echo "     (bathy.txt -> bathy-l.txt)"
     echo
 
-    echo -n "10. Interpolating bathymetry with Natural Neighbours interpolation..."
+    echo -n "17. Interpolating bathymetry with Natural Neighbours interpolation..."
     ../gridbathy -b bathy.txt -g gridpoints_DD.txt -a 2 > bathy-nn.txt
     echo "done"
     echo "     (bathy.txt -> bathy-nn.txt)"
     echo
 
-    echo -n "11. Interpolating bathymetry with Non-Sibsonian NN interpolation..."
+    echo -n "18. Interpolating bathymetry with Non-Sibsonian NN interpolation..."
     ../gridbathy -b bathy.txt -g gridpoints_DD.txt -a 1 > bathy-ns.txt
     echo "done"
     echo "     (bathy.txt -> bathy-ns.txt)"
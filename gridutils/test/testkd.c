@@ -0,0 +1,314 @@
+/******************************************************************************
+ *
+ *  File:           testkd.c
+ *
+ *  Created         16/10/2026
+ *
+ *  Purpose:        Tests range and k nearest node queries of kd-trees
+ *                  built in different ways against brute force search, for
+ *                  the nodes of a grid
+ *
+ *  Revisions:      none.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "gridnodes.h"
+#include "kdtree.h"
+
+#define NDIM 2
+#define BUCKETSIZE 16
+#define QSTEP 7                 /* use every QSTEP-th node for queries */
+#define EPS_COMPACT 1.0e-6      /* tolerance for the compact tree, relative
+                                 * to the grid extent */
+
+#define TREE_INSERTED 0
+#define TREE_BALANCED 1
+#define TREE_BUCKETED 2
+#define TREE_COMPACT 3
+#define NTREETYPES 4
+
+#define KMAX 40                 /* maximal number of nearest nodes */
+
+static char* treenames[] = { "inserted", "balanced", "bucketed", "compact" };
+
+static double ranges[] = { 0.005, 0.02, 0.1 };  /* relative to the grid
+                                                 * extent */
+static size_t ks[] = { 1, 2, 5, 16, KMAX };
+
+/** Builds a tree of the specified type.
+ * @param type Tree type
+ * @param n Number of nodes
+ * @param src Node coordinates [NDIM][n]
+ * @return The tree
+ */
+static kdtree* buildtree(int type, size_t n, double** src)
+{
+    kdtree* tree = kd_create(NDIM);
+
+    switch (type) {
+    case TREE_INSERTED:
+        kd_insertnodes(tree, n, src, 1);
+        break;
+    case TREE_BALANCED:
+        kd_build_balanced(tree, n, src);
+        break;
+    case TREE_BUCKETED:
+        kd_build_bucketed(tree, n, src, BUCKETSIZE);
+        break;
+    case TREE_COMPACT:
+        kd_build_compact(tree, n, src, BUCKETSIZE);
+        break;
+    default:
+        break;
+    }
+
+    return tree;
+}
+
+/** Calculates distance from a point to a node.
+ * @param src Node coordinates [NDIM][n]
+ * @param id Node id
+ * @param p Point coordinates [NDIM]
+ * @return Distance
+ */
+static double distance(double** src, size_t id, double* p)
+{
+    double dist = 0.0;
+    int i;
+
+    for (i = 0; i < NDIM; ++i)
+        dist += (src[i][id] - p[i]) * (src[i][id] - p[i]);
+
+    return sqrt(dist);
+}
+
+/** Checks the nodes found by a range query against brute force search.
+ * @param tree The tree
+ * @param q The query context with results of the query
+ * @param ordered Flag: the results were requested ordered
+ * @param n Number of nodes
+ * @param src Node coordinates [NDIM][n]
+ * @param p Point coordinates [NDIM]
+ * @param range Search radius
+ * @param eps Tolerance for distances
+ * @param found Work array [n]
+ * @return 1 if the results are correct, 0 otherwise
+ */
+static int checkrange(kdtree* tree, kdquery* q, int ordered, size_t n, double** src, double* p, double range, double eps, int* found)
+{
+    size_t nfound = kdquery_getsize(q);
+    double distprev = 0.0;
+    size_t i;
+
+    memset(found, 0, n * sizeof(int));
+    for (i = 0; i < nfound; ++i) {
+        double dist, dist0;
+        size_t id = kd_getnodeorigid(tree, kdquery_getnode(q, i, &dist));
+
+        if (id >= n || found[id])
+            return 0;
+        found[id] = 1;
+        dist0 = distance(src, id, p);
+        if (dist0 > range + eps || fabs(dist - dist0) > eps)
+            return 0;
+        if (ordered && dist < distprev)
+            return 0;
+        distprev = dist;
+    }
+    for (i = 0; i < n; ++i)
+        if (!found[i] && distance(src, i, p) <= range - eps)
+            return 0;
+
+    return 1;
+}
+
+/** Finds distances to the k nearest nodes by brute force search.
+ * @param n Number of nodes
+ * @param src Node coordinates [NDIM][n]
+ * @param p Point coordinates [NDIM]
+ * @param k Number of nodes to find (k <= n)
+ * @param dists Output distances, in increasing order [k]
+ */
+static void findknearest(size_t n, double** src, double* p, size_t k, double* dists)
+{
+    size_t nfound = 0;
+    size_t i, j;
+
+    for (i = 0; i < n; ++i) {
+        double dist = distance(src, i, p);
+
+        if (nfound == k && dist >= dists[k - 1])
+            continue;
+        if (nfound < k)
+            nfound++;
+        for (j = nfound - 1; j > 0 && dists[j - 1] > dist; --j)
+            dists[j] = dists[j - 1];
+        dists[j] = dist;
+    }
+}
+
+/** Checks the nodes found by a k nearest node query against brute force
+ * search.
+ * @param tree The tree
+ * @param nfound Number of nodes found
+ * @param ids Ids of the nodes found [nfound]
+ * @param dists Distances to the nodes found [nfound]
+ * @param n Number of nodes
+ * @param src Node coordinates [NDIM][n]
+ * @param p Point coordinates [NDIM]
+ * @param k Number of nodes requested
+ * @param dists0 Distances to the k nearest nodes found by brute force [k]
+ * @param eps Tolerance for distances
+ * @param found Work array [n]
+ * @return 1 if the results are correct, 0 otherwise
+ */
+static int checkknearest(kdtree* tree, size_t nfound, size_t* ids, double* dists, size_t n, double** src, double* p, size_t k, double* dists0, double eps, int* found)
+{
+    size_t i;
+
+    if (nfound != k)
+        return 0;
+    memset(found, 0, n * sizeof(int));
+    for (i = 0; i < nfound; ++i) {
+        size_t id = kd_getnodeorigid(tree, ids[i]);
+        double dist0;
+
+        if (id >= n || found[id])
+            return 0;
+        found[id] = 1;
+        dist0 = distance(src, id, p);
+        if (fabs(dists[i] - dist0) > eps || fabs(dist0 - dists0[i]) > eps * 2.0)
+            return 0;
+        if (i > 0 && dists[i] < dists[i - 1])
+            return 0;
+    }
+
+    return 1;
+}
+
+/**
+ */
+int main(int argc, char* argv[])
+{
+    gridnodes* gn;
+    double** gx;
+    double** gy;
+    double* src[NDIM];
+    double min[NDIM], max[NDIM];
+    double extent;
+    int* found;
+    kdquery* q;
+    size_t ids[KMAX];
+    double dists[KMAX];
+    double dists0[KMAX];
+    size_t n, ii;
+    int nce1, nce2, i, j, t, r;
+    int nfailed = 0;
+
+    if (argc != 2) {
+        fprintf(stderr, "  Usage: testkd <cell corner grid file>\n");
+        exit(1);
+    }
+
+    gn = gridnodes_read(argv[1], NT_COR);
+    gridnodes_validate(gn);
+    nce1 = gridnodes_getnce1(gn);
+    nce2 = gridnodes_getnce2(gn);
+    gx = gridnodes_getx(gn);
+    gy = gridnodes_gety(gn);
+
+    /*
+     * tree nodes: the valid grid nodes
+     */
+    src[0] = malloc((size_t) (nce1 + 1) * (nce2 + 1) * sizeof(double));
+    src[1] = malloc((size_t) (nce1 + 1) * (nce2 + 1) * sizeof(double));
+    n = 0;
+    for (j = 0; j <= nce2; ++j) {
+        for (i = 0; i <= nce1; ++i) {
+            if (isnan(gx[j][i]))
+                continue;
+            src[0][n] = gx[j][i];
+            src[1][n] = gy[j][i];
+            n++;
+        }
+    }
+    if (n == 0) {
+        fprintf(stderr, "  error: %s: no valid nodes found\n", argv[1]);
+        exit(1);
+    }
+    for (i = 0; i < NDIM; ++i) {
+        min[i] = src[i][0];
+        max[i] = src[i][0];
+        for (ii = 1; ii < n; ++ii) {
+            if (src[i][ii] < min[i])
+                min[i] = src[i][ii];
+            if (src[i][ii] > max[i])
+                max[i] = src[i][ii];
+        }
+    }
+    extent = (max[0] - min[0] > max[1] - min[1]) ? max[0] - min[0] : max[1] - min[1];
+
+    found = malloc(n * sizeof(int));
+    q = kdquery_create();
+
+    for (t = 0; t < NTREETYPES; ++t) {
+        kdtree* tree = buildtree(t, n, src);
+        double eps = (t == TREE_COMPACT) ? extent * EPS_COMPACT : 0.0;
+        int nwrong = 0;
+        int nwrongk = 0;
+
+        /*
+         * query points: every QSTEP-th node and the same nodes shifted
+         * by a fraction of the grid extent
+         */
+        for (ii = 0; ii < n; ii += QSTEP) {
+            double p[NDIM];
+            int shift;
+
+            for (shift = 0; shift < 2; ++shift) {
+                p[0] = src[0][ii] + shift * extent * 0.0013;
+                p[1] = src[1][ii] - shift * extent * 0.0007;
+                for (r = 0; r < (int) (sizeof(ranges) / sizeof(double)); ++r) {
+                    double range = ranges[r] * extent;
+                    int ordered;
+
+                    for (ordered = 0; ordered < 2; ++ordered) {
+                        (void) kd_findnodeswithinrange2(tree, p, range, ordered, q);
+                        if (!checkrange(tree, q, ordered, n, src, p, range, eps, found))
+                            nwrong++;
+                    }
+                }
+                for (r = 0; r < (int) (sizeof(ks) / sizeof(size_t)); ++r) {
+                    size_t k = (ks[r] < n) ? ks[r] : n;
+                    size_t nfound = kd_findknearest(tree, p, k, ids, dists);
+
+                    findknearest(n, src, p, k, dists0);
+                    if (!checkknearest(tree, nfound, ids, dists, n, src, p, k, dists0, eps, found))
+                        nwrongk++;
+                }
+            }
+        }
+        if (nwrong > 0) {
+            fprintf(stderr, "  %s tree: %d range queries differ from brute force\n", treenames[t], nwrong);
+            nfailed++;
+        }
+        if (nwrongk > 0) {
+            fprintf(stderr, "  %s tree: %d k nearest node queries differ from brute force\n", treenames[t], nwrongk);
+            nfailed++;
+        }
+
+        kd_destroy(tree);
+    }
+
+    kdquery_destroy(q);
+    free(found);
+    free(src[0]);
+    free(src[1]);
+    gridnodes_destroy(gn);
+
+    return (nfailed > 0) ? 1 : 0;
+}
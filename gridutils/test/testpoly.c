@@ -0,0 +1,146 @@
+/******************************************************************************
+ *
+ *  File:           testpoly.c
+ *
+ *  Created         16/10/2026
+ *
+ *  Purpose:        Tests poly_containspoints() and the edge index of
+ *                  poly_containspoint() against the linear containment
+ *                  test, for a lattice of points over the polygon extent
+ *                  and for the polygon vertices and edge midpoints
+ *
+ *  Revisions:      none.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "gucommon.h"
+#include "poly.h"
+
+#define NLATTICE 200            /* number of lattice points per side */
+
+/** Counts points for which the results of two containment tests differ.
+ * @param n Number of points
+ * @param res Results of the test
+ * @param res0 Reference results
+ * @return Number of differing results
+ */
+static int ndiffer(int n, int* res, int* res0)
+{
+    int ndiff = 0;
+    int i;
+
+    for (i = 0; i < n; ++i)
+        if (res[i] != res0[i])
+            ndiff++;
+
+    return ndiff;
+}
+
+/**
+ */
+int main(int argc, char* argv[])
+{
+    poly* pl = poly_create();
+    FILE* f;
+    double* x;
+    double* y;
+    int* res0;
+    int* res;
+    double dx, dy;
+    int n, i, j, k;
+    int nfailed = 0;
+
+    if (argc != 2) {
+        fprintf(stderr, "  Usage: testpoly <polygon file>\n");
+        exit(1);
+    }
+
+    f = gu_fopen(argv[1], "r");
+    (void) poly_read(pl, f);
+    fclose(f);
+    if (pl->n < 2) {
+        fprintf(stderr, "  error: %s: no polygon found\n", argv[1]);
+        exit(1);
+    }
+
+    /*
+     * test points: a lattice over the slightly extended polygon extent,
+     * the vertices and the edge midpoints
+     */
+    n = NLATTICE * NLATTICE + pl->n * 2;
+    x = malloc(n * sizeof(double));
+    y = malloc(n * sizeof(double));
+    dx = (pl->e.xmax - pl->e.xmin) / (NLATTICE - 3);
+    dy = (pl->e.ymax - pl->e.ymin) / (NLATTICE - 3);
+    k = 0;
+    for (j = 0; j < NLATTICE; ++j) {
+        for (i = 0; i < NLATTICE; ++i) {
+            x[k] = pl->e.xmin + (i - 1) * dx;
+            y[k] = pl->e.ymin + (j - 1) * dy;
+            k++;
+        }
+    }
+    for (i = 0; i < pl->n; ++i) {
+        int i1 = (i + 1) % pl->n;
+
+        x[k] = pl->x[i];
+        y[k] = pl->y[i];
+        k++;
+        x[k] = (pl->x[i] + pl->x[i1]) / 2.0;
+        y[k] = (pl->y[i] + pl->y[i1]) / 2.0;
+        k++;
+    }
+
+    res0 = malloc(n * sizeof(int));
+    res = malloc(n * sizeof(int));
+
+    /*
+     * reference: the linear test (no index)
+     */
+    for (i = 0; i < n; ++i)
+        res0[i] = poly_containspoint2(pl->n, pl->x, pl->y, x[i], y[i]);
+
+    for (i = 0; i < n; ++i)
+        res[i] = poly_containspoint(pl, x[i], y[i]);
+    if ((k = ndiffer(n, res, res0)) > 0) {
+        fprintf(stderr, "  poly_containspoint(): %d of %d points differ\n", k, n);
+        nfailed++;
+    }
+
+    poly_containspoints(pl, n, x, y, res);
+    if ((k = ndiffer(n, res, res0)) > 0) {
+        fprintf(stderr, "  poly_containspoints(): %d of %d points differ\n", k, n);
+        nfailed++;
+    }
+    if (pl->index != NULL) {
+        fprintf(stderr, "  poly_containspoints(): the polygon has been modified\n");
+        nfailed++;
+    }
+
+    /*
+     * the same with the edge index built by the caller
+     */
+    poly_buildindex(pl);
+    for (i = 0; i < n; ++i)
+        res[i] = poly_containspoint(pl, x[i], y[i]);
+    if ((k = ndiffer(n, res, res0)) > 0) {
+        fprintf(stderr, "  poly_containspoint() with index: %d of %d points differ\n", k, n);
+        nfailed++;
+    }
+
+    poly_containspoints(pl, n, x, y, res);
+    if ((k = ndiffer(n, res, res0)) > 0) {
+        fprintf(stderr, "  poly_containspoints() with index: %d of %d points differ\n", k, n);
+        nfailed++;
+    }
+
+    free(res);
+    free(res0);
+    free(x);
+    free(y);
+    poly_destroy(pl);
+
+    return (nfailed > 0) ? 1 : 0;
+}
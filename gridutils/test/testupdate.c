@@ -0,0 +1,157 @@
+/******************************************************************************
+ *
+ *  File:           testupdate.c
+ *
+ *  Created         16/10/2026
+ *
+ *  Purpose:        Tests gridmap_update_region(): invalidates and then
+ *                  restores the grid nodes within a rectangle in index
+ *                  space, updates the grid maps and compares the results
+ *                  of mapping with those of maps built from scratch
+ *
+ *  Revisions:      none.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "gridnodes.h"
+#include "gridmap.h"
+#include "nan.h"
+
+#define NSUB 4                  /* number of test points per cell side */
+
+static int maptypes[] = { GRIDMAP_TYPE_BINARY, GRIDMAP_TYPE_KDTREE };
+
+/** Compares mapping of the test points by an updated grid map and by a map
+ * built from scratch.
+ * @param gm Updated grid map
+ * @param type Grid map type
+ * @param n Number of test points
+ * @param x X coordinates of the test points
+ * @param y Y coordinates of the test points
+ * @return Number of points mapped differently
+ */
+static int compare(gridmap* gm, int type, int n, double* x, double* y)
+{
+    gridmap* gm0 = gridmap_build(gridmap_getnce1(gm), gridmap_getnce2(gm), gridmap_getxnodes(gm), gridmap_getynodes(gm), type);
+    int ndiff = 0;
+    int ii;
+
+    for (ii = 0; ii < n; ++ii) {
+        double fi, fj, fi0, fj0;
+
+        (void) gridmap_xy2fij(gm, x[ii], y[ii], &fi, &fj);
+        (void) gridmap_xy2fij(gm0, x[ii], y[ii], &fi0, &fj0);
+        if ((isnan(fi) != isnan(fi0)) || (!isnan(fi) && (fi != fi0 || fj != fj0)))
+            ndiff++;
+    }
+    gridmap_destroy(gm0);
+
+    return ndiff;
+}
+
+/**
+ */
+int main(int argc, char* argv[])
+{
+    gridnodes* gn;
+    gridmap* gm;
+    double** gx;
+    double** gy;
+    double* x;
+    double* y;
+    double* xsaved;
+    double* ysaved;
+    int nce1, nce2, imin, imax, jmin, jmax, ni, n, t, i, j, k, l;
+    int nfailed = 0;
+
+    if (argc != 6) {
+        fprintf(stderr, "  Usage: testupdate <cell corner grid file> <imin> <imax> <jmin> <jmax>\n");
+        exit(1);
+    }
+
+    gn = gridnodes_read(argv[1], NT_COR);
+    gridnodes_validate(gn);
+    nce1 = gridnodes_getnce1(gn);
+    nce2 = gridnodes_getnce2(gn);
+    gx = gridnodes_getx(gn);
+    gy = gridnodes_gety(gn);
+    imin = atoi(argv[2]);
+    imax = atoi(argv[3]);
+    jmin = atoi(argv[4]);
+    jmax = atoi(argv[5]);
+    if (imin < 0 || imax > nce1 || imin > imax || jmin < 0 || jmax > nce2 || jmin > jmax) {
+        fprintf(stderr, "  error: rectangle [%d, %d] x [%d, %d] is not within the grid\n", imin, imax, jmin, jmax);
+        exit(1);
+    }
+    ni = imax - imin + 1;
+
+    /*
+     * test points: a regular pattern within each valid cell
+     */
+    x = malloc((size_t) nce1 * nce2 * NSUB * NSUB * sizeof(double));
+    y = malloc((size_t) nce1 * nce2 * NSUB * NSUB * sizeof(double));
+    n = 0;
+    for (j = 0; j < nce2; ++j) {
+        for (i = 0; i < nce1; ++i) {
+            if (isnan(gx[j][i] + gx[j][i + 1] + gx[j + 1][i] + gx[j + 1][i + 1]))
+                continue;
+            for (k = 0; k < NSUB; ++k) {
+                for (l = 0; l < NSUB; ++l) {
+                    double u = (k + 0.5) / NSUB;
+                    double v = (l + 0.5) / NSUB;
+
+                    x[n] = gx[j][i] * (1.0 - u) * (1.0 - v) + gx[j][i + 1] * u * (1.0 - v) + gx[j + 1][i] * (1.0 - u) * v + gx[j + 1][i + 1] * u * v;
+                    y[n] = gy[j][i] * (1.0 - u) * (1.0 - v) + gy[j][i + 1] * u * (1.0 - v) + gy[j + 1][i] * (1.0 - u) * v + gy[j + 1][i + 1] * u * v;
+                    n++;
+                }
+            }
+        }
+    }
+
+    xsaved = malloc((size_t) ni * (jmax - jmin + 1) * sizeof(double));
+    ysaved = malloc((size_t) ni * (jmax - jmin + 1) * sizeof(double));
+
+    for (t = 0; t < (int) (sizeof(maptypes) / sizeof(int)); ++t) {
+        gm = gridmap_build(nce1, nce2, gx, gy, maptypes[t]);
+
+        for (j = jmin; j <= jmax; ++j) {
+            memcpy(&xsaved[(j - jmin) * ni], &gx[j][imin], ni * sizeof(double));
+            memcpy(&ysaved[(j - jmin) * ni], &gy[j][imin], ni * sizeof(double));
+            for (i = imin; i <= imax; ++i) {
+                gx[j][i] = NaN;
+                gy[j][i] = NaN;
+            }
+        }
+        gridmap_update_region(gm, imin, imax, jmin, jmax);
+        k = compare(gm, maptypes[t], n, x, y);
+        if (k > 0) {
+            fprintf(stderr, "  map type %d: %d of %d points mapped differently after invalidating nodes\n", maptypes[t], k, n);
+            nfailed++;
+        }
+
+        for (j = jmin; j <= jmax; ++j) {
+            memcpy(&gx[j][imin], &xsaved[(j - jmin) * ni], ni * sizeof(double));
+            memcpy(&gy[j][imin], &ysaved[(j - jmin) * ni], ni * sizeof(double));
+        }
+        gridmap_update_region(gm, imin, imax, jmin, jmax);
+        k = compare(gm, maptypes[t], n, x, y);
+        if (k > 0) {
+            fprintf(stderr, "  map type %d: %d of %d points mapped differently after restoring nodes\n", maptypes[t], k, n);
+            nfailed++;
+        }
+
+        gridmap_destroy(gm);
+    }
+
+    free(xsaved);
+    free(ysaved);
+    free(x);
+    free(y);
+    gridnodes_destroy(gn);
+
+    return (nfailed > 0) ? 1 : 0;
+}
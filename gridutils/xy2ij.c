@@ -20,19 +20,47 @@
 #include <string.h>
 #include <math.h>
 #include <errno.h>
+#include <sys/stat.h>
 #include "guquit.h"
 #include "gridnodes.h"
 #include "gridmap.h"
 #include "gucommon.h"
 
 #define BUFSIZE 10240
+#define NCHUNK 65536            /* maximal number of input lines mapped
+                                 * together */
 
 static int reverse = 0;
 static int force = 0;
+static int walk = 0;
+static int order = 0;           /* GRIDMAP_BATCH_MORTON,
+                                 * GRIDMAP_BATCH_HILBERT or 0 */
+static int coeffs = 0;
+static char* indexfname = NULL;
 static NODETYPE nt = NT_DD;
 static int gridmaptype = GRIDMAP_TYPE_DEF;
 
-typedef int (*mapfn) (void*, double, double, double*, double*);
+static char* mapname[] = {
+    "binary tree",
+    "kd-tree",
+    "spatial hash",
+    "geographic kd-tree",
+    "raster"
+};
+
+typedef int (*mapfn) (gridmap*, int, double*, double*, int, double*, double*, int*);
+
+typedef struct {
+    int n;                      /* number of lines in the chunk */
+    int npoints;                /* number of point lines in the chunk */
+    char* lines[NCHUNK];        /* input lines */
+    char* rem[NCHUNK];          /* remainder of a point line (or NULL) */
+    double x[NCHUNK];
+    double y[NCHUNK];
+    double ic[NCHUNK];
+    double jc[NCHUNK];
+    int status[NCHUNK];
+} chunk;
 
 /**
  */
@@ -46,7 +74,7 @@ static void version()
  */
 static void usage()
 {
-    printf("  Usage: xy2ij [-i {DD|CO}] [-f] [-k] [-r] [-v] -g <grid file> -o <point file>\n");
+    printf("  Usage: xy2ij [-c] [-i {DD|CO}] [-f] [-k] [-m <map type>] [-M <index file>] [-r] [-s <order>] [-v] [-w] -g <grid file> -o <point file>\n");
     printf("  Run \"xy2ij -h\" for more information.\n");
 
     exit(0);
@@ -63,14 +91,37 @@ static void info()
     printf("    <point file> -- text file with coordinates to be converted (first two\n");
     printf("      columns used as point coordinates) (use \"stdin\" or \"-\" for standard input)\n");
     printf("  Options:\n");
+    printf("    -c -- precompute the bilinear mapping coefficients for all cells (faster\n");
+    printf("          for many points, takes about 80 bytes per cell; same results)\n");
     printf("    -f -- do not exit with error for points outside grid\n");
     printf("    -i <node type> -- input node type\n");
-    printf("    -k -- use kd-tree for mapping\n");
+    printf("    -k -- use kd-tree for mapping (same as \"-m kdtree\")\n");
+    printf("    -m <map type> -- algorithm used for mapping from physical to index space\n");
+    printf("    -M <index file> -- load the grid map from this file if it has been saved\n");
+    printf("          for the same grid, node type and map type; otherwise build the\n");
+    printf("          map and save it to this file; set GRIDMAP_VERIFY=1 in the\n");
+    printf("          environment to verify the checksum of the whole file on loading\n");
     printf("    -r -- make convertion from index to physical space\n");
+    printf("    -s <order> -- map points in the order along a space-filling curve, with\n");
+    printf("          results output in the original order (faster for large unordered\n");
+    printf("          input, e.g. satellite swaths); <order> is \"morton\" or \"hilbert\"\n");
     printf("    -v -- verbose / version\n");
+    printf("    -w -- start search for each point from the cell of the previous point\n");
+    printf("          (faster for spatially coherent input, e.g. tracks)\n");
+    printf("  Points read from a file are mapped in chunks of %d lines. Points read from\n", NCHUNK);
+    printf("  a pipe or terminal are mapped and output line by line, unless \"-s\" or \"-w\"\n");
+    printf("  is specified.\n");
     printf("  Node types:\n");
     printf("    DD -- double density nodes (default) \n");
     printf("    CO -- cell corner nodes\n");
+    printf("  Map types:\n");
+    printf("    binary -- spatial binary tree (default)\n");
+    printf("    kdtree -- kd-tree with grid nodes\n");
+    printf("    hash -- uniform spatial hash of grid cells\n");
+    printf("    kdgeo -- kd-tree with grid nodes on the sphere, for global grids with\n");
+    printf("          X and Y being longitude and latitude in degrees\n");
+    printf("    raster -- precomputed raster of grid cells (fastest for many points,\n");
+    printf("          takes a few hundred bytes per cell)\n");
     printf("  Description:\n");
     printf("    `xy2ij' reads grid nodes from a file. After that, it reads points from\n");
     printf("     standard input, converts them from (X,Y) to (I,J) space or vice versa,\n");
@@ -127,6 +178,10 @@ static void parse_commandline(int argc, char* argv[], char** gfname, char** ofna
                     gu_quit("input node type \"%s\" not recognised", argv[i]);
                 i++;
                 break;
+            case 'c':
+                i++;
+                coeffs = 1;
+                break;
             case 'f':
                 i++;
                 force = 1;
@@ -143,6 +198,31 @@ static void parse_commandline(int argc, char* argv[], char** gfname, char** ofna
                 gridmaptype = GRIDMAP_TYPE_KDTREE;
                 i++;
                 break;
+            case 'm':
+                i++;
+                if (i == argc)
+                    gu_quit("no map type found after \"-m\"");
+                if (strcasecmp("binary", argv[i]) == 0)
+                    gridmaptype = GRIDMAP_TYPE_BINARY;
+                else if (strcasecmp("kdtree", argv[i]) == 0)
+                    gridmaptype = GRIDMAP_TYPE_KDTREE;
+                else if (strcasecmp("hash", argv[i]) == 0)
+                    gridmaptype = GRIDMAP_TYPE_HASH;
+                else if (strcasecmp("kdgeo", argv[i]) == 0)
+                    gridmaptype = GRIDMAP_TYPE_KDTREEGEO;
+                else if (strcasecmp("raster", argv[i]) == 0)
+                    gridmaptype = GRIDMAP_TYPE_RASTER;
+                else
+                    gu_quit("map type \"%s\" not recognised", argv[i]);
+                i++;
+                break;
+            case 'M':
+                i++;
+                if (i == argc)
+                    gu_quit("no file name found after \"-M\"");
+                indexfname = argv[i];
+                i++;
+                break;
             case 'o':
                 i++;
                 *ofname = argv[i];
@@ -152,10 +232,26 @@ static void parse_commandline(int argc, char* argv[], char** gfname, char** ofna
                 i++;
                 reverse = 1;
                 break;
+            case 's':
+                i++;
+                if (i == argc)
+                    gu_quit("no order found after \"-s\"");
+                if (strcasecmp("morton", argv[i]) == 0)
+                    order = GRIDMAP_BATCH_MORTON;
+                else if (strcasecmp("hilbert", argv[i]) == 0)
+                    order = GRIDMAP_BATCH_HILBERT;
+                else
+                    gu_quit("order \"%s\" not recognised", argv[i]);
+                i++;
+                break;
             case 'v':
                 i++;
                 gu_verbose = 1;
                 break;
+            case 'w':
+                i++;
+                walk = 1;
+                break;
             default:
                 usage();
                 break;
@@ -170,6 +266,49 @@ static void parse_commandline(int argc, char* argv[], char** gfname, char** ofna
         usage();
 }
 
+/** Maps points from a chunk of input lines and writes the results to the
+ * standard output. The output is flushed if `flush' is set.
+ * @param fn Batch mapping function
+ * @param map Grid map
+ * @param c Chunk
+ * @param count Pointer to the total number of mappings
+ * @param count_success Pointer to the number of successful mappings
+ * @param flush Flag: flush the output
+ */
+static void chunk_process(mapfn fn, gridmap* map, chunk* c, int* count, int* count_success, int flush)
+{
+    int i, ii;
+
+    (void) fn(map, c->npoints, c->x, c->y, 1, c->ic, c->jc, c->status);
+
+    for (i = 0, ii = 0; i < c->n; ++i) {
+        if (c->rem[i] != NULL) {
+            if (c->status[ii]) {
+                if (!isnan(c->ic[ii])) {
+                    (*count_success)++;
+                    printf("%.15g %.15g %s\n", c->ic[ii], c->jc[ii], c->rem[i]);
+                } else
+                    printf("NaN NaN %s\n", c->rem[i]);
+            } else {
+                if (!force)
+                    gu_quit("could not convert (%.15g, %.15g) from %s to %s space", c->x[ii], c->y[ii], (reverse) ? "index" : "physical", (reverse) ? "physical" : "index");
+                else
+                    printf("NaN NaN %s\n", c->rem[i]);
+            }
+            ii++;
+            (*count)++;
+            if (gu_verbose && *count % 1000 == 0)
+                fprintf(stderr, ".");
+        } else
+            printf("%s", c->lines[i]);
+        free(c->lines[i]);
+    }
+    c->n = 0;
+    c->npoints = 0;
+    if (flush)
+        fflush(stdout);
+}
+
 /**
  */
 int main(int argc, char* argv[])
@@ -178,69 +317,110 @@ int main(int argc, char* argv[])
     char* ofname = NULL;
     FILE* of = NULL;
     gridnodes* gn = NULL;
-    void* map = NULL;
+    gridmap* map = NULL;
     mapfn fn = NULL;
+    chunk* c = NULL;
     char buf[BUFSIZE];
+    struct stat st;
+    int nchunk;
     int count, count_success;
+    uint64_t checksum = 0;
 
     parse_commandline(argc, argv, &gfname, &ofname);
-    if (nt == NT_DD) {
-        gridnodes* gndd = gridnodes_read(gfname, NT_DD);
-
-        gridnodes_validate(gndd);
-        gn = gridnodes_transform(gndd, NT_COR);
-        gridnodes_destroy(gndd);
-    } else {
-        gn = gridnodes_read(gfname, NT_COR);
-        gridnodes_validate(gn);
-    }
 
     /*
-     * build grid map 
+     * try to load grid map 
      */
-    if (gu_verbose)
-        fprintf(stderr, "## parsing the grid into %s...", (gridmaptype == GRIDMAP_TYPE_KDTREE) ? "kd-tree" : "binary tree");
-    map = gridmap_build(gridnodes_getnce1(gn), gridnodes_getnce2(gn), gridnodes_getx(gn), gridnodes_gety(gn), gridmaptype);
-    if (gu_verbose)
-        fprintf(stderr, "done\n");
+    if (indexfname != NULL) {
+        if (strcmp(gfname, "stdin") == 0 || strcmp(gfname, "-") == 0)
+            gu_quit("can not use grid map index file with the grid read from standard input");
+        checksum = gu_checksum(0, &nt, sizeof(nt));
+        checksum = gu_checksum(checksum, &gridmaptype, sizeof(gridmaptype));
+        checksum = gu_checksumfile(checksum, gfname);
+        map = gridmap_load(indexfname, checksum);
+        if (gu_verbose && map != NULL)
+            fprintf(stderr, "## loaded grid map from \"%s\"\n", indexfname);
+    }
+
+    if (map == NULL) {
+        if (nt == NT_DD) {
+            gridnodes* gndd = gridnodes_read(gfname, NT_DD);
+
+            gridnodes_validate(gndd);
+            gn = gridnodes_transform(gndd, NT_COR);
+            gridnodes_destroy(gndd);
+        } else {
+            gn = gridnodes_read(gfname, NT_COR);
+            gridnodes_validate(gn);
+        }
+
+        /*
+         * build grid map 
+         */
+        if (gu_verbose)
+            fprintf(stderr, "## parsing the grid into %s...", mapname[gridmaptype]);
+        map = gridmap_build(gridnodes_getnce1(gn), gridnodes_getnce2(gn), gridnodes_getx(gn), gridnodes_gety(gn), gridmaptype);
+        if (gu_verbose)
+            fprintf(stderr, "done\n");
+        if (indexfname != NULL) {
+            gridmap_save(map, indexfname, checksum);
+            if (gu_verbose)
+                fprintf(stderr, "## saved grid map to \"%s\"\n", indexfname);
+        }
+    }
+    gridmap_setbatchflags(map, ((walk) ? GRIDMAP_BATCH_WALK : 0) | order);
+    if (coeffs)
+        gridmap_buildcoeffs(map);
 
     if (strcmp(ofname, "stdin") == 0 || strcmp(ofname, "-") == 0)
         of = stdin;
     else
         of = gu_fopen(ofname, "r");
 
-    fn = (reverse) ? (mapfn) gridmap_fij2xy : (mapfn) gridmap_xy2fij;
+    fn = (reverse) ? gridmap_fij2xy_batch : gridmap_xy2fij_batch;
 
     /*
-     * read points to be mapped, do the mapping and write results to stdout 
+     * map points read from a pipe or terminal line by line, so that the
+     * results are available to the writer (e.g. a coprocess) before it
+     * sends the next point; ordering and walking need chunks
+     */
+    nchunk = NCHUNK;
+    if (!walk && !order && (fstat(fileno(of), &st) != 0 || !S_ISREG(st.st_mode)))
+        nchunk = 1;
+
+    /*
+     * read points to be mapped, do the mapping (in chunks) and write results
+     * to stdout 
      */
     if (gu_verbose)
         fprintf(stderr, "## mapping the points: ");
     count = 0;
     count_success = 0;
+    c = malloc(sizeof(chunk));
+    c->n = 0;
+    c->npoints = 0;
     while (fgets(buf, BUFSIZE, of) != NULL) {
-        char rem[BUFSIZE] = "";
-        double xc, yc, ic, jc;
-
-        if (sscanf(buf, "%lf %lf %[^\n]", &xc, &yc, rem) >= 2) {
-            if (fn(map, xc, yc, &ic, &jc)) {
-                if (!isnan(ic)) {
-                    count_success++;
-                    printf("%.15g %.15g %s\n", ic, jc, rem);
-                } else
-                    printf("NaN NaN %s\n", rem);
-            } else {
-                if (!force)
-                    gu_quit("could not convert (%.15g, %.15g) from %s to %s space", xc, yc, (reverse) ? "index" : "physical", (reverse) ? "physical" : "index");
-                else
-                    printf("NaN NaN %s\n", rem);
-            }
-            count++;
-            if (gu_verbose && count % 1000 == 0)
-                fprintf(stderr, ".");
-        } else
-            printf("%s", buf);
+        char* line = strdup(buf);
+        int pos = -1;
+
+        c->lines[c->n] = line;
+        c->rem[c->n] = NULL;
+        if (sscanf(line, "%lf %lf %n", &c->x[c->npoints], &c->y[c->npoints], &pos) == 2) {
+            char* rem = (pos >= 0) ? &line[pos] : &line[strlen(line)];
+            char* eol = strchr(rem, '\n');
+
+            if (eol != NULL)
+                *eol = 0;
+            c->rem[c->n] = rem;
+            c->npoints++;
+        }
+        c->n++;
+        if (c->n == nchunk)
+            chunk_process(fn, map, c, &count, &count_success, nchunk == 1);
     }
+    chunk_process(fn, map, c, &count, &count_success, 0);
+    free(c);
+
     if (gu_verbose) {
         fprintf(stderr, "\n");
         fprintf(stderr, "## total mappings: %d\n", count);
@@ -251,7 +431,8 @@ int main(int argc, char* argv[])
     if (of != stdin)
         fclose(of);
     gridmap_destroy(map);
-    gridnodes_destroy(gn);
+    if (gn != NULL)
+        gridnodes_destroy(gn);
 
     return 0;
 }